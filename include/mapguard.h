@@ -1,6 +1,8 @@
 /* MapGuard - Copyright Chris Rohlf - 2025 */
 #pragma once
+#ifndef _GNU_SOURCE
 #define _GNU_SOURCE
+#endif
 #include <assert.h>
 #include <dlfcn.h>
 #include <errno.h>
@@ -13,7 +15,11 @@
 #include <string.h>
 #include <stdarg.h>
 #include <sys/mman.h>
+#include <sys/param.h>
 #include <sys/syscall.h>
+#include <sys/uio.h>
+#include <signal.h>
+#include <time.h>
 
 #if THREAD_SUPPORT
 #include <pthread.h>
@@ -26,7 +32,9 @@
 #include <elf.h>
 #endif
 
-#include "../vector_t/vector.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define OK 0
 #define ERROR -1
@@ -77,6 +85,44 @@
 #define MG_USE_MAPPING_CACHE "MG_USE_MAPPING_CACHE"
 /* Enable telemetry via syslog */
 #define MG_ENABLE_SYSLOG "MG_ENABLE_SYSLOG"
+/* Place tracked anonymous mappings at random hint addresses */
+#define MG_RANDOMIZE_PLACEMENT "MG_RANDOMIZE_PLACEMENT"
+/* Install guard pages from a worker thread instead of in mmap */
+#define MG_ASYNC_GUARD_PAGES "MG_ASYNC_GUARD_PAGES"
+/* Path of a workload profile written at exit and loaded at startup */
+#define MG_PROFILE_PATH "MG_PROFILE_PATH"
+/* Probe kernel features and time backends at startup */
+#define MG_SELF_CALIBRATE "MG_SELF_CALIBRATE"
+/* Mapping cache index: vector, array, tree or auto (default) */
+#define MG_CACHE_BACKEND "MG_CACHE_BACKEND"
+/* Write a binary dump of the metadata here on fatal signals */
+#define MG_DUMP_PATH "MG_DUMP_PATH"
+/* Track protections of writable or executable fd backed mappings */
+#define MG_TRACK_FILE_MAPPINGS "MG_TRACK_FILE_MAPPINGS"
+/* Merge adjacent unguarded entries like the kernel merges VMAs */
+#define MG_COALESCE_MAPPINGS "MG_COALESCE_MAPPINGS"
+/* Keep poisoned pages that were never written out of core dumps */
+#define MG_DONTDUMP_POISONED "MG_DONTDUMP_POISONED"
+/* Carve metadata from huge page backed arenas */
+#define MG_METADATA_HUGE_PAGES "MG_METADATA_HUGE_PAGES"
+/* Pretend the machine has this many NUMA nodes, see mapguard_numa.c */
+#define MG_NUMA_SIMULATE_NODES "MG_NUMA_SIMULATE_NODES"
+/* Place predicted short and long lived mappings apart */
+#define MG_LIFETIME_PLACEMENT "MG_LIFETIME_PLACEMENT"
+/* Lifetime in mmap calls below which a mapping is short lived */
+#define MG_LIFETIME_THRESHOLD "MG_LIFETIME_THRESHOLD"
+/* Serve about 1 in N small heap allocations from a guarded pool */
+#define MG_SAMPLE_MALLOC_RATE "MG_SAMPLE_MALLOC_RATE"
+/* Slots in that pool, MG_SAMPLE_DEFAULT_SLOTS if unset */
+#define MG_SAMPLE_MALLOC_SLOTS "MG_SAMPLE_MALLOC_SLOTS"
+/* Count page faults, dTLB misses and context switches per thread */
+#define MG_PERF_COUNTERS "MG_PERF_COUNTERS"
+/* Tracked mappings checked against the kernel per second */
+#define MG_VERIFY_RATE "MG_VERIFY_RATE"
+/* Fix or evict entries that disagree with the kernel */
+#define MG_VERIFY_REPAIR "MG_VERIFY_REPAIR"
+/* Percent of one CPU the verifier thread may use */
+#define MG_VERIFY_BUDGET "MG_VERIFY_BUDGET"
 
 #define ENV_TO_INT(env, config) \
     if(env_to_int(env)) {       \
@@ -87,16 +133,25 @@
     if(g_mapguard_policy.panic_on_violation) { \
         abort();                               \
     }
-#define ROUND_UP_PAGE(N) ((N + g_page_size) & ~g_page_size)
-#define ROUND_DOWN_PAGE(N) (ROUND_UP_PAGE(N) - g_page_size)
+#define ROUND_UP_PAGE(N) (((N) + g_page_size - 1) & ~(g_page_size - 1))
+#define ROUND_DOWN_PAGE(N) ((N) & ~(g_page_size - 1))
 
 extern pthread_mutex_t _mg_mutex;
 
+/* Odd while a thread holds _mg_mutex. Lets snapshot readers
+ * copy metadata without the lock, see mapguard_snapshot.c */
+extern uint64_t _mg_seq;
+
 #if THREAD_SUPPORT
-#define LOCK_MG() \
-    pthread_mutex_lock(&_mg_mutex);
+#define MG_SEQ_BUMP() \
+    __atomic_fetch_add(&_mg_seq, 1, __ATOMIC_SEQ_CST);
+
+#define LOCK_MG()                    \
+    pthread_mutex_lock(&_mg_mutex); \
+    MG_SEQ_BUMP();
 
 #define UNLOCK_MG() \
+    MG_SEQ_BUMP();  \
     pthread_mutex_unlock(&_mg_mutex);
 #else
 #define LOCK_MG()
@@ -105,6 +160,254 @@ extern pthread_mutex_t _mg_mutex;
 
 #define MG_POISON_BYTE 0xde
 
+/* Guard page states for mapguard_cache_entry_t guarded_b/guarded_t.
+ * A pending guard page is reserved address space that has not been
+ * protected yet, see mapguard_async.c */
+#define MG_GUARD_NONE 0
+#define MG_GUARD_PENDING 1
+#define MG_GUARD_INSTALLED 2
+
+/* Maximum number of mappings waiting on the guard page worker */
+#define MG_ASYNC_GUARD_QUEUE_SIZE 1024
+/* Longest a guard page may stay pending before a hooked
+ * call installs it synchronously (1ms) */
+#define MG_ASYNC_GUARD_WINDOW_NS 1000000
+/* Queued mappings the worker guards per madvise batch */
+#define MG_ASYNC_GUARD_BATCH 32
+
+/* MG_PERF_COUNTERS events and the scopes they are attributed
+ * to, see mapguard_perf.c */
+#define MG_PERF_EVENT_PAGE_FAULTS 0
+#define MG_PERF_EVENT_DTLB_MISSES 1
+#define MG_PERF_EVENT_CONTEXT_SWITCHES 2
+#define MG_PERF_EVENT_COUNT 3
+#define MG_PERF_SCOPE_HOOKS 0
+#define MG_PERF_SCOPE_GUARD_PAGES 1
+#define MG_PERF_SCOPE_POISON 2
+#define MG_PERF_SCOPE_COUNT 3
+/* Shortest window over which whole threads are counted (100ms) */
+#define MG_PERF_WINDOW_NS 100000000
+
+/* Ranges submitted per process_madvise call, see mapguard_madvise.c */
+#define MG_MADVISE_BATCH_SIZE 64
+
+/* Mapping sizes are bucketed by log2, see mapguard_stats_t */
+#define MG_SIZE_CLASS_COUNT 48
+
+#define MG_PROFILE_MAGIC 0x4650474d /* "MGPF" */
+#define MG_PROFILE_VERSION 3
+/* vm.max_map_count if it can't be read. A loaded profile's peak
+ * is capped at twice the limit, the kernel can't map more */
+#define MG_DEFAULT_MAX_MAP_COUNT 65530
+/* Number of call sites saved in a profile */
+#define MG_PROFILE_CALL_SITES 16
+/* Size of the table used to find the hottest call sites */
+#define MG_CALL_SITE_TABLE_SIZE 256
+/* Slots probed per lookup in the call site and lifetime tables */
+#define MG_CALL_SITE_PROBE 8
+
+/* Optional kernel features, newer than most system headers */
+#ifndef MADV_GUARD_INSTALL
+#define MADV_GUARD_INSTALL 102
+#define MADV_GUARD_REMOVE 103
+#endif
+
+#ifndef __NR_mseal
+#define __NR_mseal 462
+#endif
+
+#ifndef __NR_process_madvise
+#define __NR_process_madvise 440
+#endif
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
+/* Refers to the calling process without an fd, Linux 6.15 */
+#ifndef PIDFD_SELF_THREAD_GROUP
+#define PIDFD_SELF_THREAD_GROUP -10001
+#endif
+
+#ifndef PROCMAP_QUERY
+#include <linux/ioctl.h>
+
+struct procmap_query {
+    uint64_t size;
+    uint64_t query_flags;
+    uint64_t query_addr;
+    uint64_t vma_start;
+    uint64_t vma_end;
+    uint64_t vma_flags;
+    uint64_t vma_page_size;
+    uint64_t vma_offset;
+    uint64_t inode;
+    uint32_t dev_major;
+    uint32_t dev_minor;
+    uint32_t vma_name_size;
+    uint32_t build_id_size;
+    uint64_t vma_name_addr;
+    uint64_t build_id_addr;
+};
+
+#define PROCMAP_QUERY _IOWR('f', 17, struct procmap_query)
+#define PROCMAP_QUERY_VMA_READABLE 0x01
+#define PROCMAP_QUERY_VMA_WRITABLE 0x02
+#define PROCMAP_QUERY_VMA_EXECUTABLE 0x04
+#define PROCMAP_QUERY_VMA_SHARED 0x08
+#define PROCMAP_QUERY_COVERING_OR_NEXT_VMA 0x10
+#define PROCMAP_QUERY_FILE_BACKED_VMA 0x20
+#endif
+
+/* Results of mapguard_probe_features() */
+#define MG_FEATURE_GUARD_INSTALL 0x1
+#define MG_FEATURE_PROCMAP_QUERY 0x2
+#define MG_FEATURE_MSEAL 0x4
+#define MG_FEATURE_RSEQ 0x8
+#define MG_FEATURE_PKEYS 0x10
+#define MG_FEATURE_PROCESS_MADVISE 0x20
+
+/* Guard page installation: mprotect(PROT_NONE) + MADV_DONTNEED,
+ * or a single MADV_GUARD_INSTALL which doesn't split the VMA */
+#define MG_GUARD_METHOD_MPROTECT 0
+#define MG_GUARD_METHOD_MADVISE 1
+#define MG_GUARD_METHOD_COUNT 2
+
+#define MG_POISON_METHOD_MEMSET 0
+#define MG_POISON_METHOD_STORE64 1
+#define MG_POISON_METHOD_REP_STOSB 2
+#define MG_POISON_METHOD_COUNT 3
+
+#define MG_LOCK_METHOD_MUTEX 0
+#define MG_LOCK_METHOD_ADAPTIVE 1
+#define MG_LOCK_METHOD_COUNT 2
+
+#define MG_CACHE_BACKEND_VECTOR 0
+#define MG_CACHE_BACKEND_ARRAY 1
+#define MG_CACHE_BACKEND_TREE 2
+#define MG_CACHE_BACKEND_COUNT 3
+
+/* Default entry count at which the auto cache backend
+ * promotes the sorted array to a tree */
+#define MG_CACHE_TREE_THRESHOLD 512
+
+/* The vector backend keeps entry pointers in chunks of this many
+ * slots, up to MG_CACHE_MAX_CHUNKS of them */
+#define MG_CACHE_CHUNK_SLOTS 512
+#define MG_CACHE_MAX_CHUNKS 4096
+
+/* Upper bound on the time spent in mapguard_calibrate (5ms) */
+#define MG_CALIBRATION_BUDGET_NS 5000000
+#define MG_CALIBRATION_ROUNDS 32
+#define MG_CALIBRATION_POISON_PAGES 16
+/* Lock and unlock pairs per thread when timing contended mutexes,
+ * and the stack of the contending thread */
+#define MG_CALIBRATION_LOCK_ROUNDS 2000
+#define MG_CALIBRATION_STACK_SIZE 0x10000
+/* Metadata directory geometry, 512 * 512 metadata pages is
+ * enough for more than 15 million entries with 4k pages */
+#define MG_METADATA_L1_SIZE 512
+#define MG_METADATA_L2_SIZE 512
+/* Bounds the number of entries per metadata page */
+#define MG_METADATA_BITMAP_WORDS 4
+
+/* What an fd backed mapping was made from, MG_FD_NONE for
+ * anonymous mappings, see mapguard_file.c */
+#define MG_FD_NONE 0
+#define MG_FD_REGULAR 1
+#define MG_FD_MEMFD 2
+#define MG_FD_DEVICE 3
+#define MG_FD_OTHER 4
+/* fds below this have their classification cached */
+#define MG_FD_CACHE_SIZE 4096
+
+/* Size and alignment of a MG_METADATA_HUGE_PAGES arena */
+#define MG_METADATA_ARENA_SIZE 0x200000
+#define MG_METADATA_MAX_ARENAS 1024
+
+/* NUMA nodes with their own metadata arena */
+#define MG_NUMA_MAX_NODES 8
+
+/* Optimistic snapshot attempts before taking _mg_mutex */
+#define MG_SNAPSHOT_RETRIES 16
+
+/* Binary dump format, see mapguard_dump.c */
+#define MG_DUMP_MAGIC 0x504d55444d47ULL /* "MGDUMP" */
+#define MG_DUMP_VERSION 2
+/* Marks an entry field that is not present in this build */
+#define MG_DUMP_NO_FIELD 0xffff
+/* No other thread could have been updating the metadata */
+#define MG_DUMP_FLAG_CONSISTENT 0x1
+
+/* Per allocation policy for mapguard_alloc(), independent
+ * of the MG_* environment variables */
+#define MG_ALLOC_GUARD_PAGES 0x1
+#define MG_ALLOC_POISON 0x2
+/* Refuse W+X and transitions between W and X */
+#define MG_ALLOC_PREVENT_WX 0x4
+/* Set on every entry made by mapguard_alloc() */
+#define MG_ALLOC_EXPLICIT 0x80
+
+/* Slot sizes of mapguard_secret_alloc(), see mapguard_secret.c */
+#define MG_SECRET_MIN_SLOT 16
+#define MG_SECRET_MAX_SLOT 1024
+#define MG_SECRET_BITMAP_WORDS 4
+#define MG_SECRET_MAX_CHUNKS 1024
+
+/* Guarded slots in the MG_SAMPLE_MALLOC_RATE pool */
+#define MG_SAMPLE_DEFAULT_SLOTS 512
+/* Static buffer for allocations made while the next malloc is
+ * being resolved, and the size of a sample pool fault report */
+#define MG_SAMPLE_BOOTSTRAP_SIZE 0x2000
+#define MG_SAMPLE_REPORT_SIZE 256
+
+/* The verifier wakes up this often, see mapguard_verify.c */
+#define MG_VERIFY_TICK_NS 100000000
+#define MG_VERIFY_DEFAULT_BUDGET 1
+/* Bytes of /proc/self/maps read at a time without PROCMAP_QUERY */
+#define MG_VERIFY_MAPS_BUFFER 4096
+/* Initial capacity of the VMAs read from /proc/self/maps, and how
+ * often they are read again before giving up and reading them
+ * with _mg_mutex held */
+#define MG_VERIFY_MAPS_VMAS 4096
+#define MG_VERIFY_MAPS_RETRIES 4
+/* Random metadata pages tried when picking an entry to verify */
+#define MG_VERIFY_PICK_RETRIES 8
+
+/* Preferred address and size of the window the fake kernel
+ * hands out mappings from, and the size of the chunks its VMA
+ * nodes are allocated from */
+#define MG_FAKE_KERNEL_BASE 0x200000000000
+#define MG_FAKE_KERNEL_SIZE 0x40000000000
+#define MG_FAKE_KERNEL_CHUNK_SIZE 0x100000
+
+/* Largest synthetic cache used to find the array to tree crossover */
+#define MG_CALIBRATION_CACHE_ENTRIES 4096
+
+/* Number of random hint addresses tried for a mapping
+ * before we let the kernel choose one */
+#define MG_PLACEMENT_RETRIES 8
+
+/* Predicted lifetime of a mapping, see mapguard_lifetime.c */
+#define MG_LIFETIME_NONE 0
+#define MG_LIFETIME_SHORT 1
+#define MG_LIFETIME_LONG 2
+#define MG_LIFETIME_CLASSES 3
+#define MG_LIFETIME_TABLE_SIZE 1024
+#define MG_LIFETIME_DEFAULT_THRESHOLD 1024
+/* Address space window used for each class */
+#define MG_LIFETIME_REGION_SIZE 0x1000000000ULL
+
+/* Random hints are drawn from [4GB, 64TB) */
+#define MG_RAND_HINT_MASK 0x3FFFFFFFF000
+#define MG_RAND_HINT_MIN 0x100000000
+
+#define MG_CHACHA_BLOCK_SIZE 64
+/* Bytes of keystream generated per refill */
+#define MG_RAND_BUFFER_SIZE (MG_CHACHA_BLOCK_SIZE * 8)
+/* Bytes of keystream generated before reseeding from getrandom */
+#define MG_RAND_RESEED_BYTES (1 << 20)
+
 typedef struct {
     uint8_t prevent_rwx;
     uint8_t prevent_transition_to_x;
@@ -115,49 +418,500 @@ typedef struct {
     uint8_t poison_on_allocation;
     uint8_t use_mapping_cache;
     uint8_t enable_syslog;
+    uint8_t randomize_placement;
+    uint8_t async_guard_pages;
+    uint8_t self_calibrate;
+    uint8_t track_file_mappings;
+    uint8_t coalesce_mappings;
+    uint8_t dontdump_poisoned;
+    uint8_t lifetime_placement;
+    uint8_t perf_counters;
 } mapguard_policy_t;
 
+/* Results of MG_SELF_CALIBRATE. Timings are nanoseconds per
+ * operation, UINT64_MAX when a candidate isn't available */
+typedef struct {
+    uint32_t features;
+    uint8_t guard_method;
+    uint8_t poison_method;
+    uint8_t lock_method;
+    uint64_t guard_ns[MG_GUARD_METHOD_COUNT];
+    uint64_t poison_ns[MG_POISON_METHOD_COUNT];
+    /* Lock and unlock of each mutex type contended by two threads */
+    uint64_t lock_ns[MG_LOCK_METHOD_COUNT];
+    /* Per operation cost of the cache backends on a lookup,
+     * remove and insert trace at cache_entries entries, and the
+     * auto promotion threshold derived from it */
+    uint64_t cache_ns[MG_CACHE_BACKEND_COUNT];
+    uint64_t cache_entries;
+    uint64_t cache_tree_threshold;
+    uint64_t calibration_ns;
+} mapguard_calibration_t;
+
+/* Runtime counters, read them with mapguard_get_stats() */
+typedef struct {
+    /* Mappings currently waiting on the guard page worker */
+    uint64_t guard_queue_depth;
+    uint64_t guard_queue_max_depth;
+    /* Guard pages installed by the worker */
+    uint64_t guard_installs_async;
+    /* Guard pages installed by a hooked call because the queue
+     * was full, the window expired or the worker wasn't running */
+    uint64_t guard_installs_sync;
+    /* Pending guard pages cancelled by munmap */
+    uint64_t guard_cancels;
+    /* Time between queueing and installing guard pages */
+    uint64_t guard_window_ns_total;
+    uint64_t guard_window_ns_max;
+    /* Mappings currently in the mapping cache */
+    uint64_t tracked_mappings;
+    uint64_t tracked_mappings_peak;
+    uint64_t mmap_calls;
+    uint64_t mremap_calls;
+    /* fd backed mappings tracked with MG_TRACK_FILE_MAPPINGS
+     * and the fstat calls made to classify their fds */
+    uint64_t file_mappings;
+    uint64_t fd_classifications;
+    /* Tracked mmap calls by log2 of the page rounded size */
+    uint64_t size_classes[MG_SIZE_CLASS_COUNT];
+    /* MG_CACHE_BACKEND_* currently indexing the mapping cache */
+    uint64_t cache_backend;
+    uint64_t cache_promotions;
+    /* Entries merged away and split off by MG_COALESCE_MAPPINGS */
+    uint64_t coalesced_entries;
+    uint64_t coalesce_splits;
+    /* Secret slots in use, the chunks they were carved from
+     * and chunks that could not be mlocked */
+    uint64_t secret_slots;
+    uint64_t secret_chunks;
+    uint64_t secret_mlock_failures;
+    /* MG_SAMPLE_MALLOC_RATE allocations, frees and allocations
+     * that fell back to glibc because every slot was in use.
+     * Protected by the sample pool lock */
+    uint64_t sampled_allocations;
+    uint64_t sampled_frees;
+    uint64_t sample_pool_exhausted;
+    /* Bytes currently marked MADV_DONTDUMP by mapguard and the
+     * poisoned bytes excluded by MG_DONTDUMP_POISONED on a crash */
+    uint64_t dontdump_bytes;
+    uint64_t dontdump_poisoned_bytes;
+    /* MG_LIFETIME_PLACEMENT mappings whose death was scored, how
+     * many were predicted right and how many the kernel placed */
+    uint64_t lifetime_predictions;
+    uint64_t lifetime_correct;
+    uint64_t lifetime_fallbacks;
+    /* process_madvise calls made and the ranges they covered
+     * instead of one madvise each */
+    uint64_t madvise_batches;
+    uint64_t madvise_batched_ranges;
+    /* MG_PERF_COUNTERS events counted inside each MG_PERF_SCOPE_*,
+     * and over whole windows of every thread that used a hook.
+     * perf_events is a mask of the MG_PERF_EVENT_* that could be
+     * opened, the others stay 0 */
+    uint64_t perf_scope_counts[MG_PERF_SCOPE_COUNT][MG_PERF_EVENT_COUNT];
+    uint64_t perf_window_counts[MG_PERF_EVENT_COUNT];
+    uint64_t perf_windows;
+    uint64_t perf_threads;
+    uint64_t perf_events;
+    /* Metadata pages in the directory, in total and per node */
+    uint64_t metadata_pages;
+    uint64_t metadata_node_pages[MG_NUMA_MAX_NODES];
+    /* MG_METADATA_HUGE_PAGES arenas and how many are hugetlb */
+    uint64_t metadata_arenas;
+    uint64_t metadata_arenas_hugetlb;
+    /* mapguard_snapshot() calls, attempts that raced with a
+     * writer and snapshots that fell back to taking the lock */
+    uint64_t snapshots;
+    uint64_t snapshot_retries;
+    uint64_t snapshot_locked;
+    uint64_t snapshot_ns_total;
+    uint64_t snapshot_ns_max;
+    /* Entries checked against the kernel by the verifier, and
+     * the drift it found: entries whose mapping is gone, only
+     * partly mapped, has none of the recorded protections or
+     * lost a guard page */
+    uint64_t verify_samples;
+    uint64_t verify_missing;
+    uint64_t verify_truncated;
+    uint64_t verify_prot;
+    uint64_t verify_guard;
+    /* Drifted entries fixed or evicted with MG_VERIFY_REPAIR */
+    uint64_t verify_repairs;
+    /* Ticks skipped because the CPU budget was spent */
+    uint64_t verify_throttled;
+    uint64_t verify_cpu_ns;
+    mapguard_calibration_t calibration;
+} mapguard_stats_t;
+
+typedef struct {
+    /* FNV-1a hash of the path of the object containing the call site */
+    uint64_t module_hash;
+    /* Offset of the call site from the object base */
+    uint64_t offset;
+    uint64_t count;
+} mapguard_call_site_t;
+
+/* On disk workload profile, see mapguard_profile.c */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t page_size;
+    uint64_t peak_tracked;
+    uint64_t mmap_calls;
+    uint64_t mremap_calls;
+    uint64_t size_classes[MG_SIZE_CLASS_COUNT];
+    uint32_t call_site_count;
+    mapguard_call_site_t call_sites[MG_PROFILE_CALL_SITES];
+} mapguard_profile_t;
+
 extern size_t g_page_size;
 
+/* Header of a metadata page, the page holds
+ * [mapguard_cache_metadata_t ... mapguard_cache_entry_t ... n] */
 typedef struct {
-    void *next; /* Points to the page of [mapguard_cache_metadata_t ... mapguard_cache_entry_t ... n] */
-    bool full;
+    /* Position of this page in g_metadata_directory */
+    uint32_t index;
+    /* NUMA node whose arena this page belongs to */
+    uint32_t node;
     uint32_t total;
     uint32_t free;
+    /* Set bits are free entries */
+    uint64_t free_map[MG_METADATA_BITMAP_WORDS];
 } mapguard_cache_metadata_t;
 
-/* TODO - This structure is not thread safe */
+/* Second level of the metadata directory */
+typedef struct {
+    mapguard_cache_metadata_t *pages[MG_METADATA_L2_SIZE];
+    /* Per node, set bits are pages with at least one free entry */
+    uint64_t nonfull[MG_NUMA_MAX_NODES][MG_METADATA_L2_SIZE / 64];
+} mapguard_metadata_l2_t;
+
+/* Every metadata page is reachable through the directory and
+ * the nonfull summaries find a page with a free entry by
+ * scanning a few words at each level */
 typedef struct {
+    mapguard_metadata_l2_t *l2[MG_METADATA_L1_SIZE];
+    /* Per node, set bits are L2 tables with at least one nonfull page */
+    uint64_t nonfull[MG_NUMA_MAX_NODES][MG_METADATA_L1_SIZE / 64];
+    uint32_t page_count;
+    /* Free entries across all pages and in each node's pages */
+    size_t free;
+    size_t node_free[MG_NUMA_MAX_NODES];
+} mapguard_metadata_directory_t;
+
+/* TODO - This structure is not thread safe */
+typedef struct mapguard_cache_entry {
     void *start;
     /* Tracks which entry this is, uint16_t because pages could be 16k */
     uint16_t idx;
     size_t size;
-    bool guarded_b;
-    bool guarded_t;
+    /* MG_GUARD_NONE, MG_GUARD_PENDING or MG_GUARD_INSTALLED */
+    uint8_t guarded_b;
+    uint8_t guarded_t;
+    /* MG_ALLOC_* flags of mappings made by mapguard_alloc() */
+    uint8_t alloc_flags;
+    /* MG_FD_* type of the file behind this mapping. These
+     * entries only record protections, they have no guards */
+    uint8_t fd_type;
     int32_t immutable_prot;
     int32_t current_prot;
     int32_t cache_index;
+    /* MG_LIFETIME_PLACEMENT call site and size key, 0 if none,
+     * the mmap call count at birth and the predicted class */
+    uint32_t lifetime_key;
+    uint32_t lifetime_birth;
+    uint8_t lifetime_class;
+    /* Links for the tree cache backend */
+    struct mapguard_cache_entry *tree_left;
+    struct mapguard_cache_entry *tree_right;
+    uint32_t tree_priority;
 #if MPK_SUPPORT
     int32_t xom_enabled;
+    /* RWX code written only through mapguard_jit_write_begin() */
+    int32_t jit_enabled;
     int32_t pkey_access_rights;
     int32_t pkey;
 #endif
 } mapguard_cache_entry_t;
 
+/* Written at the start of a dump, followed by page_count
+ * uint64_t metadata page addresses and then the raw metadata
+ * pages themselves. Entry fields are described by their offsets
+ * so the decoder doesn't depend on the layout of its own build */
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t page_size;
+    uint32_t page_count;
+    uint32_t entries_per_page;
+    uint32_t metadata_header_size;
+    uint32_t entry_size;
+    /* Signal that triggered the dump, 0 when requested */
+    int32_t signal;
+    int32_t pid;
+    /* _mg_seq at the time of the dump */
+    uint64_t sequence;
+    uint64_t tracked_mappings;
+    uint16_t start_offset;
+    uint16_t size_offset;
+    uint16_t guarded_b_offset;
+    uint16_t guarded_t_offset;
+    uint16_t immutable_prot_offset;
+    uint16_t current_prot_offset;
+    uint16_t xom_enabled_offset;
+    uint16_t pkey_offset;
+    uint16_t pkey_access_rights_offset;
+    uint16_t jit_enabled_offset;
+    uint16_t alloc_flags_offset;
+    uint16_t fd_type_offset;
+    uint16_t lifetime_key_offset;
+    uint16_t lifetime_birth_offset;
+    uint16_t lifetime_class_offset;
+    /* MG_DUMP_FLAG_* */
+    uint16_t flags;
+    uint16_t reserved[2];
+} mapguard_dump_header_t;
+
+/* A tracked mapping as seen by mapguard_snapshot() */
+typedef struct {
+    void *start;
+    size_t size;
+    int32_t immutable_prot;
+    int32_t current_prot;
+    uint8_t guarded_b;
+    uint8_t guarded_t;
+    /* MG_FD_* */
+    uint8_t fd_type;
+} mapguard_mapping_t;
+
+typedef struct {
+    /* In metadata order, not sorted by address */
+    mapguard_mapping_t *mappings;
+    size_t count;
+    /* Size of the allocation holding this snapshot */
+    size_t length;
+    /* Value of _mg_seq the copy was validated against */
+    uint64_t sequence;
+    uint64_t snapshot_ns;
+    uint32_t retries;
+    /* True if the copy was taken under _mg_mutex */
+    bool locked;
+} mapguard_snapshot_t;
+
+/* One MG_LIFETIME_PLACEMENT window. low and high bound the live
+ * mappings in it, guard pages included, so 1 - live_bytes /
+ * span_bytes is how fragmented it is */
+typedef struct {
+    void *base;
+    void *low;
+    void *high;
+    uint64_t mappings;
+    uint64_t live_bytes;
+    uint64_t span_bytes;
+} mapguard_placement_region_t;
+
+typedef struct {
+    uint64_t predictions;
+    uint64_t correct;
+    uint64_t fallbacks;
+    /* Process wide, from /proc/self */
+    uint64_t vmas;
+    uint64_t page_table_bytes;
+    /* Indexed by MG_LIFETIME_SHORT and MG_LIFETIME_LONG */
+    mapguard_placement_region_t regions[MG_LIFETIME_CLASSES];
+} mapguard_placement_report_t;
+
+typedef void *(mapguard_mapping_callback_t)(mapguard_mapping_t *mapping, void *data);
+
+/* Per-thread buffered ChaCha20 state, see mapguard_rand.c */
+typedef struct {
+    uint32_t key[8];
+    uint8_t buffer[MG_RAND_BUFFER_SIZE];
+    uint32_t position;
+    uint64_t generated;
+    uint64_t generation;
+} mapguard_rand_state_t;
+
 inline __attribute__((always_inline)) void *get_base_page(void *addr) {
     return (void *) ((uintptr_t) addr & ~(g_page_size - 1));
 }
 
-mapguard_cache_metadata_t *new_mce_page();
+inline __attribute__((always_inline)) uint64_t get_monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/* The memory management syscalls made on behalf of tracked
+ * mappings, see mapguard_syscalls.c. Metadata is always
+ * allocated through the real kernel */
+typedef struct {
+    const char *name;
+    /* False when mappings are not backed by memory and
+     * must never be read or written, i.e. the fake kernel */
+    bool backed;
+    void *(*mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+    int (*munmap)(void *addr, size_t length);
+    int (*mprotect)(void *addr, size_t len, int prot);
+    void *(*mremap)(void *addr, size_t old_len, size_t new_len, int flags, void *new_address);
+    int (*madvise)(void *addr, size_t length, int advice);
+} mapguard_syscalls_t;
+
+extern const mapguard_syscalls_t *g_mg_syscalls;
+extern const mapguard_syscalls_t g_mg_real_syscalls;
+extern const mapguard_syscalls_t g_mg_fake_syscalls;
+
+/* Counter values at the start of a MG_PERF_COUNTERS scope */
+typedef struct {
+    bool valid;
+    uint64_t values[MG_PERF_EVENT_COUNT];
+} mapguard_perf_sample_t;
+
+/* Ranges waiting for the same advice, see mapguard_madvise.c */
+typedef struct {
+    int advice;
+    uint32_t count;
+    struct iovec iov[MG_MADVISE_BATCH_SIZE];
+} mapguard_madvise_batch_t;
+
+typedef void *(mapguard_cache_callback_t)(void *mce, void *data);
+
+struct mapguard_cache;
+
+/* A mapping cache backend, see mapguard_cache.c */
+typedef struct {
+    int32_t id;
+    const char *name;
+    void (*init)(struct mapguard_cache *cache);
+    void (*destroy)(struct mapguard_cache *cache);
+    void (*insert)(struct mapguard_cache *cache, mapguard_cache_entry_t *mce);
+    void (*remove)(struct mapguard_cache *cache, mapguard_cache_entry_t *mce);
+    mapguard_cache_entry_t *(*lookup)(struct mapguard_cache *cache, void *addr);
+    /* The entry with the lowest start at or above addr */
+    mapguard_cache_entry_t *(*next)(struct mapguard_cache *cache, void *addr);
+    void *(*for_each)(struct mapguard_cache *cache, mapguard_cache_callback_t *cb, void *data);
+} mapguard_cache_ops_t;
+
+typedef struct mapguard_cache {
+    const mapguard_cache_ops_t *ops;
+    size_t count;
+    /* Promote the array backend to a tree as it grows */
+    bool auto_promote;
+    /* vector backend. Chunks never move so an entry's cache_index
+     * stays valid until it is removed. Slots below slots_used hold
+     * an entry or, with the low bit set, the next free slot */
+    mapguard_cache_entry_t ***chunks;
+    size_t slots_used;
+    /* Most recently freed slot plus one, 0 if there is none */
+    size_t free_slot;
+    /* array backend */
+    mapguard_cache_entry_t **array;
+    size_t array_capacity;
+    /* tree backend */
+    mapguard_cache_entry_t *root;
+} mapguard_cache_t;
+
+extern mapguard_cache_t g_map_cache;
+extern const mapguard_cache_ops_t g_cache_backends[MG_CACHE_BACKEND_COUNT];
+
+const mapguard_cache_ops_t *mapguard_cache_backend(const char *name);
+void mapguard_cache_init(mapguard_cache_t *cache, const mapguard_cache_ops_t *ops);
+void mapguard_cache_destroy(mapguard_cache_t *cache);
+void mapguard_cache_set_backend(mapguard_cache_t *cache, const mapguard_cache_ops_t *ops);
+void mapguard_cache_reserve(mapguard_cache_t *cache, size_t count);
+void mapguard_cache_insert(mapguard_cache_t *cache, mapguard_cache_entry_t *mce);
+void mapguard_cache_remove(mapguard_cache_t *cache, mapguard_cache_entry_t *mce);
+mapguard_cache_entry_t *mapguard_cache_lookup(mapguard_cache_t *cache, void *addr);
+mapguard_cache_entry_t *mapguard_cache_next(mapguard_cache_t *cache, void *addr);
+void *mapguard_cache_for_each(mapguard_cache_t *cache, mapguard_cache_callback_t *cb, void *data);
+void mapguard_cache_rekey(mapguard_cache_t *cache, mapguard_cache_entry_t *mce, void *start);
+void cache_backend_init(void);
+
+extern mapguard_metadata_directory_t g_metadata_directory;
+
+void metadata_init(void);
+void metadata_destroy(void);
+mapguard_cache_metadata_t *metadata_page_at(uint32_t index);
+mapguard_cache_metadata_t *new_mce_page(uint32_t node);
 mapguard_cache_entry_t *find_free_mce();
+void free_mce(mapguard_cache_entry_t *mce);
+void mce_reserve(size_t count);
 mapguard_cache_entry_t *get_cache_entry(void *addr);
 void *is_mapguard_entry_cached(void *p, void *data);
-void vector_pointer_free(void *p);
 int32_t env_to_int(char *string);
+void rand_init(void);
 uint64_t rand_uint64(void);
+void *rand_page_address(void);
 void mark_guard_page(void *p);
 void *allocate_guard_page(void *p);
 void make_guard_page(void *p);
+void install_guard_page(const mapguard_syscalls_t *sys, void *p);
+void install_guard_pages(const mapguard_syscalls_t *sys, void **pages, size_t count);
+void *map_randomized(size_t length, int prot, int flags);
+void map_bottom_guard_page(mapguard_cache_entry_t *mce);
+void map_top_guard_page(mapguard_cache_entry_t *mce);
+void mark_guard_pages(mapguard_cache_entry_t *mce);
+void unmap_guard_pages(mapguard_cache_entry_t *mce);
+void mapguard_get_stats(mapguard_stats_t *stats);
+void async_guard_init(void);
+void start_guard_worker(void);
+void stop_guard_worker(void);
+void guard_queue_push(mapguard_cache_entry_t *mce);
+void guard_queue_drain(void);
+void install_pending_guards(mapguard_cache_entry_t *mce);
+void profile_load(void);
+void profile_save(void);
+void profile_record_call_site(void *addr);
+void dump_init(void);
+void *map_file(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+uint8_t fd_classify(int fd);
+void unmap_file_range(mapguard_cache_entry_t *mce, void *addr, size_t length);
+bool mce_coalescable(mapguard_cache_entry_t *mce);
+mapguard_cache_entry_t *mce_coalesce(mapguard_cache_entry_t *mce);
+mapguard_cache_entry_t *mce_isolate(mapguard_cache_entry_t *mce, void *addr, size_t length);
+void mce_unmap_range(void *addr, size_t length);
+void numa_init(void);
+uint32_t numa_current_node(void);
+void numa_bind(void *p, size_t length, uint32_t node);
+void verify_init(void);
+void start_verifier(void);
+void stop_verifier(void);
+void sample_init(void);
+void madvise_init(void);
+void perf_init(void);
+bool perf_read(uint64_t values[MG_PERF_EVENT_COUNT]);
+void perf_begin(mapguard_perf_sample_t *sample);
+void perf_end(mapguard_perf_sample_t *sample, uint32_t scope);
+bool madvise_batch_available(void);
+size_t madvise_vector(const mapguard_syscalls_t *sys, struct iovec *iov, size_t count, int advice);
+void madvise_batch_add(const mapguard_syscalls_t *sys, mapguard_madvise_batch_t *batch, void *p, size_t length);
+void madvise_batch_flush(const mapguard_syscalls_t *sys, mapguard_madvise_batch_t *batch);
+void exclude_from_core(void *p, size_t length);
+void include_in_core(void *p, size_t length);
+void slim_core_dump(void);
+uint64_t mapguard_dump_savings(void);
+void *map_by_lifetime(size_t length, int prot, int flags, void *call_site, uint32_t *key, uint8_t *lifetime_class);
+void lifetime_track(mapguard_cache_entry_t *mce, uint32_t key, uint8_t lifetime_class);
+void lifetime_record_death(mapguard_cache_entry_t *mce);
+void mapguard_placement_report(mapguard_placement_report_t *report);
+size_t mapguard_verify(size_t count);
+void *mapguard_alloc(size_t size, int prot, uint32_t flags);
+int32_t mapguard_free(void *p);
+int32_t mapguard_protect(void *p, int prot);
+void *mapguard_secret_alloc(size_t size);
+void mapguard_secret_free(void *p);
+int32_t mapguard_dump(const char *path);
+int32_t mapguard_dump_fd(int fd);
+mapguard_snapshot_t *mapguard_snapshot(void);
+void mapguard_snapshot_free(mapguard_snapshot_t *snapshot);
+void *mapguard_for_each_mapping(mapguard_mapping_callback_t *cb, void *data);
+void mapguard_fake_kernel_enable(void);
+void mapguard_fake_kernel_disable(void);
+size_t mapguard_fake_kernel_vma_count(void);
+uint32_t mapguard_probe_features(void);
+void mapguard_calibrate(void);
+void poison_pages(void *p, size_t length);
 
 #if MPK_SUPPORT
 void *memcpy_xom(size_t allocation_size, void *src, size_t src_size);
@@ -168,5 +922,15 @@ int32_t protect_segments();
 int32_t unprotect_segments();
 int32_t protect_code();
 int32_t unprotect_code();
+int32_t mapguard_secret_protect(void);
+int32_t mapguard_secret_unprotect(void);
+void *mapguard_jit_alloc(size_t size);
+int32_t mapguard_jit_free(void *p);
+int32_t mapguard_jit_write_begin(void);
+int32_t mapguard_jit_write_end(void);
 uint64_t rand_uint64(void);
 #endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,242 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+#pragma once
+
+/* C++ interface to mapguard_alloc()
+ *
+ * mg::guarded_buffer<Policy> owns one guarded allocation and
+ * mg::guarded_resource<Policy> is a std::pmr::memory_resource that
+ * pools them by size class. The policy is a compile time parameter,
+ * checks it disables are discarded with if constexpr and a W+X
+ * protection can be rejected at compile time with protect<Prot>().
+ * Both call into libmapguard directly so the process doesn't need
+ * any of the MG_* environment variables set. Requires C++17 */
+
+#include "mapguard.h"
+
+#include <cstring>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace mg {
+
+template <bool GuardPages, bool Poison, bool PreventWX>
+struct policy {
+    static constexpr bool guard_pages = GuardPages;
+    static constexpr bool poison = Poison;
+    static constexpr bool prevent_wx = PreventWX;
+    static constexpr uint32_t flags = (GuardPages ? MG_ALLOC_GUARD_PAGES : 0) | (Poison ? MG_ALLOC_POISON : 0) |
+                                      (PreventWX ? MG_ALLOC_PREVENT_WX : 0);
+};
+
+using default_policy = policy<true, true, true>;
+using guard_only_policy = policy<true, false, false>;
+
+template <int Prot>
+constexpr bool is_wx = (Prot & PROT_WRITE) && (Prot & PROT_EXEC);
+
+template <typename Policy = default_policy>
+class guarded_buffer {
+  public:
+    guarded_buffer() noexcept = default;
+
+    /* Throws std::bad_alloc if the allocation fails */
+    explicit guarded_buffer(size_t size, int prot = PROT_READ | PROT_WRITE) : size_(size) {
+        data_ = mapguard_alloc(size, prot, Policy::flags);
+
+        if(data_ == nullptr) {
+            throw std::bad_alloc();
+        }
+    }
+
+    guarded_buffer(const guarded_buffer &) = delete;
+    guarded_buffer &operator=(const guarded_buffer &) = delete;
+
+    guarded_buffer(guarded_buffer &&other) noexcept
+        : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {
+    }
+
+    guarded_buffer &operator=(guarded_buffer &&other) noexcept {
+        if(this != &other) {
+            reset();
+            data_ = std::exchange(other.data_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+        }
+
+        return *this;
+    }
+
+    ~guarded_buffer() {
+        reset();
+    }
+
+    void *data() const noexcept {
+        return data_;
+    }
+
+    template <typename T>
+    T *as() const noexcept {
+        return static_cast<T *>(data_);
+    }
+
+    size_t size() const noexcept {
+        return size_;
+    }
+
+    explicit operator bool() const noexcept {
+        return data_ != nullptr;
+    }
+
+    /* Changes the protections of the whole buffer */
+    bool protect(int prot) noexcept {
+        if constexpr(Policy::prevent_wx) {
+            if((prot & PROT_WRITE) && (prot & PROT_EXEC)) {
+                return false;
+            }
+        }
+
+        return mapguard_protect(data_, prot) == OK;
+    }
+
+    template <int Prot>
+    bool protect() noexcept {
+        static_assert(!Policy::prevent_wx || !is_wx<Prot>, "W+X protections are disallowed by this policy");
+        return protect(Prot);
+    }
+
+    void reset() noexcept {
+        if(data_ != nullptr) {
+            mapguard_free(data_);
+            data_ = nullptr;
+            size_ = 0;
+        }
+    }
+
+  private:
+    void *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+/* Pools guarded allocations in power of two page size classes.
+ * Freed blocks are poisoned, if the policy asks for it, and kept
+ * out of core dumps for reuse up to pool_depth per class. Requests
+ * larger than the largest class or aligned beyond a page are not
+ * pooled */
+template <typename Policy = default_policy>
+class guarded_resource : public std::pmr::memory_resource {
+  public:
+    static constexpr size_t size_classes = 16;
+    static constexpr size_t pool_depth = 64;
+
+    guarded_resource() = default;
+    guarded_resource(const guarded_resource &) = delete;
+    guarded_resource &operator=(const guarded_resource &) = delete;
+
+    ~guarded_resource() override {
+        release();
+    }
+
+    /* Unmaps every pooled block. Blocks still in use are unaffected */
+    void release() noexcept {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        for(size_t c = 0; c < size_classes; c++) {
+            for(void *p : pools_[c]) {
+                include_in_core(p, g_page_size << c);
+                mapguard_free(p);
+            }
+
+            pools_[c].clear();
+        }
+    }
+
+  private:
+    static size_t size_class(size_t bytes) noexcept {
+        size_t c = 0;
+
+        while(c < size_classes && (g_page_size << c) < bytes) {
+            c++;
+        }
+
+        return c;
+    }
+
+    void *do_allocate(size_t bytes, size_t alignment) override {
+        if(alignment > g_page_size) {
+            throw std::bad_alloc();
+        }
+
+        size_t c = size_class(bytes);
+
+        if(c < size_classes) {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if(pools_[c].empty() == false) {
+                void *p = pools_[c].back();
+                pools_[c].pop_back();
+                include_in_core(p, g_page_size << c);
+                return p;
+            }
+        }
+
+        void *p = mapguard_alloc(c < size_classes ? (g_page_size << c) : bytes, PROT_READ | PROT_WRITE, Policy::flags);
+
+        if(p == nullptr) {
+            throw std::bad_alloc();
+        }
+
+        return p;
+    }
+
+    void do_deallocate(void *p, size_t bytes, size_t alignment) override {
+        size_t c = size_class(bytes);
+
+        if(c < size_classes) {
+            if constexpr(Policy::poison) {
+                std::memset(p, MG_POISON_BYTE, g_page_size << c);
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            if(pools_[c].size() < pool_depth) {
+                try {
+                    pools_[c].push_back(p);
+                    exclude_from_core(p, g_page_size << c);
+                    return;
+                } catch(...) {
+                }
+            }
+        }
+
+        mapguard_free(p);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+    std::mutex mutex_;
+    std::vector<void *> pools_[size_classes];
+};
+
+#if MPK_SUPPORT
+/* Opens the JIT protection key for the calling thread for as
+ * long as it is in scope, see mapguard_jit_write_begin() */
+class jit_write_scope {
+  public:
+    jit_write_scope() noexcept {
+        mapguard_jit_write_begin();
+    }
+
+    ~jit_write_scope() {
+        mapguard_jit_write_end();
+    }
+
+    jit_write_scope(const jit_write_scope &) = delete;
+    jit_write_scope &operator=(const jit_write_scope &) = delete;
+};
+#endif
+
+} // namespace mg
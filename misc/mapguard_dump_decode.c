@@ -0,0 +1,186 @@
+/* MapGuard dump decoder
+ * Copyright Chris Rohlf - 2025
+ *
+ * Prints the mappings, guard pages, protection history, file
+ * types, mapguard_alloc() flags, lifetime predictions and MPK
+ * state recorded in a dump written by mapguard_dump() or by the
+ * MG_DUMP_PATH fatal signal handler.
+ *
+ * Usage: mapguard_dump_decode <dump file> */
+
+#include "mapguard.h"
+
+#include <sys/stat.h>
+
+static const char *prot_string(int32_t prot, char *buf) {
+    buf[0] = (prot & PROT_READ) ? 'r' : '-';
+    buf[1] = (prot & PROT_WRITE) ? 'w' : '-';
+    buf[2] = (prot & PROT_EXEC) ? 'x' : '-';
+    buf[3] = '\0';
+    return buf;
+}
+
+static const char *guard_string(uint8_t guard) {
+    switch(guard) {
+    case MG_GUARD_NONE:
+        return "none";
+    case MG_GUARD_PENDING:
+        return "pending";
+    case MG_GUARD_INSTALLED:
+        return "installed";
+    default:
+        return "invalid";
+    }
+}
+
+static const char *fd_type_string(uint8_t type) {
+    switch(type) {
+    case MG_FD_REGULAR:
+        return "file";
+    case MG_FD_MEMFD:
+        return "memfd";
+    case MG_FD_DEVICE:
+        return "device";
+    default:
+        return "other";
+    }
+}
+
+/* Reads a field of size bytes at offset in an entry.
+ * Returns false if the field isn't in the dump */
+static bool read_field(const uint8_t *entry, const mapguard_dump_header_t *header, uint16_t offset, void *out, size_t size) {
+    if(offset == MG_DUMP_NO_FIELD || offset + size > header->entry_size) {
+        return false;
+    }
+
+    memcpy(out, entry + offset, size);
+    return true;
+}
+
+static void print_entry(const uint8_t *entry, const mapguard_dump_header_t *header) {
+    uint64_t start = 0;
+    uint64_t size = 0;
+    uint8_t guarded_b = 0;
+    uint8_t guarded_t = 0;
+    int32_t immutable_prot = 0;
+    int32_t current_prot = 0;
+    int32_t xom_enabled = 0;
+    int32_t pkey = 0;
+    int32_t pkey_access_rights = 0;
+    int32_t jit_enabled = 0;
+    uint8_t alloc_flags = 0;
+    uint8_t fd_type = MG_FD_NONE;
+    uint32_t lifetime_key = 0;
+    uint32_t lifetime_birth = 0;
+    uint8_t lifetime_class = 0;
+    char cur[4];
+    char hist[4];
+
+    read_field(entry, header, header->start_offset, &start, sizeof(start));
+    read_field(entry, header, header->size_offset, &size, sizeof(size));
+    read_field(entry, header, header->guarded_b_offset, &guarded_b, sizeof(guarded_b));
+    read_field(entry, header, header->guarded_t_offset, &guarded_t, sizeof(guarded_t));
+    read_field(entry, header, header->immutable_prot_offset, &immutable_prot, sizeof(immutable_prot));
+    read_field(entry, header, header->current_prot_offset, &current_prot, sizeof(current_prot));
+
+    printf("%016lx-%016lx %10lu %s (ever %s) guards bottom=%s top=%s", start, start + size, size,
+           prot_string(current_prot, cur), prot_string(immutable_prot, hist), guard_string(guarded_b), guard_string(guarded_t));
+
+    if(read_field(entry, header, header->fd_type_offset, &fd_type, sizeof(fd_type)) && fd_type != MG_FD_NONE) {
+        printf(" fd=%s", fd_type_string(fd_type));
+    }
+
+    if(read_field(entry, header, header->alloc_flags_offset, &alloc_flags, sizeof(alloc_flags)) && alloc_flags != 0) {
+        printf(" alloc=0x%x", alloc_flags);
+    }
+
+    if(read_field(entry, header, header->lifetime_key_offset, &lifetime_key, sizeof(lifetime_key)) && lifetime_key != 0) {
+        read_field(entry, header, header->lifetime_birth_offset, &lifetime_birth, sizeof(lifetime_birth));
+        read_field(entry, header, header->lifetime_class_offset, &lifetime_class, sizeof(lifetime_class));
+        printf(" lifetime key=0x%x birth=%u class=%u", lifetime_key, lifetime_birth, lifetime_class);
+    }
+
+    if(read_field(entry, header, header->pkey_offset, &pkey, sizeof(pkey))) {
+        read_field(entry, header, header->pkey_access_rights_offset, &pkey_access_rights, sizeof(pkey_access_rights));
+        read_field(entry, header, header->xom_enabled_offset, &xom_enabled, sizeof(xom_enabled));
+        read_field(entry, header, header->jit_enabled_offset, &jit_enabled, sizeof(jit_enabled));
+        printf(" pkey=%d rights=0x%x xom=%d jit=%d", pkey, pkey_access_rights, xom_enabled, jit_enabled);
+    }
+
+    printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 2) {
+        fprintf(stderr, "Usage: %s <dump file>\n", argv[0]);
+        return ERROR;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+
+    if(f == NULL) {
+        fprintf(stderr, "Failed to open %s\n", argv[1]);
+        return ERROR;
+    }
+
+    struct stat st;
+    fstat(fileno(f), &st);
+
+    uint8_t *dump = malloc(st.st_size);
+
+    if(dump == NULL || fread(dump, 1, st.st_size, f) != (size_t) st.st_size) {
+        fprintf(stderr, "Failed to read %s\n", argv[1]);
+        return ERROR;
+    }
+
+    fclose(f);
+
+    mapguard_dump_header_t *header = (mapguard_dump_header_t *) dump;
+
+    if(st.st_size < (off_t) sizeof(mapguard_dump_header_t) || header->magic != MG_DUMP_MAGIC) {
+        fprintf(stderr, "%s is not a mapguard dump\n", argv[1]);
+        return ERROR;
+    }
+
+    if(header->version != MG_DUMP_VERSION) {
+        fprintf(stderr, "Unsupported dump version %u\n", header->version);
+        return ERROR;
+    }
+
+    size_t expected = header->header_size + (header->page_count * sizeof(uint64_t)) + (header->page_count * header->page_size);
+
+    if((size_t) st.st_size < expected) {
+        fprintf(stderr, "Dump is truncated, %ld of %zu bytes\n", st.st_size, expected);
+        return ERROR;
+    }
+
+    printf("pid %d signal %d page size %lu metadata pages %u tracked mappings %lu%s\n", header->pid, header->signal,
+           header->page_size, header->page_count, header->tracked_mappings,
+           (header->flags & MG_DUMP_FLAG_CONSISTENT) ? "" : " (metadata may have been mid update)");
+
+    uint64_t *index = (uint64_t *) (dump + header->header_size);
+    uint8_t *pages = (uint8_t *) (index + header->page_count);
+    uint64_t mappings = 0;
+
+    for(uint32_t i = 0; i < header->page_count; i++) {
+        uint8_t *entry = pages + (i * header->page_size) + header->metadata_header_size;
+
+        for(uint32_t j = 0; j < header->entries_per_page; j++, entry += header->entry_size) {
+            uint64_t start = 0;
+            read_field(entry, header, header->start_offset, &start, sizeof(start));
+
+            if(start == 0) {
+                continue;
+            }
+
+            print_entry(entry, header);
+            mappings++;
+        }
+    }
+
+    printf("%lu mappings in %u metadata pages, first page at 0x%lx\n", mappings, header->page_count,
+           header->page_count ? index[0] : 0);
+
+    free(dump);
+    return OK;
+}
@@ -18,6 +18,8 @@ while true; do
     MG_PREVENT_X_TRANSITION
     MG_POISON_ON_ALLOCATION
     MG_ENABLE_SYSLOG
+    MG_RANDOMIZE_PLACEMENT
+    MG_ASYNC_GUARD_PAGES
   )
 
   for var in "${env_vars[@]}"; do
@@ -0,0 +1,46 @@
+#!/usr/bin/env bash
+
+## Runs build/mapguard_memory_bench without mapguard and then
+## preloaded under each policy combination. Prints CSV with the
+## overhead of every run over the run without mapguard
+## Copyright Chris Rohlf - 2025
+
+## A failing run must fail the script, not just whatever it is piped into
+set -o pipefail
+
+bench=build/mapguard_memory_bench
+library=build/libmapguard.so
+
+## label and the environment it runs with
+policies=(
+    "preload"
+    "cache MG_USE_MAPPING_CACHE=1"
+    "guards MG_USE_MAPPING_CACHE=1 MG_ENABLE_GUARD_PAGES=1"
+    "poison MG_USE_MAPPING_CACHE=1 MG_ENABLE_GUARD_PAGES=1 MG_POISON_ON_ALLOCATION=1"
+    "randomize MG_USE_MAPPING_CACHE=1 MG_ENABLE_GUARD_PAGES=1 MG_RANDOMIZE_PLACEMENT=1"
+    "lifetime MG_USE_MAPPING_CACHE=1 MG_ENABLE_GUARD_PAGES=1 MG_LIFETIME_PLACEMENT=1"
+    "coalesce MG_USE_MAPPING_CACHE=1 MG_COALESCE_MAPPINGS=1"
+    "huge_metadata MG_USE_MAPPING_CACHE=1 MG_ENABLE_GUARD_PAGES=1 MG_METADATA_HUGE_PAGES=1"
+)
+
+baseline=$($bench none) || exit 1
+
+echo "policy,workload,mappings,rss_kb,pte_kb,vmas,metadata_bytes,rss_overhead_kb,pte_overhead_kb,vma_overhead"
+
+print() {
+    awk -F, -v baseline="$baseline" 'BEGIN {
+        n = split(baseline, lines, "\n")
+        for(i = 1; i <= n; i++) {
+            split(lines[i], f, ",")
+            rss[f[2]] = f[4]; pte[f[2]] = f[5]; vmas[f[2]] = f[6]
+        }
+    }
+    { print $0 "," ($4 - rss[$2]) "," ($5 - pte[$2]) "," ($6 - vmas[$2]) }'
+}
+
+echo "$baseline" | print
+
+for p in "${policies[@]}"; do
+    read -r label vars <<< "$p"
+    env $vars LD_PRELOAD=$library $bench $label | print || exit 1
+done
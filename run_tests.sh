@@ -12,9 +12,17 @@ export MG_ENABLE_GUARD_PAGES=1
 export MG_PREVENT_X_TRANSITION=1
 export MG_POISON_ON_ALLOCATION=1
 export MG_ENABLE_SYSLOG=0
+export MG_RANDOMIZE_PLACEMENT=1
+export MG_NUMA_SIMULATE_NODES=2
+export MG_TRACK_FILE_MAPPINGS=1
+export MG_SAMPLE_MALLOC_RATE=1
+export MG_DONTDUMP_POISONED=1
+export MG_SELF_CALIBRATE=1
+export MG_COALESCE_MAPPINGS=1
 export LD_LIBRARY_PATH=build/
 
-tests=("mapguard_test" "mapguard_test_with_mpk" "mapguard_thread_test")
+tests=("mapguard_test" "mapguard_test_with_mpk" "mapguard_thread_test" "mapguard_cpp_test")
+huge_page_tests=("mapguard_test" "mapguard_thread_test")
 failure=0
 succeeded=0
 
@@ -25,10 +33,10 @@ then
 	echo "vm.mmap_min_addr should be 0 for some of the tests to work"
 fi
 
-for t in "${tests[@]}"; do
-    echo -n "Running $t test"
-    echo -n "Running $t test" >> test_output.txt 2>&1
-    $(build/$t >> test_output.txt 2>&1)
+run_test() {
+    echo -n "Running $1 test$2"
+    echo -n "Running $1 test$2" >> test_output.txt 2>&1
+    $(build/$1 >> test_output.txt 2>&1)
     ret=$?
 
     if [ $ret -ne 0 ]; then
@@ -40,8 +48,21 @@ for t in "${tests[@]}"; do
         echo "... Succeeded" >> test_output.txt 2>&1
         succeeded=$((succeeded+1))
     fi
+}
+
+for t in "${tests[@]}"; do
+    run_test $t
 done
 
+## Run again with metadata carved from huge page arenas
+export MG_METADATA_HUGE_PAGES=1
+
+for t in "${huge_page_tests[@]}"; do
+    run_test $t " with MG_METADATA_HUGE_PAGES"
+done
+
+unset MG_METADATA_HUGE_PAGES
+
 unset MG_PANIC_ON_VIOLATION
 unset MG_USE_MAPPING_CACHE
 unset MG_PREVENT_RWX
@@ -51,4 +72,11 @@ unset MG_ENABLE_GUARD_PAGES
 unset MG_PREVENT_X_TRANSITION
 unset MG_POISON_ON_ALLOCATION
 unset MG_ENABLE_SYSLOG
+unset MG_RANDOMIZE_PLACEMENT
+unset MG_NUMA_SIMULATE_NODES
+unset MG_TRACK_FILE_MAPPINGS
+unset MG_SAMPLE_MALLOC_RATE
+unset MG_DONTDUMP_POISONED
+unset MG_SELF_CALIBRATE
+unset MG_COALESCE_MAPPINGS
 unset LD_LIBRARY_PATH
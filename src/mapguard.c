@@ -3,21 +3,31 @@
 #include "mapguard.h"
 
 pthread_mutex_t _mg_mutex;
-
-mapguard_cache_metadata_t *mce_head;
+uint64_t _mg_seq;
 
 /* Globals */
-vector_t g_map_cache_vector;
 size_t g_page_size;
 
 /* Global policy configuration object */
 mapguard_policy_t g_mapguard_policy;
 
+/* Global runtime counters, protected by _mg_mutex */
+mapguard_stats_t g_mapguard_stats;
+
+/* Guard page technique selected by mapguard_calibrate */
+extern uint8_t g_guard_method;
+
 /* Pointers to hooked libc functions */
 void *(*g_real_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
 int (*g_real_munmap)(void *addr, size_t length);
 int (*g_real_mprotect)(void *addr, size_t len, int prot);
 void *(*g_real_mremap)(void *__addr, size_t __old_len, size_t __new_len, int __flags, ...);
+int (*g_real_close)(int fd);
+int (*g_real_dup2)(int oldfd, int newfd);
+int (*g_real_dup3)(int oldfd, int newfd, int flags);
+int (*g_real_close_range)(unsigned int first, unsigned int last, int flags);
+void (*g_real_closefrom)(int lowfd);
+int (*g_real_fclose)(FILE *stream);
 
 extern int (*g_real_pkey_mprotect)(void *addr, size_t len, int prot, int pkey);
 extern int (*g_real_pkey_alloc)(unsigned int flags, unsigned int access_rights);
@@ -41,16 +51,39 @@ __attribute__((constructor)) void mapguard_ctor() {
     ENV_TO_INT(MG_POISON_ON_ALLOCATION, g_mapguard_policy.poison_on_allocation);
     ENV_TO_INT(MG_USE_MAPPING_CACHE, g_mapguard_policy.use_mapping_cache);
     ENV_TO_INT(MG_ENABLE_SYSLOG, g_mapguard_policy.enable_syslog);
+    ENV_TO_INT(MG_RANDOMIZE_PLACEMENT, g_mapguard_policy.randomize_placement);
+    ENV_TO_INT(MG_ASYNC_GUARD_PAGES, g_mapguard_policy.async_guard_pages);
+    ENV_TO_INT(MG_SELF_CALIBRATE, g_mapguard_policy.self_calibrate);
+    ENV_TO_INT(MG_TRACK_FILE_MAPPINGS, g_mapguard_policy.track_file_mappings);
+    ENV_TO_INT(MG_COALESCE_MAPPINGS, g_mapguard_policy.coalesce_mappings);
+    ENV_TO_INT(MG_DONTDUMP_POISONED, g_mapguard_policy.dontdump_poisoned);
+    ENV_TO_INT(MG_LIFETIME_PLACEMENT, g_mapguard_policy.lifetime_placement);
+    ENV_TO_INT(MG_PERF_COUNTERS, g_mapguard_policy.perf_counters);
 
     /* In order for guard pages to work we need MCE */
     if(g_mapguard_policy.enable_guard_pages == 1 && g_mapguard_policy.use_mapping_cache == 0) {
         LOG_AND_ABORT("MG_ENABLE_GUARD_PAGES == 1 but MG_USE_MAPPING_CACHE == 0");
     }
 
+    if(g_mapguard_policy.track_file_mappings == 1 && g_mapguard_policy.use_mapping_cache == 0) {
+        LOG_AND_ABORT("MG_TRACK_FILE_MAPPINGS == 1 but MG_USE_MAPPING_CACHE == 0");
+    }
+
+    /* Lifetimes are learned from the cache entries */
+    if(g_mapguard_policy.lifetime_placement == 1 && g_mapguard_policy.use_mapping_cache == 0) {
+        LOG_AND_ABORT("MG_LIFETIME_PLACEMENT == 1 but MG_USE_MAPPING_CACHE == 0");
+    }
+
     g_real_mmap = dlsym(RTLD_NEXT, "mmap");
     g_real_munmap = dlsym(RTLD_NEXT, "munmap");
     g_real_mprotect = dlsym(RTLD_NEXT, "mprotect");
     g_real_mremap = dlsym(RTLD_NEXT, "mremap");
+    g_real_close = dlsym(RTLD_NEXT, "close");
+    g_real_dup2 = dlsym(RTLD_NEXT, "dup2");
+    g_real_dup3 = dlsym(RTLD_NEXT, "dup3");
+    g_real_close_range = dlsym(RTLD_NEXT, "close_range");
+    g_real_closefrom = dlsym(RTLD_NEXT, "closefrom");
+    g_real_fclose = dlsym(RTLD_NEXT, "fclose");
 
 #if MPK_SUPPORT
     g_real_pkey_mprotect = dlsym(RTLD_NEXT, "pkey_mprotect");
@@ -64,58 +97,127 @@ __attribute__((constructor)) void mapguard_ctor() {
         openlog("mapguard", LOG_CONS | LOG_PID, LOG_AUTH);
     }
 
-    vector_init(&g_map_cache_vector);
+    rand_init();
+
+    if(g_mapguard_policy.async_guard_pages) {
+        async_guard_init();
+    }
 
     g_page_size = getpagesize();
-    mce_head = new_mce_page();
-    LOG("Allocated mce_head at %p", mce_head);
-}
 
-mapguard_cache_metadata_t *new_mce_page() {
-    /* Produce a random page address as a hint for mmap */
-    uint64_t hint = ROUND_DOWN_PAGE(rand_uint64());
-    hint &= 0x3FFFFFFFF000;
+    madvise_init();
+
+    if(g_mapguard_policy.self_calibrate) {
+        mapguard_calibrate();
+    }
+
+    cache_backend_init();
 
-    void *ptr = g_real_mmap((void *) hint, g_page_size * 3, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    make_guard_page((void *) ptr);
-    make_guard_page((void *) ptr + (g_page_size * 2));
+    numa_init();
+    metadata_init();
+    dump_init();
+    verify_init();
+    sample_init();
+    perf_init();
 
-    mapguard_cache_metadata_t *t = (mapguard_cache_metadata_t *) (ptr + g_page_size);
-    t->total = (g_page_size - sizeof(mapguard_cache_metadata_t)) / sizeof(mapguard_cache_entry_t);
-    t->free = t->total;
-    return t;
+    profile_load();
 }
 
-/* Attempts to allocate a guard page at a given address */
+/* Attempts to allocate a guard page at a given address. The
+ * kernel treats the address as a hint, so a page that could not
+ * be placed exactly at p is released and MAP_FAILED returned */
 void *allocate_guard_page(void *p) {
-    return g_real_mmap(p, g_page_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void *ptr = g_mg_syscalls->mmap(p, g_page_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+    if(ptr != MAP_FAILED && ptr != p) {
+        g_mg_syscalls->munmap(ptr, g_page_size);
+        return MAP_FAILED;
+    }
+
+    return ptr;
+}
+
+/* Fall back to mprotect if the kernel refuses the guard
+ * region, e.g. for mlocked mappings. That makes the guard
+ * page a VMA of its own so it can be kept out of core dumps
+ * without splitting anything */
+static void protect_guard_page(const mapguard_syscalls_t *sys, void *p) {
+    sys->mprotect(p, g_page_size, PROT_NONE);
+    sys->madvise(p, g_page_size, MADV_DONTNEED);
+    sys->madvise(p, g_page_size, MADV_DONTDUMP);
+}
+
+/* Installs count guard pages with as few syscalls as possible.
+ * Metadata pages are always guarded through the real kernel,
+ * tracked mappings through g_mg_syscalls */
+void install_guard_pages(const mapguard_syscalls_t *sys, void **pages, size_t count) {
+    struct iovec iov[MG_MADVISE_BATCH_SIZE];
+    mapguard_perf_sample_t sample;
+    size_t i = 0;
+
+    if(g_mapguard_policy.perf_counters) {
+        perf_begin(&sample);
+    }
+
+    if(g_guard_method != MG_GUARD_METHOD_MADVISE) {
+        for(; i < count; i++) {
+            protect_guard_page(sys, pages[i]);
+        }
+    }
+
+    while(i < count) {
+        size_t n = MIN(count - i, MG_MADVISE_BATCH_SIZE);
+
+        for(size_t j = 0; j < n; j++) {
+            iov[j].iov_base = pages[i + j];
+            iov[j].iov_len = g_page_size;
+        }
+
+        size_t done = madvise_vector(sys, iov, n, MADV_GUARD_INSTALL);
+        i += done;
+
+        /* The kernel refused the guard region at i, carry on after it */
+        if(done < n) {
+            protect_guard_page(sys, pages[i++]);
+        }
+    }
+
+    if(g_mapguard_policy.perf_counters) {
+        perf_end(&sample, MG_PERF_SCOPE_GUARD_PAGES);
+    }
+
+    for(i = 0; i < count; i++) {
+        LOG("Mapped guard page %p", pages[i]);
+    }
+}
+
+void install_guard_page(const mapguard_syscalls_t *sys, void *p) {
+    install_guard_pages(sys, &p, 1);
 }
 
 void make_guard_page(void *p) {
-    g_real_mprotect(p, g_page_size, PROT_NONE);
-    madvise(p, g_page_size, MADV_DONTNEED);
-    LOG("Mapped guard page %p", p);
+    install_guard_page(g_mg_syscalls, p);
 }
 
 void unmap_top_guard_page(mapguard_cache_entry_t *mce) {
 #if DEBUG
-    if(mce->guarded_t == false) {
+    if(mce->guarded_t == MG_GUARD_NONE) {
         LOG_AND_ABORT("Attempting to unmap missing top guard page")
     }
 #endif
-    g_real_munmap(mce->start + mce->size, g_page_size);
-    mce->guarded_t = false;
+    g_mg_syscalls->munmap(mce->start + mce->size, g_page_size);
+    mce->guarded_t = MG_GUARD_NONE;
     LOG("Unmapped top guard page %p", mce->start + mce->size);
 }
 
 void unmap_bottom_guard_page(mapguard_cache_entry_t *mce) {
 #if DEBUG
-    if(mce->guarded_b == false) {
+    if(mce->guarded_b == MG_GUARD_NONE) {
         LOG_AND_ABORT("Attempting to unmap missing bottom guard page")
     }
 #endif
-    g_real_munmap(mce->start - g_page_size, g_page_size);
-    mce->guarded_b = false;
+    g_mg_syscalls->munmap(mce->start - g_page_size, g_page_size);
+    mce->guarded_b = MG_GUARD_NONE;
     LOG("Unmapped bottom guard page %p", mce->start - g_page_size);
 }
 
@@ -124,6 +226,12 @@ void unmap_guard_pages(mapguard_cache_entry_t *mce) {
         LOG_AND_ABORT("This should never happen: mce == NULL");
     }
 
+    /* Unmapping the reserved guard page address space cancels
+     * any installation still queued for the guard page worker */
+    if(mce->guarded_b == MG_GUARD_PENDING || mce->guarded_t == MG_GUARD_PENDING) {
+        g_mapguard_stats.guard_cancels++;
+    }
+
     if(mce->guarded_b) {
         unmap_bottom_guard_page(mce);
     }
@@ -135,82 +243,43 @@ void unmap_guard_pages(mapguard_cache_entry_t *mce) {
 
 void map_bottom_guard_page(mapguard_cache_entry_t *mce) {
     make_guard_page(mce->start - g_page_size);
-    mce->guarded_b = true;
+    mce->guarded_b = MG_GUARD_INSTALLED;
 }
 
 void map_top_guard_page(mapguard_cache_entry_t *mce) {
     make_guard_page(mce->start + mce->size);
-    mce->guarded_t = true;
+    mce->guarded_t = MG_GUARD_INSTALLED;
 }
 
 void mark_guard_pages(mapguard_cache_entry_t *mce) {
-    map_bottom_guard_page(mce);
-    map_top_guard_page(mce);
-}
-
-mapguard_cache_entry_t *find_free_mce() {
-    mapguard_cache_entry_t *mce = NULL;
-    mapguard_cache_metadata_t *current = mce_head;
-
-    while(current != NULL) {
-        /* If count is 0 then all entries on this
-         * page have been used, goto the next */
-        if(current->free == 0) {
-            current = current->next;
-            continue;
-        } else {
-            mce = (mapguard_cache_entry_t *) (current + sizeof(mapguard_cache_metadata_t));
-            uint32_t i = 0;
-            while(mce->start != NULL && i < current->total) {
-                mce++;
-            }
-
-            /* This page was supposed to have a free entry */
-            if(mce->start != NULL || i > current->total) {
-                abort();
-            }
+    void *pages[2] = {mce->start - g_page_size, mce->start + mce->size};
 
-            /* We have a usable mce entry */
-            return mce;
-        }
-    }
-
-    /* We need a new page */
-    while(current != NULL) {
-        if(current->next == NULL) {
-            current->next = new_mce_page();
-            mce = (mapguard_cache_entry_t *) (current->next + sizeof(mapguard_cache_metadata_t));
-            return mce;
-        }
-    }
-
-    LOG_AND_ABORT("No free mce!");
-    return NULL;
+    install_guard_pages(g_mg_syscalls, pages, 2);
+    mce->guarded_b = MG_GUARD_INSTALLED;
+    mce->guarded_t = MG_GUARD_INSTALLED;
 }
 
 __attribute__((destructor)) void mapguard_dtor() {
+    /* The worker and the verifier must not touch entries
+     * we are about to unmap */
+    stop_guard_worker();
+    stop_verifier();
+
+    profile_save();
+
     if(g_mapguard_policy.enable_syslog) {
         closelog();
     }
 
+    LOCK_MG();
+
     /* Erase all cache entries */
     if(g_mapguard_policy.use_mapping_cache) {
-        vector_free(&g_map_cache_vector);
+        mapguard_cache_destroy(&g_map_cache);
     }
 
-    mapguard_cache_metadata_t *current = mce_head;
-
-    while(current != NULL) {
-        mapguard_cache_metadata_t *tmp = current->next;
-        g_real_munmap(current, g_page_size);
-        current = tmp;
-    }
-}
-
-uint64_t rand_uint64(void) {
-    uint64_t val = 0;
-    syscall(SYS_getrandom, &val, sizeof(val), GRND_NONBLOCK);
-    return val;
+    metadata_destroy();
+    UNLOCK_MG();
 }
 
 int32_t env_to_int(char *string) {
@@ -223,6 +292,12 @@ int32_t env_to_int(char *string) {
     return strtoul(p, NULL, 0);
 }
 
+void mapguard_get_stats(mapguard_stats_t *stats) {
+    LOCK_MG();
+    memcpy(stats, &g_mapguard_stats, sizeof(mapguard_stats_t));
+    UNLOCK_MG();
+}
+
 /* Checks if we have a cache entry for this mapping */
 void *is_mapguard_entry_cached(void *p, void *data) {
     mapguard_cache_entry_t *mce = (mapguard_cache_entry_t *) p;
@@ -240,18 +315,57 @@ void *is_mapguard_entry_cached(void *p, void *data) {
 }
 
 mapguard_cache_entry_t *get_cache_entry(void *addr) {
-    mapguard_cache_entry_t *mce = (mapguard_cache_entry_t *) vector_for_each(&g_map_cache_vector, (vector_for_each_callback_t *) is_mapguard_entry_cached, addr);
-    return mce;
+    return mapguard_cache_lookup(&g_map_cache, addr);
 }
 
-/* Hook mmap in libc */
-void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
-    /* We don't intercept file backed mappings */
+/* Attempts to place an anonymous mapping at a random address.
+ * MAP_FIXED_NOREPLACE guarantees we never clobber an existing
+ * mapping, older kernels treat it as a plain hint so we check
+ * the result ourselves. After MG_PLACEMENT_RETRIES collisions
+ * we fall back to letting the kernel pick the address */
+void *map_randomized(size_t length, int prot, int flags) {
+    int32_t saved_errno = errno;
+
+    for(int32_t i = 0; i < MG_PLACEMENT_RETRIES; i++) {
+        void *hint = rand_page_address();
+        void *ptr = g_mg_syscalls->mmap(hint, length, prot, flags | MAP_FIXED_NOREPLACE, -1, 0);
+
+        if(ptr == hint) {
+            errno = saved_errno;
+            return ptr;
+        }
+
+        if(ptr != MAP_FAILED) {
+            g_mg_syscalls->munmap(ptr, length);
+        } else if(errno != EEXIST) {
+            break;
+        }
+    }
+
+    errno = saved_errno;
+    return g_mg_syscalls->mmap(NULL, length, prot, flags, -1, 0);
+}
+
+/* call_site is the return address of the exported mmap, which
+ * MG_LIFETIME_PLACEMENT predicts lifetimes by */
+static void *hook_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset, void *call_site) {
+    /* File backed mappings are only tracked with MG_TRACK_FILE_MAPPINGS
+     * and then only if they could ever violate W^X */
     if(fd != -1) {
-        void *map_ptr = g_real_mmap(addr, length, prot, flags, fd, offset);
+        if(g_mapguard_policy.track_file_mappings && (prot & (PROT_WRITE | PROT_EXEC)) && (flags & MAP_ANONYMOUS) == 0) {
+            return map_file(addr, length, prot, flags, fd, offset);
+        }
+
+        void *map_ptr = g_mg_syscalls->mmap(addr, length, prot, flags, fd, offset);
         return map_ptr;
     }
 
+    /* The kernel refuses these too, and they have no size class */
+    if(length == 0) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
     LOCK_MG();
 
     /* Evaluate and enforce security policies set by env vars */
@@ -273,15 +387,22 @@ void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
     }
 
     void *map_ptr = NULL;
+    uint32_t lifetime_key = 0;
+    uint8_t lifetime_class = MG_LIFETIME_NONE;
 
     size_t rounded_length = ROUND_UP_PAGE(length);
+    size_t map_length = rounded_length;
 
     if(g_mapguard_policy.enable_guard_pages) {
-        map_ptr = g_real_mmap(addr, rounded_length + (g_page_size * GUARD_PAGE_COUNT), prot, flags, fd, offset);
-        make_guard_page(map_ptr);
-        make_guard_page(map_ptr + g_page_size + length);
+        map_length += g_page_size * GUARD_PAGE_COUNT;
+    }
+
+    if(g_mapguard_policy.lifetime_placement && addr == NULL && (flags & MAP_FIXED) == 0) {
+        map_ptr = map_by_lifetime(map_length, prot, flags, call_site, &lifetime_key, &lifetime_class);
+    } else if(g_mapguard_policy.randomize_placement && addr == NULL && (flags & MAP_FIXED) == 0) {
+        map_ptr = map_randomized(map_length, prot, flags);
     } else {
-        map_ptr = g_real_mmap(addr, rounded_length, prot, flags, fd, offset);
+        map_ptr = g_mg_syscalls->mmap(addr, map_length, prot, flags, fd, offset);
     }
 
     if(map_ptr == MAP_FAILED) {
@@ -289,6 +410,10 @@ void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
         return map_ptr;
     }
 
+    g_mapguard_stats.mmap_calls++;
+    g_mapguard_stats.size_classes[MIN(63 - __builtin_clzll(rounded_length), MG_SIZE_CLASS_COUNT - 1)]++;
+    profile_record_call_site(call_site);
+
     mapguard_cache_entry_t *mce = NULL;
 
     /* Cache the start, size and protections of this mapping */
@@ -300,28 +425,45 @@ void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
             abort();
         }
 
-        mce->start = map_ptr + g_page_size;
+        mce->start = map_ptr;
         mce->size = rounded_length;
         mce->immutable_prot |= prot;
         mce->current_prot = prot;
-        mce->cache_index = vector_push(&g_map_cache_vector, mce);
 
         if(g_mapguard_policy.enable_guard_pages) {
-            mce->guarded_b = true;
-            mce->guarded_t = true;
+            mce->start += g_page_size;
+        }
+
+        if(lifetime_key != 0) {
+            lifetime_track(mce, lifetime_key, lifetime_class);
+        }
+
+        mapguard_cache_insert(&g_map_cache, mce);
+
+        if(g_mapguard_policy.enable_guard_pages) {
+
+            if(g_mapguard_policy.async_guard_pages) {
+                guard_queue_push(mce);
+            } else {
+                mark_guard_pages(mce);
+            }
         }
 
         /* Set all bytes in the allocation if configured and pages are writeable */
-        if(g_mapguard_policy.poison_on_allocation && (prot & PROT_WRITE)) {
-            memset(mce->start, MG_POISON_BYTE, length);
+        if(g_mapguard_policy.poison_on_allocation && (prot & PROT_WRITE) && g_mg_syscalls->backed) {
+            poison_pages(mce->start, rounded_length);
         }
 
+        void *ptr = mce->start;
+        mce_coalesce(mce);
         UNLOCK_MG();
-        return mce->start;
+        start_guard_worker();
+        start_verifier();
+        return ptr;
     } else {
         /* Set all bytes in the allocation if configured and pages are writeable */
-        if(g_mapguard_policy.poison_on_allocation && (prot & PROT_WRITE)) {
-            memset(map_ptr, MG_POISON_BYTE, length);
+        if(g_mapguard_policy.poison_on_allocation && (prot & PROT_WRITE) && g_mg_syscalls->backed) {
+            poison_pages(map_ptr, rounded_length);
         }
 
         UNLOCK_MG();
@@ -329,8 +471,7 @@ void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
     }
 }
 
-/* Hook munmap in libc */
-int munmap(void *addr, size_t length) {
+static int hook_munmap(void *addr, size_t length) {
     LOCK_MG();
 
     mapguard_cache_entry_t *mce = NULL;
@@ -343,6 +484,50 @@ int munmap(void *addr, size_t length) {
         if(mce) {
             LOG("Found mapguard cache entry for mapping %p", mce->start);
 
+#if MPK_SUPPORT
+            /* Every JIT region shares one pkey, which must not be
+             * freed with any one of them */
+            if(mce->jit_enabled) {
+                SYSLOG("Preventing munmap of JIT region %p, use mapguard_jit_free()", addr);
+                MAYBE_PANIC();
+                errno = EACCES;
+                UNLOCK_MG();
+                return ERROR;
+            }
+#endif
+
+            /* Guard pages still waiting on the worker must be in place
+             * before a partial unmapping moves them, or the queued work
+             * no longer matches the entry and is dropped */
+            if(g_mapguard_policy.async_guard_pages) {
+                install_pending_guards(mce);
+            }
+
+            /* fd backed entries have no guard pages to move around */
+            if(mce->fd_type != MG_FD_NONE) {
+                ret = g_mg_syscalls->munmap(addr, length);
+
+                if(ret == 0) {
+                    unmap_file_range(mce, addr, ROUND_UP_PAGE(length));
+                }
+
+                UNLOCK_MG();
+                return ret;
+            }
+
+            /* Coalesced entries are split wherever the range starts
+             * and ends, then every entry inside it is dropped */
+            if(g_mapguard_policy.coalesce_mappings && mce_coalescable(mce)) {
+                ret = g_mg_syscalls->munmap(addr, length);
+
+                if(ret == 0) {
+                    mce_unmap_range(addr, ROUND_UP_PAGE(length));
+                }
+
+                UNLOCK_MG();
+                return ret;
+            }
+
             /* Handle a partial unmapping */
             if(mce->start != addr || mce->size != length) {
                 /* Update the size we are tracking */
@@ -351,14 +536,14 @@ int munmap(void *addr, size_t length) {
                 /* Handle the case of unmapping the last N pages */
                 if(addr > mce->start && length < mce->size) {
                     unmap_top_guard_page(mce);
-                    ret = g_real_munmap(addr, length);
+                    ret = g_mg_syscalls->munmap(addr, length);
 
                     /* If the unmapping succeeded remap the top guard page */
                     if(ret == 0) {
                         void *p = allocate_guard_page(mce->start + mce->size);
 
-                        if(p == MAP_FAILED) {
-                            mce->guarded_t = false;
+                        if(p != MAP_FAILED) {
+                            mce->guarded_t = MG_GUARD_INSTALLED;
                         }
                     }
 
@@ -369,15 +554,15 @@ int munmap(void *addr, size_t length) {
                 /* Handle the case of unmapping the first N pages */
                 if(mce->start == addr) {
                     unmap_bottom_guard_page(mce);
-                    mce->start += length;
-                    ret = g_real_munmap(addr, length);
+                    mapguard_cache_rekey(&g_map_cache, mce, mce->start + length);
+                    ret = g_mg_syscalls->munmap(addr, length);
 
                     /* If the unmapping succeeded remap the bottom guard page */
                     if(ret == 0) {
                         void *p = allocate_guard_page(mce->start - g_page_size);
 
-                        if(p == MAP_FAILED) {
-                            mce->guarded_b = false;
+                        if(p != MAP_FAILED) {
+                            mce->guarded_b = MG_GUARD_INSTALLED;
                         }
                     }
 
@@ -392,7 +577,7 @@ int munmap(void *addr, size_t length) {
                     g_real_pkey_free(mce->pkey);
                 }
 #endif
-                ret = g_real_munmap(addr, length);
+                ret = g_mg_syscalls->munmap(addr, length);
 
                 /* Continue tracking a failed unmapping */
                 if(ret) {
@@ -401,9 +586,11 @@ int munmap(void *addr, size_t length) {
                 }
 
                 unmap_guard_pages(mce);
+                lifetime_record_death(mce);
 
                 LOG("Deleting cache entry for %p", mce->start);
-                vector_delete_at(&g_map_cache_vector, mce->cache_index);
+                mapguard_cache_remove(&g_map_cache, mce);
+                free_mce(mce);
                 UNLOCK_MG();
                 return ret;
             }
@@ -411,11 +598,10 @@ int munmap(void *addr, size_t length) {
     }
 
     UNLOCK_MG();
-    return g_real_munmap(addr, length);
+    return g_mg_syscalls->munmap(addr, length);
 }
 
-/* Hook mprotect in libc */
-int mprotect(void *addr, size_t len, int prot) {
+static int hook_mprotect(void *addr, size_t len, int prot) {
     LOCK_MG();
     mapguard_cache_entry_t *mce = NULL;
 
@@ -431,6 +617,15 @@ int mprotect(void *addr, size_t len, int prot) {
     if(g_mapguard_policy.use_mapping_cache) {
         mce = get_cache_entry(addr);
 #if MPK_SUPPORT
+        /* JIT code is only ever made writable through its pkey */
+        if(mce != NULL && mce->jit_enabled) {
+            SYSLOG("Preventing mprotect of JIT region %p, use mapguard_jit_write_begin()", addr);
+            MAYBE_PANIC();
+            errno = EACCES;
+            UNLOCK_MG();
+            return ERROR;
+        }
+
         if(mce != NULL && mce->xom_enabled == 0) {
 #else
         if(mce != NULL) {
@@ -453,9 +648,13 @@ int mprotect(void *addr, size_t len, int prot) {
         }
     }
 
-    int32_t ret = g_real_mprotect(addr, len, prot);
+    int32_t ret = g_mg_syscalls->mprotect(addr, len, prot);
 
     if(ret == 0 && mce) {
+        /* A coalesced entry is split so only the range that
+         * changed gets the new protections */
+        mce = mce_isolate(mce, addr, ROUND_UP_PAGE(len));
+
         /* Its possible the caller changed the protections on
          * only a portion of the mapping. Log it but ignore it */
         if(mce->size != len) {
@@ -465,28 +664,22 @@ int mprotect(void *addr, size_t len, int prot) {
         /* Update the saved page permissions, even if the size doesn't match */
         mce->immutable_prot |= prot;
         mce->current_prot = prot;
+        mce_coalesce(mce);
     }
 
     UNLOCK_MG();
     return ret;
 }
 
-/* Hook mremap in libc
- * mremap is a complex syscall when you consider all of the flags.
+/* mremap is a complex syscall when you consider all of the flags.
  * Instead of trying to intelligently handle these flags we just
  * transparently proxy the call and do our best to handle what the
  * kernel decides to do with the mapping.
  */
-void *mremap(void *__addr, size_t __old_len, size_t __new_len, int __flags, ...) {
+static void *hook_mremap(void *__addr, size_t __old_len, size_t __new_len, int __flags, void *new_address) {
     LOCK_MG();
 
-    void *new_address = NULL;
-
     if((__flags & MREMAP_FIXED) || (__flags & MAP_FIXED_NOREPLACE)) {
-        va_list vl;
-        va_start(vl, __flags);
-        new_address = va_arg(vl, void *);
-
         if(g_mapguard_policy.prevent_static_address) {
             SYSLOG("Attempted mremap with MREMAP_FIXED at %p", new_address);
             MAYBE_PANIC();
@@ -496,12 +689,30 @@ void *mremap(void *__addr, size_t __old_len, size_t __new_len, int __flags, ...)
         }
     }
 
-    void *map_ptr = NULL;
+    /* Guard pages still waiting on the worker must be in place
+     * before the kernel moves or resizes the mapping */
+    if(g_mapguard_policy.async_guard_pages) {
+        mapguard_cache_entry_t *pending = get_cache_entry(__addr);
 
-    if(new_address != NULL) {
-        map_ptr = g_real_mremap(__addr, __old_len, __new_len, __flags, new_address);
-    } else {
-        map_ptr = g_real_mremap(__addr, __old_len, __new_len, __flags);
+        if(pending) {
+            install_pending_guards(pending);
+        }
+    }
+
+    /* Only the remapped range of a coalesced entry moves or
+     * resizes, so it is split off into an entry of its own */
+    if(g_mapguard_policy.use_mapping_cache) {
+        mapguard_cache_entry_t *coalesced = get_cache_entry(__addr);
+
+        if(coalesced) {
+            mce_isolate(coalesced, __addr, ROUND_UP_PAGE(__old_len));
+        }
+    }
+
+    void *map_ptr = g_mg_syscalls->mremap(__addr, __old_len, __new_len, __flags, new_address);
+
+    if(map_ptr != MAP_FAILED) {
+        g_mapguard_stats.mremap_calls++;
     }
 
     if(g_mapguard_policy.use_mapping_cache && map_ptr != MAP_FAILED) {
@@ -520,22 +731,24 @@ void *mremap(void *__addr, size_t __old_len, size_t __new_len, int __flags, ...)
              * cheap check regardless */
             if(mce->start != map_ptr) {
                 unmap_guard_pages(mce);
-                mce->guarded_b = false;
-                mce->guarded_t = false;
+            } else if(mce->size != __new_len && mce->guarded_t) {
+                unmap_top_guard_page(mce);
+            }
+
+            if(mce->start != map_ptr) {
+                mapguard_cache_rekey(&g_map_cache, mce, map_ptr);
             }
 
-            mce->start = map_ptr;
             mce->size = __new_len;
 
             /* Best effort guard page creation */
-            void *ptr = g_real_mmap(map_ptr - g_page_size, g_page_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-
-            if(ptr != MAP_FAILED) {
-                mce->guarded_b = true;
-                ptr = g_real_mmap(map_ptr + __new_len, g_page_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(g_mapguard_policy.enable_guard_pages && mce->fd_type == MG_FD_NONE) {
+                if(mce->guarded_b == MG_GUARD_NONE && allocate_guard_page(map_ptr - g_page_size) != MAP_FAILED) {
+                    mce->guarded_b = MG_GUARD_INSTALLED;
+                }
 
-                if(ptr != MAP_FAILED) {
-                    mce->guarded_t = true;
+                if(mce->guarded_t == MG_GUARD_NONE && allocate_guard_page(map_ptr + __new_len) != MAP_FAILED) {
+                    mce->guarded_t = MG_GUARD_INSTALLED;
                 }
             }
 
@@ -552,9 +765,75 @@ void *mremap(void *__addr, size_t __old_len, size_t __new_len, int __flags, ...)
                 }
             }
 #endif
+
+            mce_coalesce(mce);
         }
     }
 
     UNLOCK_MG();
     return map_ptr;
 }
+
+/* The exported hooks only add MG_PERF_COUNTERS sampling around
+ * the hook_* implementations above */
+
+/* Hook mmap in libc */
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    if(g_mapguard_policy.perf_counters == 0) {
+        return hook_mmap(addr, length, prot, flags, fd, offset, __builtin_return_address(0));
+    }
+
+    mapguard_perf_sample_t sample;
+    perf_begin(&sample);
+    void *ret = hook_mmap(addr, length, prot, flags, fd, offset, __builtin_return_address(0));
+    perf_end(&sample, MG_PERF_SCOPE_HOOKS);
+    return ret;
+}
+
+/* Hook munmap in libc */
+int munmap(void *addr, size_t length) {
+    if(g_mapguard_policy.perf_counters == 0) {
+        return hook_munmap(addr, length);
+    }
+
+    mapguard_perf_sample_t sample;
+    perf_begin(&sample);
+    int ret = hook_munmap(addr, length);
+    perf_end(&sample, MG_PERF_SCOPE_HOOKS);
+    return ret;
+}
+
+/* Hook mprotect in libc */
+int mprotect(void *addr, size_t len, int prot) {
+    if(g_mapguard_policy.perf_counters == 0) {
+        return hook_mprotect(addr, len, prot);
+    }
+
+    mapguard_perf_sample_t sample;
+    perf_begin(&sample);
+    int ret = hook_mprotect(addr, len, prot);
+    perf_end(&sample, MG_PERF_SCOPE_HOOKS);
+    return ret;
+}
+
+/* Hook mremap in libc */
+void *mremap(void *__addr, size_t __old_len, size_t __new_len, int __flags, ...) {
+    void *new_address = NULL;
+
+    if((__flags & MREMAP_FIXED) || (__flags & MAP_FIXED_NOREPLACE)) {
+        va_list vl;
+        va_start(vl, __flags);
+        new_address = va_arg(vl, void *);
+        va_end(vl);
+    }
+
+    if(g_mapguard_policy.perf_counters == 0) {
+        return hook_mremap(__addr, __old_len, __new_len, __flags, new_address);
+    }
+
+    mapguard_perf_sample_t sample;
+    perf_begin(&sample);
+    void *ret = hook_mremap(__addr, __old_len, __new_len, __flags, new_address);
+    perf_end(&sample, MG_PERF_SCOPE_HOOKS);
+    return ret;
+}
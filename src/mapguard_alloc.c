@@ -0,0 +1,141 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+/* Explicit guarded allocations
+ *
+ * mapguard_alloc() gives callers the protections of the mmap hook
+ * for one allocation at a time, with the policy passed in as
+ * MG_ALLOC_* flags instead of read from the environment. The
+ * mapping is made through g_mg_syscalls and tracked in the mapping
+ * cache like any other, so the hooks and mapguard_snapshot() see
+ * it, but nothing goes through the interposed mmap, munmap or
+ * mprotect symbols. include/mapguard.hpp builds the C++ interface
+ * on top of these */
+
+extern mapguard_policy_t g_mapguard_policy;
+extern mapguard_stats_t g_mapguard_stats;
+
+/* Returns a page aligned allocation of at least size bytes or
+ * NULL with errno set */
+void *mapguard_alloc(size_t size, int prot, uint32_t flags) {
+    if(size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if((flags & MG_ALLOC_PREVENT_WX) && (prot & PROT_WRITE) && (prot & PROT_EXEC)) {
+        errno = EACCES;
+        return NULL;
+    }
+
+    size_t rounded_length = ROUND_UP_PAGE(size);
+    size_t map_length = rounded_length;
+
+    if(flags & MG_ALLOC_GUARD_PAGES) {
+        map_length += g_page_size * GUARD_PAGE_COUNT;
+    }
+
+    LOCK_MG();
+
+    void *map_ptr;
+
+    if(g_mapguard_policy.randomize_placement) {
+        map_ptr = map_randomized(map_length, prot, MAP_PRIVATE | MAP_ANONYMOUS);
+    } else {
+        map_ptr = g_mg_syscalls->mmap(NULL, map_length, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if(map_ptr == MAP_FAILED) {
+        UNLOCK_MG();
+        return NULL;
+    }
+
+    mapguard_cache_entry_t *mce = find_free_mce();
+    mce->start = map_ptr;
+    mce->size = rounded_length;
+    mce->immutable_prot |= prot;
+    mce->current_prot = prot;
+    mce->alloc_flags = flags | MG_ALLOC_EXPLICIT;
+
+    if(flags & MG_ALLOC_GUARD_PAGES) {
+        mce->start += g_page_size;
+    }
+
+    mapguard_cache_insert(&g_map_cache, mce);
+
+    if(flags & MG_ALLOC_GUARD_PAGES) {
+        mark_guard_pages(mce);
+    }
+
+    if((flags & MG_ALLOC_POISON) && (prot & PROT_WRITE) && g_mg_syscalls->backed) {
+        poison_pages(mce->start, rounded_length);
+    }
+
+    void *ptr = mce->start;
+    UNLOCK_MG();
+    return ptr;
+}
+
+/* Returns an allocation made by mapguard_alloc(), including its
+ * guard pages, to the kernel */
+int32_t mapguard_free(void *p) {
+    LOCK_MG();
+
+    mapguard_cache_entry_t *mce = get_cache_entry(p);
+
+    if(mce == NULL || mce->start != p) {
+        UNLOCK_MG();
+        errno = EINVAL;
+        return ERROR;
+    }
+
+    int32_t ret = g_mg_syscalls->munmap(mce->start, mce->size);
+
+    if(ret == 0) {
+        unmap_guard_pages(mce);
+        mapguard_cache_remove(&g_map_cache, mce);
+        free_mce(mce);
+    }
+
+    UNLOCK_MG();
+    return ret;
+}
+
+/* Changes the protections of an entire allocation made by
+ * mapguard_alloc(), enforcing MG_ALLOC_PREVENT_WX */
+int32_t mapguard_protect(void *p, int prot) {
+    LOCK_MG();
+
+    mapguard_cache_entry_t *mce = get_cache_entry(p);
+
+    if(mce == NULL || mce->start != p) {
+        UNLOCK_MG();
+        errno = EINVAL;
+        return ERROR;
+    }
+
+    if(mce->alloc_flags & MG_ALLOC_PREVENT_WX) {
+        bool wx = (prot & PROT_WRITE) && (prot & PROT_EXEC);
+        bool to_x = (prot & PROT_EXEC) && (mce->immutable_prot & PROT_WRITE);
+        bool from_x = (prot & PROT_WRITE) && (mce->immutable_prot & PROT_EXEC);
+
+        if(wx || to_x || from_x) {
+            SYSLOG("Preventing W^X violation on allocation %p", p);
+            MAYBE_PANIC();
+            UNLOCK_MG();
+            errno = EACCES;
+            return ERROR;
+        }
+    }
+
+    int32_t ret = g_mg_syscalls->mprotect(mce->start, mce->size, prot);
+
+    if(ret == 0) {
+        mce->immutable_prot |= prot;
+        mce->current_prot = prot;
+    }
+
+    UNLOCK_MG();
+    return ret;
+}
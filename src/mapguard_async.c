@@ -0,0 +1,295 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+/* Asynchronous guard page installation (MG_ASYNC_GUARD_PAGES)
+ *
+ * Installing two guard pages costs two mprotect and two madvise
+ * syscalls on every mmap. In this mode the mmap hook reserves the
+ * guard page address space as part of the mapping, marks both
+ * guards MG_GUARD_PENDING and queues the entry. A worker thread
+ * then applies the protections. This trades a short window where
+ * the guard pages are still accessible for lower mmap latency.
+ * The worker takes up to MG_ASYNC_GUARD_BATCH entries off the
+ * queue at a time and guards all of them with one madvise batch.
+ *
+ * The queue is protected by _mg_mutex, same as the mapping cache.
+ * The worker installs guards with the lock held so an entry can
+ * never be unmapped, and its address reused, while the worker is
+ * protecting it. munmap and mremap install pending guards before
+ * proceeding.
+ *
+ * The exposure window is bounded: whenever the oldest queued entry
+ * has waited longer than MG_ASYNC_GUARD_WINDOW_NS the next hook to
+ * enqueue work installs it synchronously */
+
+extern mapguard_policy_t g_mapguard_policy;
+extern mapguard_stats_t g_mapguard_stats;
+
+#if THREAD_SUPPORT
+
+typedef struct {
+    mapguard_cache_entry_t *mce;
+    void *start;
+    uint64_t enqueue_ns;
+} mapguard_guard_work_t;
+
+static mapguard_guard_work_t g_guard_queue[MG_ASYNC_GUARD_QUEUE_SIZE];
+static uint32_t g_guard_queue_head;
+static uint32_t g_guard_queue_count;
+
+static pthread_cond_t g_guard_queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t g_guard_worker;
+
+/* 0 = not running, 1 = starting, 2 = running */
+static int32_t g_guard_worker_state;
+
+/* Set under _mg_mutex to make the worker drain the queue and exit */
+static bool g_guard_worker_stop;
+
+/* Applies the protections for any pending guard pages on mce.
+ * Must be called with _mg_mutex held */
+void install_pending_guards(mapguard_cache_entry_t *mce) {
+    if(mce->guarded_b == MG_GUARD_PENDING) {
+        map_bottom_guard_page(mce);
+    }
+
+    if(mce->guarded_t == MG_GUARD_PENDING) {
+        map_top_guard_page(mce);
+    }
+}
+
+static bool guard_queue_pop(mapguard_guard_work_t *work) {
+    if(g_guard_queue_count == 0) {
+        return false;
+    }
+
+    *work = g_guard_queue[g_guard_queue_head];
+    g_guard_queue_head = (g_guard_queue_head + 1) % MG_ASYNC_GUARD_QUEUE_SIZE;
+    g_guard_queue_count--;
+    g_mapguard_stats.guard_queue_depth = g_guard_queue_count;
+    return true;
+}
+
+/* Takes up to max entries off the queue and installs all of
+ * their pending guard pages at once. Returns how many entries
+ * were taken off the queue */
+static uint32_t guard_queue_complete(uint32_t max) {
+    mapguard_guard_work_t work[MG_ASYNC_GUARD_BATCH];
+    void *pages[MG_ASYNC_GUARD_BATCH * 2];
+    uint32_t popped = 0;
+    uint32_t count = 0;
+    size_t page_count = 0;
+
+    while(popped < MIN(max, MG_ASYNC_GUARD_BATCH) && guard_queue_pop(&work[count])) {
+        mapguard_cache_entry_t *mce = work[count].mce;
+        popped++;
+
+        /* The entry was unmapped, or reused for another mapping,
+         * after this work was queued. Nothing left to do */
+        if(mce->start != work[count].start || (mce->guarded_b != MG_GUARD_PENDING && mce->guarded_t != MG_GUARD_PENDING)) {
+            continue;
+        }
+
+        if(mce->guarded_b == MG_GUARD_PENDING) {
+            pages[page_count++] = mce->start - g_page_size;
+        }
+
+        if(mce->guarded_t == MG_GUARD_PENDING) {
+            pages[page_count++] = mce->start + mce->size;
+        }
+
+        count++;
+    }
+
+    install_guard_pages(g_mg_syscalls, pages, page_count);
+
+    uint64_t now = get_monotonic_ns();
+
+    for(uint32_t i = 0; i < count; i++) {
+        mapguard_cache_entry_t *mce = work[i].mce;
+        uint64_t window = now - work[i].enqueue_ns;
+
+        mce->guarded_b = (mce->guarded_b == MG_GUARD_PENDING) ? MG_GUARD_INSTALLED : mce->guarded_b;
+        mce->guarded_t = (mce->guarded_t == MG_GUARD_PENDING) ? MG_GUARD_INSTALLED : mce->guarded_t;
+        g_mapguard_stats.guard_window_ns_total += window;
+
+        if(window > g_mapguard_stats.guard_window_ns_max) {
+            g_mapguard_stats.guard_window_ns_max = window;
+        }
+    }
+
+    return popped;
+}
+
+/* Installs everything still queued. Must be called with _mg_mutex held */
+void guard_queue_drain(void) {
+    uint32_t n;
+
+    while((n = guard_queue_complete(MG_ASYNC_GUARD_BATCH)) != 0) {
+        g_mapguard_stats.guard_installs_sync += n;
+    }
+}
+
+/* Queues guard page installation for a freshly mapped entry
+ * whose guard page address space is already reserved. Must be
+ * called with _mg_mutex held */
+void guard_queue_push(mapguard_cache_entry_t *mce) {
+    uint64_t now = get_monotonic_ns();
+    uint32_t expired = 0;
+
+    /* Enforce the exposure window bound if the worker is behind */
+    while(expired < g_guard_queue_count &&
+          now - g_guard_queue[(g_guard_queue_head + expired) % MG_ASYNC_GUARD_QUEUE_SIZE].enqueue_ns > MG_ASYNC_GUARD_WINDOW_NS) {
+        expired++;
+    }
+
+    while(expired != 0) {
+        uint32_t n = guard_queue_complete(expired);
+        g_mapguard_stats.guard_installs_sync += n;
+        expired -= n;
+    }
+
+    if(g_guard_queue_count == MG_ASYNC_GUARD_QUEUE_SIZE || g_guard_worker_state == 0) {
+        mark_guard_pages(mce);
+        g_mapguard_stats.guard_installs_sync++;
+        return;
+    }
+
+    mce->guarded_b = MG_GUARD_PENDING;
+    mce->guarded_t = MG_GUARD_PENDING;
+
+    uint32_t tail = (g_guard_queue_head + g_guard_queue_count) % MG_ASYNC_GUARD_QUEUE_SIZE;
+    g_guard_queue[tail].mce = mce;
+    g_guard_queue[tail].start = mce->start;
+    g_guard_queue[tail].enqueue_ns = now;
+    g_guard_queue_count++;
+
+    g_mapguard_stats.guard_queue_depth = g_guard_queue_count;
+
+    if(g_guard_queue_count > g_mapguard_stats.guard_queue_max_depth) {
+        g_mapguard_stats.guard_queue_max_depth = g_guard_queue_count;
+    }
+
+    pthread_cond_signal(&g_guard_queue_cond);
+}
+
+static void *guard_worker_main(void *arg) {
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    LOCK_MG();
+
+    while(true) {
+        uint32_t n = guard_queue_complete(MG_ASYNC_GUARD_BATCH);
+
+        if(n == 0 && g_guard_worker_stop) {
+            break;
+        }
+
+        if(n == 0) {
+            /* The mutex is released while we wait */
+            MG_SEQ_BUMP();
+            pthread_cond_wait(&g_guard_queue_cond, &_mg_mutex);
+            MG_SEQ_BUMP();
+            continue;
+        }
+
+        g_mapguard_stats.guard_installs_async += n;
+
+        /* Give hooked calls a chance at the lock between batches */
+        UNLOCK_MG();
+        LOCK_MG();
+    }
+
+    /* Anything queued from now on is guarded synchronously */
+    __atomic_store_n(&g_guard_worker_state, 0, __ATOMIC_RELEASE);
+    UNLOCK_MG();
+    return NULL;
+}
+
+/* Starts the worker the first time it is needed. This must be
+ * called without _mg_mutex held because pthread_create will
+ * call our mmap hook to allocate the thread stack */
+void start_guard_worker(void) {
+    if(g_mapguard_policy.async_guard_pages == 0 || __atomic_load_n(&g_guard_worker_state, __ATOMIC_ACQUIRE) != 0) {
+        return;
+    }
+
+    int32_t expected = 0;
+
+    if(__atomic_compare_exchange_n(&g_guard_worker_state, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) == false) {
+        return;
+    }
+
+    if(pthread_create(&g_guard_worker, NULL, guard_worker_main, NULL) != 0) {
+        LOG_ERROR("Failed to start the guard page worker, installing guard pages synchronously");
+        LOCK_MG();
+        g_mapguard_policy.async_guard_pages = 0;
+        __atomic_store_n(&g_guard_worker_state, 0, __ATOMIC_RELEASE);
+        guard_queue_drain();
+        UNLOCK_MG();
+        return;
+    }
+
+    __atomic_store_n(&g_guard_worker_state, 2, __ATOMIC_RELEASE);
+}
+
+/* Guards everything still queued and waits for the worker to
+ * exit. Called from mapguard_dtor without _mg_mutex held */
+void stop_guard_worker(void) {
+    if(__atomic_load_n(&g_guard_worker_state, __ATOMIC_ACQUIRE) != 2) {
+        return;
+    }
+
+    LOCK_MG();
+    g_guard_worker_stop = true;
+    pthread_cond_signal(&g_guard_queue_cond);
+    UNLOCK_MG();
+
+    pthread_join(g_guard_worker, NULL);
+}
+
+/* Forking while the worker, or any other thread, holds _mg_mutex
+ * would leave the child with a lock that is never released */
+static void guard_atfork_prepare(void) {
+    LOCK_MG();
+}
+
+static void guard_atfork_parent(void) {
+    UNLOCK_MG();
+}
+
+/* The worker thread does not exist in the child. Install anything
+ * that was pending and let the next mmap start a new worker */
+static void guard_atfork_child(void) {
+    g_guard_worker_state = 0;
+    guard_queue_drain();
+    UNLOCK_MG();
+}
+
+void async_guard_init(void) {
+    pthread_atfork(guard_atfork_prepare, guard_atfork_parent, guard_atfork_child);
+}
+#else
+void install_pending_guards(mapguard_cache_entry_t *mce) {
+}
+
+void guard_queue_drain(void) {
+}
+
+void guard_queue_push(mapguard_cache_entry_t *mce) {
+    mark_guard_pages(mce);
+}
+
+void start_guard_worker(void) {
+}
+
+void stop_guard_worker(void) {
+}
+
+void async_guard_init(void) {
+    LOG("MG_ASYNC_GUARD_PAGES requires THREAD_SUPPORT, installing guard pages synchronously");
+}
+#endif
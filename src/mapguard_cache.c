@@ -0,0 +1,610 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+/* Mapping cache backends
+ *
+ * The mapping cache answers one question on every hooked call:
+ * which tracked mapping, if any, contains this address. The best
+ * index for that depends on how many mappings a process has so
+ * the cache is an ops table with several implementations:
+ *
+ * vector - Unordered slots in fixed size chunks, lookups are a
+ *          linear scan. Removal frees the slot in place
+ * array  - A sorted array of entry pointers allocated with mmap,
+ *          binary search lookups. Fast and compact for small caches
+ * tree   - A treap linked through the cache entries themselves,
+ *          O(log n) lookups, inserts and removals at any size
+ *
+ * MG_CACHE_BACKEND selects one of these by name. The default, auto,
+ * starts with the array and promotes it to the tree once the number
+ * of entries crosses g_cache_tree_threshold. Entries are ordered by
+ * their start address with the entry pointer as a tie breaker so
+ * that overlapping stale entries never break the ordering */
+
+extern mapguard_policy_t g_mapguard_policy;
+extern mapguard_stats_t g_mapguard_stats;
+
+extern void *(*g_real_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+extern int (*g_real_munmap)(void *addr, size_t length);
+extern void *(*g_real_mremap)(void *__addr, size_t __old_len, size_t __new_len, int __flags, ...);
+
+mapguard_cache_t g_map_cache;
+
+/* Entry count at which the auto backend switches from the sorted
+ * array to the tree. mapguard_calibrate may lower or raise it */
+size_t g_cache_tree_threshold = MG_CACHE_TREE_THRESHOLD;
+
+static inline bool cache_entry_before(mapguard_cache_entry_t *a, mapguard_cache_entry_t *b) {
+    return a->start < b->start || (a->start == b->start && a < b);
+}
+
+static inline bool cache_entry_contains(mapguard_cache_entry_t *mce, void *addr) {
+    return mce != NULL && addr >= mce->start && addr < mce->start + mce->size;
+}
+
+/* vector backend. Everything is mapped with g_real_mmap so
+ * growing it never calls malloc or the hooks while _mg_mutex is
+ * held, and nothing is ever copied. The chunk directory is only
+ * reserved, its pages are touched as chunks are added */
+#define MG_CACHE_CHUNK_SIZE ROUND_UP_PAGE(MG_CACHE_CHUNK_SLOTS * sizeof(mapguard_cache_entry_t *))
+#define MG_CACHE_DIRECTORY_SIZE ROUND_UP_PAGE(MG_CACHE_MAX_CHUNKS * sizeof(mapguard_cache_entry_t **))
+
+static inline mapguard_cache_entry_t **vector_slot(mapguard_cache_t *cache, size_t i) {
+    return &cache->chunks[i / MG_CACHE_CHUNK_SLOTS][i % MG_CACHE_CHUNK_SLOTS];
+}
+
+/* Free slots link to the next free slot plus one, shifted
+ * left with the low bit set so they never look like entries */
+static inline bool vector_slot_is_free(mapguard_cache_entry_t *slot) {
+    return ((uintptr_t) slot & 1) != 0;
+}
+
+static void vector_cache_init(mapguard_cache_t *cache) {
+    cache->chunks = NULL;
+    cache->slots_used = 0;
+    cache->free_slot = 0;
+}
+
+static void vector_cache_destroy(mapguard_cache_t *cache) {
+    if(cache->chunks != NULL) {
+        for(size_t i = 0; i < MG_CACHE_MAX_CHUNKS && cache->chunks[i] != NULL; i++) {
+            g_real_munmap(cache->chunks[i], MG_CACHE_CHUNK_SIZE);
+        }
+
+        g_real_munmap(cache->chunks, MG_CACHE_DIRECTORY_SIZE);
+    }
+
+    vector_cache_init(cache);
+}
+
+static void *vector_cache_map(size_t length) {
+    void *p = g_real_mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if(p == MAP_FAILED) {
+        LOG_AND_ABORT("Failed to map %zu bytes for the mapping cache", length);
+    }
+
+    exclude_from_core(p, length);
+    return p;
+}
+
+static void vector_cache_insert(mapguard_cache_t *cache, mapguard_cache_entry_t *mce) {
+    size_t i;
+
+    if(cache->free_slot != 0) {
+        i = cache->free_slot - 1;
+        cache->free_slot = (uintptr_t) *vector_slot(cache, i) >> 1;
+    } else {
+        i = cache->slots_used;
+
+        if(i == MG_CACHE_MAX_CHUNKS * MG_CACHE_CHUNK_SLOTS) {
+            LOG_AND_ABORT("The mapping cache is full at %zu entries", i);
+        }
+
+        if(cache->chunks == NULL) {
+            cache->chunks = vector_cache_map(MG_CACHE_DIRECTORY_SIZE);
+        }
+
+        if(cache->chunks[i / MG_CACHE_CHUNK_SLOTS] == NULL) {
+            cache->chunks[i / MG_CACHE_CHUNK_SLOTS] = vector_cache_map(MG_CACHE_CHUNK_SIZE);
+        }
+
+        cache->slots_used++;
+    }
+
+    *vector_slot(cache, i) = mce;
+    mce->cache_index = i;
+}
+
+static void vector_cache_remove(mapguard_cache_t *cache, mapguard_cache_entry_t *mce) {
+    mapguard_cache_entry_t **slot = vector_slot(cache, mce->cache_index);
+
+    if(*slot != mce) {
+        LOG_AND_ABORT("Cache entry %p for %p is missing from slot %d", mce, mce->start, mce->cache_index);
+    }
+
+    *slot = (mapguard_cache_entry_t *) ((cache->free_slot << 1) | 1);
+    cache->free_slot = mce->cache_index + 1;
+}
+
+static void *vector_cache_for_each(mapguard_cache_t *cache, mapguard_cache_callback_t *cb, void *data) {
+    for(size_t i = 0; i < cache->slots_used; i++) {
+        mapguard_cache_entry_t *mce = *vector_slot(cache, i);
+
+        if(vector_slot_is_free(mce)) {
+            continue;
+        }
+
+        void *ret = cb(mce, data);
+
+        if(ret != NULL) {
+            return ret;
+        }
+    }
+
+    return NULL;
+}
+
+static mapguard_cache_entry_t *vector_cache_lookup(mapguard_cache_t *cache, void *addr) {
+    return (mapguard_cache_entry_t *) vector_cache_for_each(cache, is_mapguard_entry_cached, addr);
+}
+
+static mapguard_cache_entry_t *vector_cache_next(mapguard_cache_t *cache, void *addr) {
+    mapguard_cache_entry_t *best = NULL;
+
+    for(size_t i = 0; i < cache->slots_used; i++) {
+        mapguard_cache_entry_t *mce = *vector_slot(cache, i);
+
+        if(vector_slot_is_free(mce) == false && mce->start >= addr && (best == NULL || mce->start < best->start)) {
+            best = mce;
+        }
+    }
+
+    return best;
+}
+
+/* array backend */
+static void array_cache_init(mapguard_cache_t *cache) {
+    cache->array = NULL;
+    cache->array_capacity = 0;
+}
+
+static void array_cache_destroy(mapguard_cache_t *cache) {
+    if(cache->array != NULL) {
+        g_real_munmap(cache->array, cache->array_capacity * sizeof(mapguard_cache_entry_t *));
+    }
+
+    array_cache_init(cache);
+}
+
+static void array_cache_reserve(mapguard_cache_t *cache, size_t count) {
+    if(count <= cache->array_capacity) {
+        return;
+    }
+
+    size_t capacity = cache->array_capacity ? cache->array_capacity : g_page_size / sizeof(mapguard_cache_entry_t *);
+
+    while(capacity < count) {
+        capacity *= 2;
+    }
+
+    size_t old_size = cache->array_capacity * sizeof(mapguard_cache_entry_t *);
+    size_t new_size = capacity * sizeof(mapguard_cache_entry_t *);
+    void *p;
+
+    /* mremap lets the kernel move the pages instead of us copying them */
+    if(cache->array != NULL) {
+        p = g_real_mremap(cache->array, old_size, new_size, MREMAP_MAYMOVE);
+    } else {
+        p = g_real_mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if(p == MAP_FAILED) {
+        LOG_AND_ABORT("Failed to grow the mapping cache array to %zu entries", capacity);
+    }
+
+    cache->array = p;
+    cache->array_capacity = capacity;
+}
+
+/* Returns the index of the first entry not ordered before mce */
+static size_t array_cache_lower_bound(mapguard_cache_t *cache, mapguard_cache_entry_t *mce) {
+    size_t lo = 0;
+    size_t hi = cache->count;
+
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if(cache_entry_before(cache->array[mid], mce)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static void array_cache_insert(mapguard_cache_t *cache, mapguard_cache_entry_t *mce) {
+    array_cache_reserve(cache, cache->count + 1);
+
+    size_t i = array_cache_lower_bound(cache, mce);
+    memmove(&cache->array[i + 1], &cache->array[i], (cache->count - i) * sizeof(mapguard_cache_entry_t *));
+    cache->array[i] = mce;
+}
+
+static void array_cache_remove(mapguard_cache_t *cache, mapguard_cache_entry_t *mce) {
+    size_t i = array_cache_lower_bound(cache, mce);
+
+    if(i == cache->count || cache->array[i] != mce) {
+        LOG_AND_ABORT("Cache entry %p for %p is missing from the array", mce, mce->start);
+    }
+
+    memmove(&cache->array[i], &cache->array[i + 1], (cache->count - i - 1) * sizeof(mapguard_cache_entry_t *));
+}
+
+static mapguard_cache_entry_t *array_cache_lookup(mapguard_cache_t *cache, void *addr) {
+    size_t lo = 0;
+    size_t hi = cache->count;
+
+    /* Find the first entry that starts above addr, the
+     * one before it is the only candidate to contain it */
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if(cache->array[mid]->start <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if(lo == 0 || cache_entry_contains(cache->array[lo - 1], addr) == false) {
+        return NULL;
+    }
+
+    return cache->array[lo - 1];
+}
+
+static mapguard_cache_entry_t *array_cache_next(mapguard_cache_t *cache, void *addr) {
+    size_t lo = 0;
+    size_t hi = cache->count;
+
+    while(lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if(cache->array[mid]->start < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return (lo < cache->count) ? cache->array[lo] : NULL;
+}
+
+static void *array_cache_for_each(mapguard_cache_t *cache, mapguard_cache_callback_t *cb, void *data) {
+    for(size_t i = 0; i < cache->count; i++) {
+        void *ret = cb(cache->array[i], data);
+
+        if(ret != NULL) {
+            return ret;
+        }
+    }
+
+    return NULL;
+}
+
+/* tree backend */
+static void tree_cache_init(mapguard_cache_t *cache) {
+    cache->root = NULL;
+}
+
+static void tree_cache_destroy(mapguard_cache_t *cache) {
+    cache->root = NULL;
+}
+
+static mapguard_cache_entry_t *treap_rotate_right(mapguard_cache_entry_t *node) {
+    mapguard_cache_entry_t *left = node->tree_left;
+    node->tree_left = left->tree_right;
+    left->tree_right = node;
+    return left;
+}
+
+static mapguard_cache_entry_t *treap_rotate_left(mapguard_cache_entry_t *node) {
+    mapguard_cache_entry_t *right = node->tree_right;
+    node->tree_right = right->tree_left;
+    right->tree_left = node;
+    return right;
+}
+
+static mapguard_cache_entry_t *treap_insert(mapguard_cache_entry_t *node, mapguard_cache_entry_t *mce) {
+    if(node == NULL) {
+        return mce;
+    }
+
+    if(cache_entry_before(mce, node)) {
+        node->tree_left = treap_insert(node->tree_left, mce);
+
+        if(node->tree_left->tree_priority > node->tree_priority) {
+            node = treap_rotate_right(node);
+        }
+    } else {
+        node->tree_right = treap_insert(node->tree_right, mce);
+
+        if(node->tree_right->tree_priority > node->tree_priority) {
+            node = treap_rotate_left(node);
+        }
+    }
+
+    return node;
+}
+
+static mapguard_cache_entry_t *treap_merge(mapguard_cache_entry_t *a, mapguard_cache_entry_t *b) {
+    if(a == NULL) {
+        return b;
+    }
+
+    if(b == NULL) {
+        return a;
+    }
+
+    if(a->tree_priority > b->tree_priority) {
+        a->tree_right = treap_merge(a->tree_right, b);
+        return a;
+    }
+
+    b->tree_left = treap_merge(a, b->tree_left);
+    return b;
+}
+
+static mapguard_cache_entry_t *treap_remove(mapguard_cache_entry_t *node, mapguard_cache_entry_t *mce) {
+    if(node == NULL) {
+        LOG_AND_ABORT("Cache entry %p for %p is missing from the tree", mce, mce->start);
+    }
+
+    if(node == mce) {
+        return treap_merge(node->tree_left, node->tree_right);
+    }
+
+    if(cache_entry_before(mce, node)) {
+        node->tree_left = treap_remove(node->tree_left, mce);
+    } else {
+        node->tree_right = treap_remove(node->tree_right, mce);
+    }
+
+    return node;
+}
+
+static void tree_cache_insert(mapguard_cache_t *cache, mapguard_cache_entry_t *mce) {
+    mce->tree_left = NULL;
+    mce->tree_right = NULL;
+    mce->tree_priority = (uint32_t) rand_uint64();
+    cache->root = treap_insert(cache->root, mce);
+}
+
+static void tree_cache_remove(mapguard_cache_t *cache, mapguard_cache_entry_t *mce) {
+    cache->root = treap_remove(cache->root, mce);
+    mce->tree_left = NULL;
+    mce->tree_right = NULL;
+}
+
+static mapguard_cache_entry_t *tree_cache_lookup(mapguard_cache_t *cache, void *addr) {
+    mapguard_cache_entry_t *node = cache->root;
+    mapguard_cache_entry_t *best = NULL;
+
+    while(node != NULL) {
+        if(node->start <= addr) {
+            best = node;
+            node = node->tree_right;
+        } else {
+            node = node->tree_left;
+        }
+    }
+
+    return cache_entry_contains(best, addr) ? best : NULL;
+}
+
+static mapguard_cache_entry_t *tree_cache_next(mapguard_cache_t *cache, void *addr) {
+    mapguard_cache_entry_t *node = cache->root;
+    mapguard_cache_entry_t *best = NULL;
+
+    while(node != NULL) {
+        if(node->start >= addr) {
+            best = node;
+            node = node->tree_left;
+        } else {
+            node = node->tree_right;
+        }
+    }
+
+    return best;
+}
+
+static void *treap_for_each(mapguard_cache_entry_t *node, mapguard_cache_callback_t *cb, void *data) {
+    if(node == NULL) {
+        return NULL;
+    }
+
+    void *ret = treap_for_each(node->tree_left, cb, data);
+
+    if(ret != NULL) {
+        return ret;
+    }
+
+    /* Read the right link first, the callback may remove node */
+    mapguard_cache_entry_t *right = node->tree_right;
+    ret = cb(node, data);
+
+    if(ret != NULL) {
+        return ret;
+    }
+
+    return treap_for_each(right, cb, data);
+}
+
+static void *tree_cache_for_each(mapguard_cache_t *cache, mapguard_cache_callback_t *cb, void *data) {
+    return treap_for_each(cache->root, cb, data);
+}
+
+const mapguard_cache_ops_t g_cache_backends[MG_CACHE_BACKEND_COUNT] = {
+    [MG_CACHE_BACKEND_VECTOR] = {
+        .id = MG_CACHE_BACKEND_VECTOR,
+        .name = "vector",
+        .init = vector_cache_init,
+        .destroy = vector_cache_destroy,
+        .insert = vector_cache_insert,
+        .remove = vector_cache_remove,
+        .lookup = vector_cache_lookup,
+        .next = vector_cache_next,
+        .for_each = vector_cache_for_each,
+    },
+    [MG_CACHE_BACKEND_ARRAY] = {
+        .id = MG_CACHE_BACKEND_ARRAY,
+        .name = "array",
+        .init = array_cache_init,
+        .destroy = array_cache_destroy,
+        .insert = array_cache_insert,
+        .remove = array_cache_remove,
+        .lookup = array_cache_lookup,
+        .next = array_cache_next,
+        .for_each = array_cache_for_each,
+    },
+    [MG_CACHE_BACKEND_TREE] = {
+        .id = MG_CACHE_BACKEND_TREE,
+        .name = "tree",
+        .init = tree_cache_init,
+        .destroy = tree_cache_destroy,
+        .insert = tree_cache_insert,
+        .remove = tree_cache_remove,
+        .lookup = tree_cache_lookup,
+        .next = tree_cache_next,
+        .for_each = tree_cache_for_each,
+    },
+};
+
+/* Returns the backend called name or NULL */
+const mapguard_cache_ops_t *mapguard_cache_backend(const char *name) {
+    for(int32_t i = 0; i < MG_CACHE_BACKEND_COUNT; i++) {
+        if(strcmp(g_cache_backends[i].name, name) == 0) {
+            return &g_cache_backends[i];
+        }
+    }
+
+    return NULL;
+}
+
+void mapguard_cache_init(mapguard_cache_t *cache, const mapguard_cache_ops_t *ops) {
+    memset(cache, 0x0, sizeof(mapguard_cache_t));
+    cache->ops = ops;
+    cache->ops->init(cache);
+}
+
+void mapguard_cache_destroy(mapguard_cache_t *cache) {
+    cache->ops->destroy(cache);
+    cache->count = 0;
+}
+
+static void *cache_migrate_entry(void *mce, void *data) {
+    mapguard_cache_t *cache = (mapguard_cache_t *) data;
+    cache->ops->insert(cache, (mapguard_cache_entry_t *) mce);
+    cache->count++;
+    return NULL;
+}
+
+/* Moves every entry into a new backend. The array never touches
+ * the tree links so moving between the two is safe while walking */
+void mapguard_cache_set_backend(mapguard_cache_t *cache, const mapguard_cache_ops_t *ops) {
+    if(cache->ops == ops) {
+        return;
+    }
+
+    mapguard_cache_t tmp;
+    mapguard_cache_init(&tmp, ops);
+    tmp.auto_promote = cache->auto_promote;
+
+    if(ops->id == MG_CACHE_BACKEND_ARRAY) {
+        array_cache_reserve(&tmp, cache->count);
+    }
+
+    cache->ops->for_each(cache, cache_migrate_entry, &tmp);
+    cache->ops->destroy(cache);
+    memcpy(cache, &tmp, sizeof(mapguard_cache_t));
+
+    if(cache == &g_map_cache) {
+        g_mapguard_stats.cache_backend = ops->id;
+    }
+}
+
+void mapguard_cache_reserve(mapguard_cache_t *cache, size_t count) {
+    if(cache->auto_promote && count > g_cache_tree_threshold) {
+        mapguard_cache_set_backend(cache, &g_cache_backends[MG_CACHE_BACKEND_TREE]);
+    }
+
+    if(cache->ops->id == MG_CACHE_BACKEND_ARRAY) {
+        array_cache_reserve(cache, count);
+    }
+}
+
+void mapguard_cache_insert(mapguard_cache_t *cache, mapguard_cache_entry_t *mce) {
+    if(cache->auto_promote && cache->ops->id == MG_CACHE_BACKEND_ARRAY && cache->count >= g_cache_tree_threshold) {
+        LOG("Promoting the mapping cache to a tree at %zu entries", cache->count);
+        mapguard_cache_set_backend(cache, &g_cache_backends[MG_CACHE_BACKEND_TREE]);
+
+        if(cache == &g_map_cache) {
+            g_mapguard_stats.cache_promotions++;
+        }
+    }
+
+    cache->ops->insert(cache, mce);
+    cache->count++;
+}
+
+void mapguard_cache_remove(mapguard_cache_t *cache, mapguard_cache_entry_t *mce) {
+    cache->ops->remove(cache, mce);
+    cache->count--;
+}
+
+mapguard_cache_entry_t *mapguard_cache_lookup(mapguard_cache_t *cache, void *addr) {
+    return cache->ops->lookup(cache, addr);
+}
+
+mapguard_cache_entry_t *mapguard_cache_next(mapguard_cache_t *cache, void *addr) {
+    return cache->ops->next(cache, addr);
+}
+
+void *mapguard_cache_for_each(mapguard_cache_t *cache, mapguard_cache_callback_t *cb, void *data) {
+    return cache->ops->for_each(cache, cb, data);
+}
+
+/* Changes the start address of a cached entry. The array and
+ * tree are ordered by start so the entry has to be reinserted */
+void mapguard_cache_rekey(mapguard_cache_t *cache, mapguard_cache_entry_t *mce, void *start) {
+    mapguard_cache_remove(cache, mce);
+    mce->start = start;
+    mapguard_cache_insert(cache, mce);
+}
+
+/* Sets up g_map_cache from MG_CACHE_BACKEND, called from mapguard_ctor */
+void cache_backend_init(void) {
+    char *name = getenv(MG_CACHE_BACKEND);
+    const mapguard_cache_ops_t *ops = NULL;
+
+    if(name != NULL && strcmp(name, "auto") != 0) {
+        ops = mapguard_cache_backend(name);
+
+        if(ops == NULL) {
+            LOG_ERROR("Unknown MG_CACHE_BACKEND %s, using auto", name);
+        }
+    }
+
+    if(ops != NULL) {
+        mapguard_cache_init(&g_map_cache, ops);
+    } else {
+        mapguard_cache_init(&g_map_cache, &g_cache_backends[MG_CACHE_BACKEND_ARRAY]);
+        g_map_cache.auto_promote = true;
+    }
+
+    g_mapguard_stats.cache_backend = g_map_cache.ops->id;
+}
@@ -0,0 +1,419 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+/* Startup self calibration (MG_SELF_CALIBRATE)
+ *
+ * The cheapest way to install a guard page, fill memory with the
+ * poison byte or serialize our hooks depends on the kernel version,
+ * the CPU and the number of cores. When enabled mapguard_ctor probes
+ * for optional kernel features and times the candidate guard page
+ * and poisoning implementations on scratch mappings, then selects
+ * the fastest. It also finds the mapping cache size at which the
+ * tree backend overtakes the sorted array and uses it as the auto
+ * promotion threshold. The whole step is bounded by MG_CALIBRATION_BUDGET_NS
+ * and the results are reported through mapguard_get_stats() */
+
+extern mapguard_policy_t g_mapguard_policy;
+extern mapguard_stats_t g_mapguard_stats;
+
+extern size_t g_cache_tree_threshold;
+
+extern void *(*g_real_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+extern int (*g_real_munmap)(void *addr, size_t length);
+extern int (*g_real_mprotect)(void *addr, size_t len, int prot);
+
+uint8_t g_guard_method = MG_GUARD_METHOD_MPROTECT;
+
+static void poison_memset(void *p, size_t length) {
+    memset(p, MG_POISON_BYTE, length);
+}
+
+static void poison_store64(void *p, size_t length) {
+    uint64_t pattern = 0x0101010101010101ULL * MG_POISON_BYTE;
+    uint64_t *q = (uint64_t *) p;
+
+    /* Callers always poison whole pages */
+    for(size_t i = 0; i < length / sizeof(uint64_t); i++) {
+        q[i] = pattern;
+    }
+}
+
+#if __x86_64__
+static void poison_rep_stosb(void *p, size_t length) {
+    __asm__ volatile("rep stosb"
+                     : "+D"(p), "+c"(length)
+                     : "a"(MG_POISON_BYTE)
+                     : "memory");
+}
+#endif
+
+static void (*g_poison_fn)(void *, size_t) = poison_memset;
+
+static void (*const g_poison_candidates[])(void *, size_t) = {
+    [MG_POISON_METHOD_MEMSET] = poison_memset,
+    [MG_POISON_METHOD_STORE64] = poison_store64,
+#if __x86_64__
+    [MG_POISON_METHOD_REP_STOSB] = poison_rep_stosb,
+#endif
+};
+
+/* Fills length bytes at p with MG_POISON_BYTE using the
+ * implementation selected by calibration */
+void poison_pages(void *p, size_t length) {
+    if(g_mapguard_policy.perf_counters == 0) {
+        g_poison_fn(p, length);
+        return;
+    }
+
+    mapguard_perf_sample_t sample;
+    perf_begin(&sample);
+    g_poison_fn(p, length);
+    perf_end(&sample, MG_PERF_SCOPE_POISON);
+}
+
+static uint32_t g_features;
+static bool g_features_probed;
+
+static bool probe_guard_install(void) {
+    void *p = g_real_mmap(NULL, g_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(p == MAP_FAILED) {
+        return false;
+    }
+
+    int32_t ret = madvise(p, g_page_size, MADV_GUARD_INSTALL);
+    g_real_munmap(p, g_page_size);
+    return ret == 0;
+}
+
+static bool probe_procmap_query(void) {
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+
+    if(fd == -1) {
+        return false;
+    }
+
+    struct procmap_query q;
+    memset(&q, 0x0, sizeof(q));
+    q.size = sizeof(q);
+    q.query_addr = (uintptr_t) &probe_procmap_query;
+
+    int32_t ret = ioctl(fd, PROCMAP_QUERY, &q);
+    close(fd);
+    return ret == 0;
+}
+
+/* A zero length seal is a no-op on kernels that implement mseal */
+static bool probe_mseal(void) {
+    void *p = g_real_mmap(NULL, g_page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(p == MAP_FAILED) {
+        return false;
+    }
+
+    int32_t ret = syscall(__NR_mseal, p, 0, 0);
+    g_real_munmap(p, g_page_size);
+    return ret == 0;
+}
+
+/* glibc registers rseq for every thread when the kernel has it.
+ * Otherwise an invalid registration fails with EINVAL, not ENOSYS */
+static bool probe_rseq(void) {
+    const uint32_t *rseq_size = (const uint32_t *) dlsym(RTLD_DEFAULT, "__rseq_size");
+
+    if(rseq_size != NULL && *rseq_size != 0) {
+        return true;
+    }
+
+    return syscall(__NR_rseq, NULL, 0, 0, 0) == -1 && errno != ENOSYS;
+}
+
+/* We go straight to the syscalls because the libc
+ * pkey functions are hooked when MPK_SUPPORT is enabled */
+static bool probe_pkeys(void) {
+    int32_t pkey = syscall(SYS_pkey_alloc, 0, 0);
+
+    if(pkey < 0) {
+        return false;
+    }
+
+    syscall(SYS_pkey_free, pkey);
+    return true;
+}
+
+/* Returns a MG_FEATURE_* mask of the optional kernel features
+ * this process can use. The probes only run once */
+uint32_t mapguard_probe_features(void) {
+    if(g_features_probed) {
+        return g_features;
+    }
+
+    int32_t saved_errno = errno;
+
+    g_features |= probe_guard_install() ? MG_FEATURE_GUARD_INSTALL : 0;
+    g_features |= probe_procmap_query() ? MG_FEATURE_PROCMAP_QUERY : 0;
+    g_features |= probe_mseal() ? MG_FEATURE_MSEAL : 0;
+    g_features |= probe_rseq() ? MG_FEATURE_RSEQ : 0;
+    g_features |= probe_pkeys() ? MG_FEATURE_PKEYS : 0;
+    g_features |= madvise_batch_available() ? MG_FEATURE_PROCESS_MADVISE : 0;
+    g_features_probed = true;
+
+    errno = saved_errno;
+    return g_features;
+}
+
+/* Times installing MG_CALIBRATION_ROUNDS guard pages on every
+ * other page of a scratch mapping with the given method */
+static uint64_t time_guard_method(uint8_t method, uint64_t deadline) {
+    size_t length = g_page_size * MG_CALIBRATION_ROUNDS * 2;
+    void *p = g_real_mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(p == MAP_FAILED) {
+        return UINT64_MAX;
+    }
+
+    uint64_t start = get_monotonic_ns();
+    uint32_t rounds = 0;
+
+    for(; rounds < MG_CALIBRATION_ROUNDS && get_monotonic_ns() < deadline; rounds++) {
+        void *page = p + (g_page_size * rounds * 2);
+
+        if(method == MG_GUARD_METHOD_MADVISE) {
+            madvise(page, g_page_size, MADV_GUARD_INSTALL);
+        } else {
+            g_real_mprotect(page, g_page_size, PROT_NONE);
+            madvise(page, g_page_size, MADV_DONTNEED);
+        }
+    }
+
+    uint64_t elapsed = get_monotonic_ns() - start;
+    g_real_munmap(p, length);
+    return rounds ? elapsed / rounds : UINT64_MAX;
+}
+
+static uint64_t time_poison_method(uint8_t method, void *scratch, size_t length, uint64_t deadline) {
+    uint64_t start = get_monotonic_ns();
+    uint32_t rounds = 0;
+
+    for(; rounds < MG_CALIBRATION_ROUNDS && get_monotonic_ns() < deadline; rounds++) {
+        g_poison_candidates[method](scratch, length);
+    }
+
+    uint64_t elapsed = get_monotonic_ns() - start;
+    return rounds ? elapsed / rounds : UINT64_MAX;
+}
+
+/* Times lookup, remove and reinsert of random synthetic entries
+ * in a private cache holding count entries. The entries are never
+ * dereferenced as memory so their addresses can be anything */
+static uint64_t time_cache_backend(const mapguard_cache_ops_t *ops, mapguard_cache_entry_t *entries, size_t count, uint64_t deadline) {
+    mapguard_cache_t cache;
+    mapguard_cache_init(&cache, ops);
+
+    for(size_t i = 0; i < count; i++) {
+        mapguard_cache_insert(&cache, &entries[i]);
+    }
+
+    uint64_t start = get_monotonic_ns();
+    uint32_t rounds = 0;
+
+    for(; rounds < MG_CALIBRATION_ROUNDS && get_monotonic_ns() < deadline; rounds++) {
+        mapguard_cache_entry_t *mce = &entries[rand_uint64() % count];
+
+        if(mapguard_cache_lookup(&cache, mce->start + g_page_size) != mce) {
+            LOG_AND_ABORT("Cache backend %s failed calibration lookup", ops->name);
+        }
+
+        mapguard_cache_remove(&cache, mce);
+        mapguard_cache_insert(&cache, mce);
+    }
+
+    uint64_t elapsed = get_monotonic_ns() - start;
+    mapguard_cache_destroy(&cache);
+    return rounds ? elapsed / rounds : UINT64_MAX;
+}
+
+/* Doubles the synthetic cache size until the tree is cheaper
+ * than the array. If it never is the default threshold stays */
+static void calibrate_cache(mapguard_calibration_t *cal, uint64_t deadline) {
+    size_t length = ROUND_UP_PAGE(sizeof(mapguard_cache_entry_t) * MG_CALIBRATION_CACHE_ENTRIES);
+    mapguard_cache_entry_t *entries = g_real_mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    cal->cache_tree_threshold = g_cache_tree_threshold;
+
+    if(entries == MAP_FAILED) {
+        return;
+    }
+
+    for(size_t i = 0; i < MG_CALIBRATION_CACHE_ENTRIES; i++) {
+        entries[i].start = (void *) (MG_RAND_HINT_MIN + (i * 4 * g_page_size));
+        entries[i].size = g_page_size * 2;
+    }
+
+    for(size_t count = 256; count <= MG_CALIBRATION_CACHE_ENTRIES && get_monotonic_ns() < deadline; count *= 2) {
+        cal->cache_entries = count;
+        cal->cache_ns[MG_CACHE_BACKEND_VECTOR] = UINT64_MAX;
+        cal->cache_ns[MG_CACHE_BACKEND_ARRAY] = time_cache_backend(&g_cache_backends[MG_CACHE_BACKEND_ARRAY], entries, count, deadline);
+        cal->cache_ns[MG_CACHE_BACKEND_TREE] = time_cache_backend(&g_cache_backends[MG_CACHE_BACKEND_TREE], entries, count, deadline);
+
+        if(cal->cache_ns[MG_CACHE_BACKEND_TREE] < cal->cache_ns[MG_CACHE_BACKEND_ARRAY]) {
+            g_cache_tree_threshold = count;
+            cal->cache_tree_threshold = count;
+            break;
+        }
+    }
+
+    g_real_munmap(entries, length);
+}
+
+#if THREAD_SUPPORT
+typedef struct {
+    pthread_mutex_t mutex;
+    volatile uint64_t counter;
+    uint64_t deadline;
+} mapguard_lock_trial_t;
+
+static void *lock_contender(void *arg) {
+    mapguard_lock_trial_t *trial = (mapguard_lock_trial_t *) arg;
+
+    for(uint32_t i = 0; i < MG_CALIBRATION_LOCK_ROUNDS && get_monotonic_ns() < trial->deadline; i++) {
+        pthread_mutex_lock(&trial->mutex);
+        trial->counter++;
+        pthread_mutex_unlock(&trial->mutex);
+    }
+
+    return NULL;
+}
+
+/* Returns the cost of a lock and unlock pair of a mutex of type
+ * while a second thread is contending for it. That thread runs on
+ * a stack we map ourselves so creating it never enters our hooks */
+static uint64_t time_lock_method(int type, uint64_t deadline) {
+    mapguard_lock_trial_t trial;
+    pthread_mutexattr_t attr;
+    pthread_attr_t thread_attr;
+    pthread_t thread;
+    uint64_t ns = UINT64_MAX;
+
+    void *stack = g_real_mmap(NULL, MG_CALIBRATION_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(stack == MAP_FAILED) {
+        return ns;
+    }
+
+    trial.counter = 0;
+    trial.deadline = deadline;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, type);
+    pthread_mutex_init(&trial.mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setstack(&thread_attr, stack, MG_CALIBRATION_STACK_SIZE);
+
+    uint64_t start = get_monotonic_ns();
+
+    if(pthread_create(&thread, &thread_attr, lock_contender, &trial) == 0) {
+        lock_contender(&trial);
+        pthread_join(thread, NULL);
+
+        if(trial.counter != 0) {
+            ns = (get_monotonic_ns() - start) / trial.counter;
+        }
+    }
+
+    pthread_attr_destroy(&thread_attr);
+    pthread_mutex_destroy(&trial.mutex);
+    g_real_munmap(stack, MG_CALIBRATION_STACK_SIZE);
+    return ns;
+}
+#endif
+
+/* An adaptive mutex spins briefly before sleeping, which wins if
+ * another core usually releases the lock while we spin. Both
+ * types are timed with two threads contending for the lock */
+static void calibrate_lock(mapguard_calibration_t *cal, uint64_t deadline) {
+    cal->lock_method = MG_LOCK_METHOD_MUTEX;
+    cal->lock_ns[MG_LOCK_METHOD_MUTEX] = UINT64_MAX;
+    cal->lock_ns[MG_LOCK_METHOD_ADAPTIVE] = UINT64_MAX;
+
+#if THREAD_SUPPORT
+    if(sysconf(_SC_NPROCESSORS_ONLN) < 2 || get_monotonic_ns() > deadline) {
+        return;
+    }
+
+    cal->lock_ns[MG_LOCK_METHOD_MUTEX] = time_lock_method(PTHREAD_MUTEX_NORMAL, deadline);
+    cal->lock_ns[MG_LOCK_METHOD_ADAPTIVE] = time_lock_method(PTHREAD_MUTEX_ADAPTIVE_NP, deadline);
+
+    if(cal->lock_ns[MG_LOCK_METHOD_ADAPTIVE] < cal->lock_ns[MG_LOCK_METHOD_MUTEX]) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+        pthread_mutex_destroy(&_mg_mutex);
+        pthread_mutex_init(&_mg_mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+        cal->lock_method = MG_LOCK_METHOD_ADAPTIVE;
+    }
+#endif
+}
+
+/* Called from mapguard_ctor before any other thread can be
+ * using mapguard, so nothing here needs _mg_mutex */
+void mapguard_calibrate(void) {
+    mapguard_calibration_t *cal = &g_mapguard_stats.calibration;
+    uint64_t start = get_monotonic_ns();
+    uint64_t deadline = start + MG_CALIBRATION_BUDGET_NS;
+    int32_t saved_errno = errno;
+
+    cal->features = mapguard_probe_features();
+
+    /* Guard page installation */
+    cal->guard_ns[MG_GUARD_METHOD_MPROTECT] = time_guard_method(MG_GUARD_METHOD_MPROTECT, deadline);
+    cal->guard_ns[MG_GUARD_METHOD_MADVISE] = UINT64_MAX;
+
+    if(cal->features & MG_FEATURE_GUARD_INSTALL) {
+        cal->guard_ns[MG_GUARD_METHOD_MADVISE] = time_guard_method(MG_GUARD_METHOD_MADVISE, deadline);
+    }
+
+    if(cal->guard_ns[MG_GUARD_METHOD_MADVISE] < cal->guard_ns[MG_GUARD_METHOD_MPROTECT]) {
+        g_guard_method = MG_GUARD_METHOD_MADVISE;
+    }
+
+    cal->guard_method = g_guard_method;
+
+    /* Poisoning */
+    size_t length = g_page_size * MG_CALIBRATION_POISON_PAGES;
+    void *scratch = g_real_mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(scratch != MAP_FAILED) {
+        /* Fault the pages in first so we time the fill alone */
+        memset(scratch, 0x0, length);
+
+        for(uint8_t m = 0; m < MG_POISON_METHOD_COUNT; m++) {
+            cal->poison_ns[m] = UINT64_MAX;
+
+            if(g_poison_candidates[m] != NULL) {
+                cal->poison_ns[m] = time_poison_method(m, scratch, length, deadline);
+            }
+
+            if(cal->poison_ns[m] < cal->poison_ns[cal->poison_method]) {
+                cal->poison_method = m;
+            }
+        }
+
+        g_real_munmap(scratch, length);
+        g_poison_fn = g_poison_candidates[cal->poison_method];
+    }
+
+    calibrate_cache(cal, deadline);
+    calibrate_lock(cal, deadline);
+
+    cal->calibration_ns = get_monotonic_ns() - start;
+    errno = saved_errno;
+
+    LOG("Calibrated in %lu ns, features 0x%x guard method %d poison method %d lock method %d cache tree threshold %lu",
+        cal->calibration_ns, cal->features, cal->guard_method, cal->poison_method, cal->lock_method, cal->cache_tree_threshold);
+}
@@ -0,0 +1,128 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+/* Coalescing of adjacent cache entries (MG_COALESCE_MAPPINGS)
+ *
+ * The kernel merges adjacent anonymous VMAs with the same
+ * protections but the cache keeps one entry per mmap call. With
+ * this option a new or reprotected entry is merged with the
+ * entries directly below and above it when neither has guard
+ * pages and both have the same current and historical protections,
+ * so the cache stays about as large as the VMA list.
+ *
+ * No boundaries need to be remembered to undo a merge. Like the
+ * kernel we split an entry wherever a partial munmap or mprotect
+ * lands, so the affected range has an entry of its own before the
+ * hook updates or removes it.
+ *
+ * Everything here must be called with _mg_mutex held */
+
+extern mapguard_policy_t g_mapguard_policy;
+extern mapguard_stats_t g_mapguard_stats;
+
+/* Only plain anonymous entries are ever merged or split. An entry
+ * placed by lifetime must keep its key and birth until it dies */
+bool mce_coalescable(mapguard_cache_entry_t *mce) {
+    if(mce->guarded_b != MG_GUARD_NONE || mce->guarded_t != MG_GUARD_NONE || mce->fd_type != MG_FD_NONE || mce->alloc_flags != 0 ||
+       mce->lifetime_key != 0) {
+        return false;
+    }
+
+#if MPK_SUPPORT
+    if(mce->pkey != 0 || mce->xom_enabled != 0) {
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+static bool mce_compatible(mapguard_cache_entry_t *a, mapguard_cache_entry_t *b) {
+    return mce_coalescable(a) && mce_coalescable(b) && a->current_prot == b->current_prot && a->immutable_prot == b->immutable_prot;
+}
+
+/* Merges mce with compatible entries directly adjacent to it
+ * and returns the entry that now covers its range */
+mapguard_cache_entry_t *mce_coalesce(mapguard_cache_entry_t *mce) {
+    if(g_mapguard_policy.coalesce_mappings == 0 || mce_coalescable(mce) == false) {
+        return mce;
+    }
+
+    mapguard_cache_entry_t *prev = get_cache_entry(mce->start - 1);
+
+    if(prev != NULL && prev != mce && prev->start + prev->size == mce->start && mce_compatible(prev, mce)) {
+        prev->size += mce->size;
+        mapguard_cache_remove(&g_map_cache, mce);
+        free_mce(mce);
+        mce = prev;
+        g_mapguard_stats.coalesced_entries++;
+    }
+
+    mapguard_cache_entry_t *next = get_cache_entry(mce->start + mce->size);
+
+    if(next != NULL && next != mce && next->start == mce->start + mce->size && mce_compatible(mce, next)) {
+        mce->size += next->size;
+        mapguard_cache_remove(&g_map_cache, next);
+        free_mce(next);
+        g_mapguard_stats.coalesced_entries++;
+    }
+
+    return mce;
+}
+
+/* Splits [start, start + size) off into a new entry with the
+ * same protections as mce, which is shrunk to end at start */
+static mapguard_cache_entry_t *mce_split_at(mapguard_cache_entry_t *mce, void *start) {
+    mapguard_cache_entry_t *upper = find_free_mce();
+
+    upper->start = start;
+    upper->size = (mce->start + mce->size) - start;
+    upper->immutable_prot = mce->immutable_prot;
+    upper->current_prot = mce->current_prot;
+    mce->size = start - mce->start;
+    mapguard_cache_insert(&g_map_cache, upper);
+
+    g_mapguard_stats.coalesce_splits++;
+    return upper;
+}
+
+/* Splits a coalescable entry so the part of it inside
+ * [addr, addr + length) has an entry of its own, which is
+ * returned. Other entries are returned unchanged */
+mapguard_cache_entry_t *mce_isolate(mapguard_cache_entry_t *mce, void *addr, size_t length) {
+    if(g_mapguard_policy.coalesce_mappings == 0 || mce_coalescable(mce) == false) {
+        return mce;
+    }
+
+    void *start = MAX(addr, mce->start);
+    void *end = MIN(addr + length, mce->start + mce->size);
+
+    if(start >= end) {
+        return mce;
+    }
+
+    if(start > mce->start) {
+        mce = mce_split_at(mce, start);
+    }
+
+    if(end < mce->start + mce->size) {
+        mce_split_at(mce, end);
+    }
+
+    return mce;
+}
+
+/* Drops the entries covering [addr, addr + length) after it
+ * was unmapped, splitting the ones that straddle either end */
+void mce_unmap_range(void *addr, size_t length) {
+    void *end = addr + length;
+    mapguard_cache_entry_t *mce;
+
+    while(addr < end && (mce = get_cache_entry(addr)) != NULL && mce_coalescable(mce)) {
+        mce = mce_isolate(mce, addr, end - addr);
+        addr = mce->start + mce->size;
+        mapguard_cache_remove(&g_map_cache, mce);
+        free_mce(mce);
+    }
+}
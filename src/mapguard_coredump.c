@@ -0,0 +1,168 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+/* Core dump slimming
+ *
+ * Nothing a core dump is read for lives in mapguard's metadata,
+ * guard pages, quarantined sample slots or secret chunks, but
+ * in a large process they add up to a lot of dump. These are all
+ * marked MADV_DONTDUMP when they are made and the bytes excluded
+ * are counted in the dontdump_bytes stat. MG_DUMP_PATH still
+ * writes the metadata to a file of its own.
+ *
+ * Guard pages made with mprotect are excluded by install_guard_page.
+ * Guard regions made with MADV_GUARD_INSTALL live inside their
+ * mapping's VMA, so marking them would split it, but the kernel
+ * can't read them and leaves a hole in the dump either way.
+ *
+ * With MG_DONTDUMP_POISONED the fatal signal handler in
+ * mapguard_dump.c also excludes every resident page of a tracked
+ * mapping that still holds nothing but MG_POISON_BYTE, i.e. was
+ * poisoned and never written since. There is no cheaper way to
+ * know a page was never written, and reading memory is faster
+ * than the kernel writing it out. The runs of poisoned pages are
+ * excluded with as few madvise batches as possible */
+
+extern mapguard_policy_t g_mapguard_policy;
+extern mapguard_stats_t g_mapguard_stats;
+
+/* Pages checked per mincore call */
+#define MG_COREDUMP_CHUNK_PAGES 64
+
+/* Excludes [p, p + length) from core dumps */
+void exclude_from_core(void *p, size_t length) {
+    if(madvise(p, length, MADV_DONTDUMP) == 0) {
+        __atomic_fetch_add(&g_mapguard_stats.dontdump_bytes, length, __ATOMIC_RELAXED);
+    }
+}
+
+/* Undoes exclude_from_core */
+void include_in_core(void *p, size_t length) {
+    if(madvise(p, length, MADV_DODUMP) == 0) {
+        __atomic_fetch_sub(&g_mapguard_stats.dontdump_bytes, length, __ATOMIC_RELAXED);
+    }
+}
+
+static bool page_is_poisoned(const uint64_t *p) {
+    const uint64_t pattern = 0x0101010101010101ULL * MG_POISON_BYTE;
+
+    for(size_t i = 0; i < g_page_size / sizeof(uint64_t); i++) {
+        if(p[i] != pattern) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Returns the bytes of [start, start + size) that are resident
+ * and still poisoned, queueing them in exclude if it isn't NULL.
+ * Only called on readable anonymous mappings */
+static size_t poisoned_bytes(uint8_t *start, size_t size, mapguard_madvise_batch_t *exclude) {
+    unsigned char resident[MG_COREDUMP_CHUNK_PAGES];
+    size_t pages = size / g_page_size;
+    size_t total = 0;
+    uint8_t *run = NULL;
+
+    for(size_t i = 0; i < pages; i += MG_COREDUMP_CHUNK_PAGES) {
+        size_t n = MIN(pages - i, MG_COREDUMP_CHUNK_PAGES);
+
+        /* Fails if the entry is stale, don't touch it */
+        if(mincore(start + (i * g_page_size), n * g_page_size, resident) != 0) {
+            pages = i;
+            break;
+        }
+
+        for(size_t j = 0; j < n; j++) {
+            uint8_t *page = start + ((i + j) * g_page_size);
+
+            if((resident[j] & 1) && page_is_poisoned((const uint64_t *) page)) {
+                total += g_page_size;
+                run = (run == NULL) ? page : run;
+                continue;
+            }
+
+            if(exclude != NULL && run != NULL) {
+                madvise_batch_add(&g_mg_real_syscalls, exclude, run, page - run);
+            }
+
+            run = NULL;
+        }
+    }
+
+    if(exclude != NULL && run != NULL) {
+        madvise_batch_add(&g_mg_real_syscalls, exclude, run, start + (pages * g_page_size) - run);
+    }
+
+    return total;
+}
+
+/* Counts the installed guard pages of every tracked mapping in
+ * *guard_pages. If scan is set the poisoned bytes of anonymous
+ * readable ones are returned and queued in exclude if it isn't NULL */
+static size_t walk_tracked(bool scan, mapguard_madvise_batch_t *exclude, size_t *guard_pages) {
+    uint32_t page_count = __atomic_load_n(&g_metadata_directory.page_count, __ATOMIC_ACQUIRE);
+    size_t per_page = MIN((g_page_size - sizeof(mapguard_cache_metadata_t)) / sizeof(mapguard_cache_entry_t), MG_METADATA_BITMAP_WORDS * 64);
+    size_t total = 0;
+
+    for(uint32_t i = 0; i < page_count; i++) {
+        mapguard_cache_entry_t *mce = (mapguard_cache_entry_t *) (metadata_page_at(i) + 1);
+
+        for(size_t j = 0; j < per_page; j++, mce++) {
+            if(mce->start == NULL) {
+                continue;
+            }
+
+            *guard_pages += (mce->guarded_b == MG_GUARD_INSTALLED) + (mce->guarded_t == MG_GUARD_INSTALLED);
+
+            if(scan == false || mce->fd_type != MG_FD_NONE || (mce->current_prot & PROT_READ) == 0) {
+                continue;
+            }
+
+#if MPK_SUPPORT
+            if(mce->pkey != 0) {
+                continue;
+            }
+#endif
+
+            total += poisoned_bytes(mce->start, ROUND_UP_PAGE(mce->size), exclude);
+        }
+    }
+
+    return total;
+}
+
+/* Called from the fatal signal handler with MG_DONTDUMP_POISONED.
+ * The walk is skipped if a thread was inside _mg_mutex because
+ * the entries may not match the address space */
+void slim_core_dump(void) {
+    if((__atomic_load_n(&_mg_seq, __ATOMIC_ACQUIRE) & 1) != 0 || g_mg_syscalls->backed == false) {
+        return;
+    }
+
+    mapguard_madvise_batch_t batch = {.advice = MADV_DONTDUMP};
+    size_t guard_pages = 0;
+    size_t bytes = walk_tracked(true, &batch, &guard_pages);
+
+    madvise_batch_flush(&g_mg_real_syscalls, &batch);
+    __atomic_fetch_add(&g_mapguard_stats.dontdump_poisoned_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/* Returns the number of bytes mapguard keeps out of a core dump
+ * right now: everything it marked MADV_DONTDUMP, its guard pages
+ * and, with MG_DONTDUMP_POISONED, the poisoned pages that would
+ * be excluded if the process crashed now. Reads every poisoned
+ * candidate page so it is not cheap */
+uint64_t mapguard_dump_savings(void) {
+    LOCK_MG();
+
+    size_t guard_pages = 0;
+    bool scan = g_mapguard_policy.dontdump_poisoned && g_mg_syscalls->backed;
+    uint64_t total = walk_tracked(scan, NULL, &guard_pages);
+
+    total += __atomic_load_n(&g_mapguard_stats.dontdump_bytes, __ATOMIC_RELAXED) + (guard_pages * g_page_size);
+
+    UNLOCK_MG();
+    return total;
+}
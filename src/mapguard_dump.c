@@ -0,0 +1,211 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+
+/* Binary metadata dump (MG_DUMP_PATH)
+ *
+ * Writes everything mapguard knows about the address space to
+ * a file: a mapguard_dump_header_t, the address of every metadata
+ * page in directory order and then the raw metadata pages. The
+ * dump only uses open, write and close and never allocates, so
+ * it is safe to run from a signal handler. When MG_DUMP_PATH is
+ * set a dump is written on SIGSEGV, SIGBUS, SIGABRT, SIGILL and
+ * SIGFPE, which includes MAYBE_PANIC and LOG_AND_ABORT, before
+ * the signal is passed on. mapguard_dump() writes one on demand.
+ * The same handlers run slim_core_dump() for MG_DONTDUMP_POISONED.
+ *
+ * misc/mapguard_dump_decode.c prints the contents of a dump */
+
+extern mapguard_policy_t g_mapguard_policy;
+extern mapguard_stats_t g_mapguard_stats;
+
+static char g_dump_path[PATH_MAX];
+static int32_t g_dumping;
+
+static const int32_t g_dump_signals[] = {SIGSEGV, SIGBUS, SIGABRT, SIGILL, SIGFPE};
+static struct sigaction g_dump_old_actions[NSIG];
+
+/* Number of page addresses written per write() call */
+#define MG_DUMP_INDEX_CHUNK 256
+
+static int32_t write_all(int fd, const void *buf, size_t length) {
+    const uint8_t *p = (const uint8_t *) buf;
+
+    while(length != 0) {
+        ssize_t ret = write(fd, p, length);
+
+        if(ret == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if(ret <= 0) {
+            return ERROR;
+        }
+
+        p += ret;
+        length -= ret;
+    }
+
+    return OK;
+}
+
+/* Writes a dump to fd. Signal handlers can't take _mg_mutex
+ * so locked says whether the caller holds it */
+static int32_t dump_write(int fd, int32_t signal, bool locked) {
+    mapguard_metadata_directory_t *dir = &g_metadata_directory;
+    mapguard_dump_header_t header;
+    uint64_t index[MG_DUMP_INDEX_CHUNK];
+    uint32_t page_count = __atomic_load_n(&dir->page_count, __ATOMIC_ACQUIRE);
+
+    memset(&header, 0x0, sizeof(header));
+    header.magic = MG_DUMP_MAGIC;
+    header.version = MG_DUMP_VERSION;
+    header.header_size = sizeof(mapguard_dump_header_t);
+    header.page_size = g_page_size;
+    header.page_count = page_count;
+    header.entries_per_page = MIN((g_page_size - sizeof(mapguard_cache_metadata_t)) / sizeof(mapguard_cache_entry_t), MG_METADATA_BITMAP_WORDS * 64);
+    header.metadata_header_size = sizeof(mapguard_cache_metadata_t);
+    header.entry_size = sizeof(mapguard_cache_entry_t);
+    header.signal = signal;
+    header.pid = getpid();
+    header.sequence = __atomic_load_n(&_mg_seq, __ATOMIC_ACQUIRE);
+    header.tracked_mappings = g_mapguard_stats.tracked_mappings;
+
+    /* An odd sequence means some thread was inside the lock */
+    if(locked || (header.sequence & 1) == 0) {
+        header.flags |= MG_DUMP_FLAG_CONSISTENT;
+    }
+
+    header.start_offset = offsetof(mapguard_cache_entry_t, start);
+    header.size_offset = offsetof(mapguard_cache_entry_t, size);
+    header.guarded_b_offset = offsetof(mapguard_cache_entry_t, guarded_b);
+    header.guarded_t_offset = offsetof(mapguard_cache_entry_t, guarded_t);
+    header.immutable_prot_offset = offsetof(mapguard_cache_entry_t, immutable_prot);
+    header.current_prot_offset = offsetof(mapguard_cache_entry_t, current_prot);
+    header.alloc_flags_offset = offsetof(mapguard_cache_entry_t, alloc_flags);
+    header.fd_type_offset = offsetof(mapguard_cache_entry_t, fd_type);
+    header.lifetime_key_offset = offsetof(mapguard_cache_entry_t, lifetime_key);
+    header.lifetime_birth_offset = offsetof(mapguard_cache_entry_t, lifetime_birth);
+    header.lifetime_class_offset = offsetof(mapguard_cache_entry_t, lifetime_class);
+#if MPK_SUPPORT
+    header.xom_enabled_offset = offsetof(mapguard_cache_entry_t, xom_enabled);
+    header.pkey_offset = offsetof(mapguard_cache_entry_t, pkey);
+    header.pkey_access_rights_offset = offsetof(mapguard_cache_entry_t, pkey_access_rights);
+    header.jit_enabled_offset = offsetof(mapguard_cache_entry_t, jit_enabled);
+#else
+    header.xom_enabled_offset = MG_DUMP_NO_FIELD;
+    header.pkey_offset = MG_DUMP_NO_FIELD;
+    header.pkey_access_rights_offset = MG_DUMP_NO_FIELD;
+    header.jit_enabled_offset = MG_DUMP_NO_FIELD;
+#endif
+
+    if(write_all(fd, &header, sizeof(header)) != OK) {
+        return ERROR;
+    }
+
+    for(uint32_t i = 0; i < page_count; i += MG_DUMP_INDEX_CHUNK) {
+        uint32_t n = MIN(page_count - i, MG_DUMP_INDEX_CHUNK);
+
+        for(uint32_t j = 0; j < n; j++) {
+            index[j] = (uintptr_t) metadata_page_at(i + j);
+        }
+
+        if(write_all(fd, index, n * sizeof(uint64_t)) != OK) {
+            return ERROR;
+        }
+    }
+
+    for(uint32_t i = 0; i < page_count; i++) {
+        if(write_all(fd, metadata_page_at(i), g_page_size) != OK) {
+            return ERROR;
+        }
+    }
+
+    return OK;
+}
+
+/* Writes a dump to fd */
+int32_t mapguard_dump_fd(int fd) {
+    LOCK_MG();
+    int32_t ret = dump_write(fd, 0, true);
+    UNLOCK_MG();
+    return ret;
+}
+
+/* Writes a dump to path */
+int32_t mapguard_dump(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    if(fd == -1) {
+        return ERROR;
+    }
+
+    int32_t ret = mapguard_dump_fd(fd);
+    close(fd);
+    return ret;
+}
+
+static void dump_signal_handler(int sig, siginfo_t *info, void *context) {
+    int32_t saved_errno = errno;
+
+    /* Only the first fatal signal writes a dump */
+    if(__atomic_exchange_n(&g_dumping, 1, __ATOMIC_SEQ_CST) == 0) {
+        if(g_dump_path[0] != '\0') {
+            int fd = open(g_dump_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+            if(fd != -1) {
+                dump_write(fd, sig, false);
+                close(fd);
+            }
+        }
+
+        if(g_mapguard_policy.dontdump_poisoned) {
+            slim_core_dump();
+        }
+    }
+
+    errno = saved_errno;
+
+    /* Pass the signal on to whoever had it before us. Faults
+     * raised by the kernel fire again when we return, signals
+     * sent by a process, including abort(), have to be raised */
+    sigaction(sig, &g_dump_old_actions[sig], NULL);
+
+    if(info == NULL || info->si_code <= 0) {
+        raise(sig);
+    }
+}
+
+/* Installs the fatal signal handlers if MG_DUMP_PATH or
+ * MG_DONTDUMP_POISONED is set. Called from mapguard_ctor */
+void dump_init(void) {
+    char *path = getenv(MG_DUMP_PATH);
+
+    if(path != NULL && strlen(path) < sizeof(g_dump_path)) {
+        strncpy(g_dump_path, path, sizeof(g_dump_path) - 1);
+    }
+
+    if(g_dump_path[0] == '\0' && g_mapguard_policy.dontdump_poisoned == 0) {
+        return;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0x0, sizeof(sa));
+    sa.sa_sigaction = dump_signal_handler;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+
+    for(size_t i = 0; i < sizeof(g_dump_signals) / sizeof(g_dump_signals[0]); i++) {
+        if(sigaction(g_dump_signals[i], &sa, &g_dump_old_actions[g_dump_signals[i]]) != 0) {
+            LOG_ERROR("Failed to install dump handler for signal %d", g_dump_signals[i]);
+        }
+    }
+
+    if(g_dump_path[0] != '\0') {
+        LOG("Metadata will be dumped to %s on fatal signals", g_dump_path);
+    }
+}
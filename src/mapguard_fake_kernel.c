@@ -0,0 +1,486 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+/* In-memory fake kernel
+ *
+ * A model of the process address space that implements the
+ * mapguard_syscalls_t interface without making any syscalls.
+ * VMAs are cache entries in a mapguard_cache_t of their own using
+ * the tree backend, so every operation is O(log n) and the model
+ * scales to millions of mappings, far beyond vm.max_map_count.
+ * Mappings returned by the fake kernel are addresses only, there
+ * is no memory behind them, so mapguard skips poisoning while it
+ * is enabled.
+ *
+ * What is modelled: placement (hints, MAP_FIXED and
+ * MAP_FIXED_NOREPLACE), VMA splitting on partial munmap and
+ * mprotect, mremap growth in place or by moving, and guard
+ * regions installed with MADV_GUARD_INSTALL. VMAs are never
+ * merged.
+ *
+ * Fake mappings live in a window of address space reserved with
+ * the real kernel as PROT_NONE, so they can never collide with a
+ * real mapping. Calls on addresses outside the window, file
+ * mappings and MAP_FIXED anonymous mappings outside it are
+ * passed to the real kernel. A MAP_FIXED_NOREPLACE hint outside
+ * the window fails with EEXIST, so randomized placement falls
+ * back to an address picked inside it.
+ *
+ * The fake kernel is intended for benchmarks and stress tests.
+ * mapguard_fake_kernel_disable() forgets every fake mapping,
+ * including their cache entries, and releases the window */
+
+extern void *(*g_real_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+extern int (*g_real_munmap)(void *addr, size_t length);
+extern mapguard_policy_t g_mapguard_policy;
+
+/* VMAs, start and size are the range, current_prot its
+ * protection and guarded_b is set for guard regions */
+static mapguard_cache_t g_fake_vmas;
+static mapguard_cache_entry_t *g_fake_free_list;
+static uintptr_t g_fake_base;
+static uintptr_t g_fake_end;
+static uintptr_t g_fake_next;
+
+#if THREAD_SUPPORT
+/* Some hooked paths call into the syscall layer without
+ * holding _mg_mutex, e.g. untracked munmap */
+static pthread_mutex_t g_fake_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_FAKE() pthread_mutex_lock(&g_fake_mutex);
+#define UNLOCK_FAKE() pthread_mutex_unlock(&g_fake_mutex);
+#else
+#define LOCK_FAKE()
+#define UNLOCK_FAKE()
+#endif
+
+static void fake_vma_insert(uintptr_t start, uintptr_t end, int32_t prot, uint8_t guard) {
+    if(g_fake_free_list == NULL) {
+        mapguard_cache_entry_t *chunk = g_real_mmap(NULL, MG_FAKE_KERNEL_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if(chunk == MAP_FAILED) {
+            LOG_AND_ABORT("Fake kernel failed to allocate VMA nodes");
+        }
+
+        for(size_t i = 0; i < MG_FAKE_KERNEL_CHUNK_SIZE / sizeof(mapguard_cache_entry_t); i++) {
+            chunk[i].tree_left = g_fake_free_list;
+            g_fake_free_list = &chunk[i];
+        }
+    }
+
+    mapguard_cache_entry_t *vma = g_fake_free_list;
+    g_fake_free_list = vma->tree_left;
+
+    memset(vma, 0x0, sizeof(mapguard_cache_entry_t));
+    vma->start = (void *) start;
+    vma->size = end - start;
+    vma->current_prot = prot;
+    vma->guarded_b = guard;
+    mapguard_cache_insert(&g_fake_vmas, vma);
+}
+
+static void fake_vma_remove(mapguard_cache_entry_t *vma) {
+    mapguard_cache_remove(&g_fake_vmas, vma);
+    vma->tree_left = g_fake_free_list;
+    g_fake_free_list = vma;
+}
+
+static inline uintptr_t fake_vma_end(mapguard_cache_entry_t *vma) {
+    return (uintptr_t) vma->start + vma->size;
+}
+
+static inline mapguard_cache_entry_t *fake_vma_find(uintptr_t addr) {
+    return mapguard_cache_lookup(&g_fake_vmas, (void *) addr);
+}
+
+/* Returns the VMA with the lowest start >= addr */
+static inline mapguard_cache_entry_t *fake_vma_next(uintptr_t addr) {
+    return mapguard_cache_next(&g_fake_vmas, (void *) addr);
+}
+
+/* Makes sure no VMA straddles addr */
+static void fake_vma_split(uintptr_t addr) {
+    mapguard_cache_entry_t *vma = fake_vma_find(addr);
+
+    if(vma == NULL || (uintptr_t) vma->start == addr) {
+        return;
+    }
+
+    uintptr_t end = fake_vma_end(vma);
+    vma->size = addr - (uintptr_t) vma->start;
+    fake_vma_insert(addr, end, vma->current_prot, vma->guarded_b);
+}
+
+static bool fake_range_free(uintptr_t start, uintptr_t end) {
+    if(fake_vma_find(start) != NULL) {
+        return false;
+    }
+
+    mapguard_cache_entry_t *vma = fake_vma_next(start);
+    return vma == NULL || (uintptr_t) vma->start >= end;
+}
+
+static bool fake_range_mapped(uintptr_t start, uintptr_t end) {
+    while(start < end) {
+        mapguard_cache_entry_t *vma = fake_vma_find(start);
+
+        if(vma == NULL) {
+            return false;
+        }
+
+        start = fake_vma_end(vma);
+    }
+
+    return true;
+}
+
+static void fake_range_unmap(uintptr_t start, uintptr_t end) {
+    fake_vma_split(start);
+    fake_vma_split(end);
+
+    mapguard_cache_entry_t *vma = fake_vma_next(start);
+
+    while(vma != NULL && (uintptr_t) vma->start < end) {
+        uintptr_t next = fake_vma_end(vma);
+        fake_vma_remove(vma);
+        vma = fake_vma_next(next);
+    }
+}
+
+/* Applies prot, or the guard flag when guard is not -1,
+ * to every VMA in the range. The range must be mapped */
+static void fake_range_update(uintptr_t start, uintptr_t end, int32_t prot, int32_t guard) {
+    fake_vma_split(start);
+    fake_vma_split(end);
+
+    for(mapguard_cache_entry_t *vma = fake_vma_next(start); vma != NULL && (uintptr_t) vma->start < end; vma = fake_vma_next(fake_vma_end(vma))) {
+        if(guard == -1) {
+            vma->current_prot = prot;
+        } else {
+            vma->guarded_b = guard ? MG_GUARD_INSTALLED : MG_GUARD_NONE;
+        }
+    }
+}
+
+/* Finds a free range of length bytes above the bump cursor,
+ * wrapping around to the bottom of the window once. Returns 0
+ * if the window is full */
+static uintptr_t fake_pick_address(size_t length) {
+    uintptr_t addr = g_fake_next;
+    bool wrapped = false;
+
+    while(true) {
+        if(addr + length > g_fake_end || addr + length < addr) {
+            if(wrapped) {
+                return 0;
+            }
+
+            addr = g_fake_base;
+            wrapped = true;
+        }
+
+        mapguard_cache_entry_t *vma = fake_vma_find(addr);
+
+        if(vma == NULL) {
+            vma = fake_vma_next(addr);
+
+            if(vma == NULL || (uintptr_t) vma->start >= addr + length) {
+                break;
+            }
+        }
+
+        addr = fake_vma_end(vma);
+    }
+
+    g_fake_next = addr + length;
+    return addr;
+}
+
+/* Is the range inside the window. Ranges that only partly
+ * overlap it are neither fake nor real and are refused */
+static inline bool fake_owns(uintptr_t start, size_t length) {
+    return start >= g_fake_base && start + length <= g_fake_end && start + length >= start;
+}
+
+static inline bool fake_overlaps(uintptr_t start, size_t length) {
+    return start < g_fake_end && start + length > g_fake_base;
+}
+
+static void *fake_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    uintptr_t start = (uintptr_t) addr;
+    bool fixed = (flags & MAP_FIXED) || (flags & MAP_FIXED_NOREPLACE) == MAP_FIXED_NOREPLACE;
+
+    if(length == 0 || (start & (g_page_size - 1))) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    length = ROUND_UP_PAGE(length);
+
+    if((flags & MAP_ANONYMOUS) == 0 || (fixed && start != 0 && fake_overlaps(start, length) == false && (flags & MAP_FIXED))) {
+        return g_mg_real_syscalls.mmap(addr, length, prot, flags, fd, offset);
+    }
+
+    LOCK_FAKE();
+
+    if(fixed && start != 0 && fake_owns(start, length) == false) {
+        UNLOCK_FAKE();
+        errno = EEXIST;
+        return MAP_FAILED;
+    }
+
+    if((flags & MAP_FIXED_NOREPLACE) == MAP_FIXED_NOREPLACE && start != 0) {
+        if(fake_range_free(start, start + length) == false) {
+            UNLOCK_FAKE();
+            errno = EEXIST;
+            return MAP_FAILED;
+        }
+    } else if(flags & MAP_FIXED) {
+        fake_range_unmap(start, start + length);
+    } else if(start == 0 || fake_owns(start, length) == false || fake_range_free(start, start + length) == false) {
+        start = fake_pick_address(length);
+    }
+
+    if(start == 0) {
+        UNLOCK_FAKE();
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+
+    fake_vma_insert(start, start + length, prot, MG_GUARD_NONE);
+    UNLOCK_FAKE();
+    return (void *) start;
+}
+
+static int fake_munmap(void *addr, size_t length) {
+    uintptr_t start = (uintptr_t) addr;
+
+    if(length == 0 || (start & (g_page_size - 1))) {
+        errno = EINVAL;
+        return ERROR;
+    }
+
+    length = ROUND_UP_PAGE(length);
+
+    if(fake_overlaps(start, length) == false) {
+        return g_mg_real_syscalls.munmap(addr, length);
+    }
+
+    if(fake_owns(start, length) == false) {
+        errno = EINVAL;
+        return ERROR;
+    }
+
+    LOCK_FAKE();
+    fake_range_unmap(start, start + length);
+    UNLOCK_FAKE();
+    return OK;
+}
+
+static int fake_mprotect(void *addr, size_t len, int prot) {
+    uintptr_t start = (uintptr_t) addr;
+    uintptr_t end = start + ROUND_UP_PAGE(len);
+
+    if(start & (g_page_size - 1)) {
+        errno = EINVAL;
+        return ERROR;
+    }
+
+    if(fake_overlaps(start, end - start) == false) {
+        return g_mg_real_syscalls.mprotect(addr, len, prot);
+    }
+
+    LOCK_FAKE();
+
+    if(fake_owns(start, end - start) == false || fake_range_mapped(start, end) == false) {
+        UNLOCK_FAKE();
+        errno = ENOMEM;
+        return ERROR;
+    }
+
+    fake_range_update(start, end, prot, -1);
+    UNLOCK_FAKE();
+    return OK;
+}
+
+static void *fake_mremap(void *addr, size_t old_len, size_t new_len, int flags, void *new_address) {
+    uintptr_t start = (uintptr_t) addr;
+    uintptr_t target = (uintptr_t) new_address;
+
+    if(new_len == 0 || (start & (g_page_size - 1))) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    old_len = ROUND_UP_PAGE(old_len);
+    new_len = ROUND_UP_PAGE(new_len);
+
+    if(fake_overlaps(start, old_len) == false && ((flags & MREMAP_FIXED) == 0 || fake_overlaps(target, new_len) == false)) {
+        return g_mg_real_syscalls.mremap(addr, old_len, new_len, flags, new_address);
+    }
+
+    /* Memory can't move between the fake and the real kernel */
+    if(fake_owns(start, old_len) == false || ((flags & MREMAP_FIXED) && fake_owns(target, new_len) == false)) {
+        errno = EINVAL;
+        return MAP_FAILED;
+    }
+
+    LOCK_FAKE();
+
+    if(fake_range_mapped(start, start + old_len) == false) {
+        UNLOCK_FAKE();
+        errno = EFAULT;
+        return MAP_FAILED;
+    }
+
+    int32_t prot = fake_vma_find(start)->current_prot;
+
+    if(flags & MREMAP_FIXED) {
+        fake_range_unmap(target, target + new_len);
+        fake_range_unmap(start, start + old_len);
+        fake_vma_insert(target, target + new_len, prot, MG_GUARD_NONE);
+        UNLOCK_FAKE();
+        return new_address;
+    }
+
+    if(new_len <= old_len) {
+        fake_range_unmap(start + new_len, start + old_len);
+        UNLOCK_FAKE();
+        return addr;
+    }
+
+    if(fake_owns(start, new_len) && fake_range_free(start + old_len, start + new_len)) {
+        fake_vma_insert(start + old_len, start + new_len, prot, MG_GUARD_NONE);
+        UNLOCK_FAKE();
+        return addr;
+    }
+
+    if((flags & MREMAP_MAYMOVE) == 0 || (target = fake_pick_address(new_len)) == 0) {
+        UNLOCK_FAKE();
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+
+    fake_range_unmap(start, start + old_len);
+    fake_vma_insert(target, target + new_len, prot, MG_GUARD_NONE);
+    UNLOCK_FAKE();
+    return (void *) target;
+}
+
+static int fake_madvise(void *addr, size_t length, int advice) {
+    uintptr_t start = (uintptr_t) addr;
+    uintptr_t end = start + ROUND_UP_PAGE(length);
+
+    if(start & (g_page_size - 1)) {
+        errno = EINVAL;
+        return ERROR;
+    }
+
+    if(fake_overlaps(start, end - start) == false) {
+        return g_mg_real_syscalls.madvise(addr, length, advice);
+    }
+
+    LOCK_FAKE();
+
+    if(fake_owns(start, end - start) == false || fake_range_mapped(start, end) == false) {
+        UNLOCK_FAKE();
+        errno = ENOMEM;
+        return ERROR;
+    }
+
+    if(advice == MADV_GUARD_INSTALL || advice == MADV_GUARD_REMOVE) {
+        fake_range_update(start, end, 0, advice == MADV_GUARD_INSTALL);
+    }
+
+    UNLOCK_FAKE();
+    return OK;
+}
+
+const mapguard_syscalls_t g_mg_fake_syscalls = {
+    .name = "fake",
+    .backed = false,
+    .mmap = fake_mmap,
+    .munmap = fake_munmap,
+    .mprotect = fake_mprotect,
+    .mremap = fake_mremap,
+    .madvise = fake_madvise,
+};
+
+/* Routes hooked calls to the fake kernel from now on */
+void mapguard_fake_kernel_enable(void) {
+    LOCK_MG();
+
+    if(g_mg_syscalls == &g_mg_fake_syscalls) {
+        UNLOCK_MG();
+        return;
+    }
+
+    void *window = g_real_mmap((void *) MG_FAKE_KERNEL_BASE, MG_FAKE_KERNEL_SIZE, PROT_NONE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if(window == MAP_FAILED) {
+        LOG_ERROR("Failed to reserve the fake kernel window");
+        UNLOCK_MG();
+        return;
+    }
+
+    LOCK_FAKE();
+    mapguard_cache_init(&g_fake_vmas, &g_cache_backends[MG_CACHE_BACKEND_TREE]);
+    g_fake_base = (uintptr_t) window;
+    g_fake_end = g_fake_base + MG_FAKE_KERNEL_SIZE;
+    g_fake_next = g_fake_base;
+    UNLOCK_FAKE();
+
+    g_mg_syscalls = &g_mg_fake_syscalls;
+    UNLOCK_MG();
+    LOG("Fake kernel enabled at %p, new mappings are no longer backed by memory", window);
+}
+
+static void *fake_vma_release(void *p, void *data) {
+    mapguard_cache_entry_t *vma = (mapguard_cache_entry_t *) p;
+    vma->tree_left = g_fake_free_list;
+    g_fake_free_list = vma;
+    return NULL;
+}
+
+/* Goes back to the real kernel. Every fake mapping is dropped
+ * along with its cache entry, so none of them may be used again */
+void mapguard_fake_kernel_disable(void) {
+    LOCK_MG();
+
+    if(g_mg_syscalls != &g_mg_fake_syscalls) {
+        UNLOCK_MG();
+        return;
+    }
+
+    for(uint32_t i = 0; i < g_metadata_directory.page_count; i++) {
+        mapguard_cache_metadata_t *page = metadata_page_at(i);
+        mapguard_cache_entry_t *mce = (mapguard_cache_entry_t *) (page + 1);
+
+        for(uint32_t j = 0; j < page->total; j++, mce++) {
+            if(mce->start != NULL && fake_overlaps((uintptr_t) mce->start, mce->size)) {
+                mapguard_cache_remove(&g_map_cache, mce);
+                free_mce(mce);
+            }
+        }
+    }
+
+    LOCK_FAKE();
+    mapguard_cache_for_each(&g_fake_vmas, fake_vma_release, NULL);
+    mapguard_cache_init(&g_fake_vmas, &g_cache_backends[MG_CACHE_BACKEND_TREE]);
+    g_real_munmap((void *) g_fake_base, MG_FAKE_KERNEL_SIZE);
+    g_fake_base = 0;
+    g_fake_end = 0;
+    UNLOCK_FAKE();
+
+    g_mg_syscalls = &g_mg_real_syscalls;
+    UNLOCK_MG();
+    LOG("Fake kernel disabled");
+}
+
+size_t mapguard_fake_kernel_vma_count(void) {
+    LOCK_FAKE();
+    size_t count = g_fake_vmas.count;
+    UNLOCK_FAKE();
+    return count;
+}
@@ -0,0 +1,209 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* Tracking of fd backed mappings (MG_TRACK_FILE_MAPPINGS)
+ *
+ * The mmap hook normally passes fd backed mappings straight
+ * through, which leaves memfd JIT regions and executable file
+ * mappings without W^X transition checks. With this option a
+ * writable or executable fd backed mapping gets a cache entry
+ * that only records its protections, there are no guard pages
+ * and nothing is poisoned, so the mprotect hook can enforce the
+ * MG_PREVENT_* policies on it. Read only mappings, the bulk of
+ * all file mappings, still go straight to the kernel.
+ *
+ * Each fd is classified as a regular file, memfd, device or
+ * other with one fstat, plus F_GET_SEALS for regular files, and
+ * the result is cached until the fd is closed or replaced through
+ * the close, close_range, closefrom, fclose, dup2 and dup3 hooks */
+
+extern mapguard_policy_t g_mapguard_policy;
+extern mapguard_stats_t g_mapguard_stats;
+
+extern int (*g_real_close)(int fd);
+extern int (*g_real_dup2)(int oldfd, int newfd);
+extern int (*g_real_dup3)(int oldfd, int newfd, int flags);
+extern int (*g_real_close_range)(unsigned int first, unsigned int last, int flags);
+extern void (*g_real_closefrom)(int lowfd);
+extern int (*g_real_fclose)(FILE *stream);
+
+static uint8_t g_fd_types[MG_FD_CACHE_SIZE];
+
+static void fd_forget(int fd) {
+    if(g_mapguard_policy.track_file_mappings && fd >= 0 && fd < MG_FD_CACHE_SIZE) {
+        __atomic_store_n(&g_fd_types[fd], MG_FD_NONE, __ATOMIC_RELAXED);
+    }
+}
+
+static void fd_forget_range(unsigned int first, unsigned int last) {
+    if(g_mapguard_policy.track_file_mappings == 0) {
+        return;
+    }
+
+    for(unsigned int fd = first; fd <= last && fd < MG_FD_CACHE_SIZE; fd++) {
+        __atomic_store_n(&g_fd_types[fd], MG_FD_NONE, __ATOMIC_RELAXED);
+    }
+}
+
+/* Returns the MG_FD_* type of fd. Must be called with _mg_mutex held */
+uint8_t fd_classify(int fd) {
+    if(fd >= 0 && fd < MG_FD_CACHE_SIZE) {
+        uint8_t type = __atomic_load_n(&g_fd_types[fd], __ATOMIC_RELAXED);
+
+        if(type != MG_FD_NONE) {
+            return type;
+        }
+    }
+
+    struct stat st;
+    uint8_t type = MG_FD_OTHER;
+
+    g_mapguard_stats.fd_classifications++;
+
+    if(fstat(fd, &st) != 0) {
+        return type;
+    }
+
+    /* Only shmem, which backs every memfd, supports seals */
+    if(S_ISREG(st.st_mode)) {
+        type = (fcntl(fd, F_GET_SEALS) != -1) ? MG_FD_MEMFD : MG_FD_REGULAR;
+    } else if(S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
+        type = MG_FD_DEVICE;
+    }
+
+    if(fd >= 0 && fd < MG_FD_CACHE_SIZE) {
+        __atomic_store_n(&g_fd_types[fd], type, __ATOMIC_RELAXED);
+    }
+
+    return type;
+}
+
+/* Maps and tracks a writable or executable fd backed mapping.
+ * Called from the mmap hook */
+void *map_file(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    LOCK_MG();
+
+    if(g_mapguard_policy.prevent_rwx && (prot & PROT_WRITE) && (prot & PROT_EXEC)) {
+        SYSLOG("Preventing RWX mapping of fd %d", fd);
+        MAYBE_PANIC();
+        UNLOCK_MG();
+        return MAP_FAILED;
+    }
+
+    uint8_t type = fd_classify(fd);
+    void *map_ptr = g_mg_syscalls->mmap(addr, length, prot, flags, fd, offset);
+
+    if(map_ptr == MAP_FAILED) {
+        UNLOCK_MG();
+        return map_ptr;
+    }
+
+    mapguard_cache_entry_t *mce = find_free_mce();
+    mce->start = map_ptr;
+    mce->size = ROUND_UP_PAGE(length);
+    mce->immutable_prot |= prot;
+    mce->current_prot = prot;
+    mce->fd_type = type;
+    mapguard_cache_insert(&g_map_cache, mce);
+
+    g_mapguard_stats.file_mappings++;
+    UNLOCK_MG();
+    return map_ptr;
+}
+
+/* Updates the entry of an fd backed mapping after the range
+ * [addr, addr + length) was unmapped. Must be called with
+ * _mg_mutex held */
+void unmap_file_range(mapguard_cache_entry_t *mce, void *addr, size_t length) {
+    void *end = mce->start + mce->size;
+
+    if(addr <= mce->start && addr + length >= end) {
+        mapguard_cache_remove(&g_map_cache, mce);
+        free_mce(mce);
+    } else if(addr <= mce->start) {
+        mapguard_cache_rekey(&g_map_cache, mce, addr + length);
+        mce->size = end - (addr + length);
+    } else if(addr + length >= end) {
+        mce->size = addr - mce->start;
+    }
+
+    /* A hole in the middle leaves the entry covering both sides */
+}
+
+/* Hook close in libc. The hooks can run before mapguard_ctor
+ * has resolved the real functions */
+int close(int fd) {
+    fd_forget(fd);
+
+    if(g_real_close == NULL) {
+        return syscall(SYS_close, fd);
+    }
+
+    return g_real_close(fd);
+}
+
+/* Hook close_range in libc. With CLOSE_RANGE_CLOEXEC
+ * nothing is closed yet */
+int close_range(unsigned int first, unsigned int last, int flags) {
+    if((flags & CLOSE_RANGE_CLOEXEC) == 0) {
+        fd_forget_range(first, last);
+    }
+
+    if(g_real_close_range == NULL) {
+        return syscall(SYS_close_range, first, last, flags);
+    }
+
+    return g_real_close_range(first, last, flags);
+}
+
+/* Hook closefrom in libc */
+void closefrom(int lowfd) {
+    if(lowfd >= 0) {
+        fd_forget_range(lowfd, MG_FD_CACHE_SIZE - 1);
+    }
+
+    if(g_real_closefrom == NULL) {
+        syscall(SYS_close_range, lowfd, ~0U, 0);
+        return;
+    }
+
+    g_real_closefrom(lowfd);
+}
+
+/* Hook fclose in libc, which closes the stream's fd
+ * without going through close */
+int fclose(FILE *stream) {
+    fd_forget(fileno(stream));
+
+    if(g_real_fclose == NULL) {
+        g_real_fclose = dlsym(RTLD_NEXT, "fclose");
+    }
+
+    return g_real_fclose(stream);
+}
+
+/* Hook dup2 in libc */
+int dup2(int oldfd, int newfd) {
+    fd_forget(newfd);
+
+    if(g_real_dup2 == NULL) {
+        return syscall(SYS_dup2, oldfd, newfd);
+    }
+
+    return g_real_dup2(oldfd, newfd);
+}
+
+/* Hook dup3 in libc */
+int dup3(int oldfd, int newfd, int flags) {
+    fd_forget(newfd);
+
+    if(g_real_dup3 == NULL) {
+        return syscall(SYS_dup3, oldfd, newfd, flags);
+    }
+
+    return g_real_dup3(oldfd, newfd, flags);
+}
@@ -0,0 +1,145 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+/* JIT code regions gated by a protection key
+ *
+ * A JIT can't flip its code pages between writable and executable
+ * under MG_PREVENT_TRANSITION_TO_X, and even where it can each
+ * flip costs two mprotect calls and a TLB shootdown. Instead
+ * mapguard_jit_alloc() maps the code inaccessible, with guard
+ * pages, and one pkey_mprotect call makes it RWX and tags it with
+ * a protection key that denies writes. Threads created after the
+ * first region inherit that default and threads that predate it
+ * start with the key fully disabled, which still lets them
+ * execute the code since pkeys don't apply to instruction
+ * fetches. A thread can write to JIT code only between
+ * mapguard_jit_write_begin() and mapguard_jit_write_end(), which
+ * write the thread's PKRU register and make no syscalls.
+ *
+ * This is the only way to get an RWX mapping under MG_PREVENT_RWX.
+ * Regions are tracked in the mapping cache with jit_enabled set
+ * and the mprotect hook refuses to change them, so the pkey stays
+ * the only way to write them. Signal handlers run with the
+ * kernel's default PKRU and can't write JIT code */
+
+#if MPK_SUPPORT
+extern mapguard_policy_t g_mapguard_policy;
+
+extern int (*g_real_pkey_mprotect)(void *addr, size_t len, int prot, int pkey);
+extern int (*g_real_pkey_alloc)(unsigned int flags, unsigned int access_rights);
+extern int (*g_real_pkey_set)(int pkey, unsigned int access_rights);
+
+static int32_t g_jit_pkey = -1;
+
+/* Returns an RWX region of at least size bytes whose pages only
+ * the calling thread's write scopes can write to, or NULL */
+void *mapguard_jit_alloc(size_t size) {
+    const int prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+
+    if(size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if(g_mapguard_policy.use_mapping_cache == 0) {
+        LOG("Cannot allocate JIT memory without MG_USE_MAPPING_CACHE enabled");
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    size_t rounded_length = ROUND_UP_PAGE(size);
+    size_t map_length = rounded_length + (g_page_size * GUARD_PAGE_COUNT);
+
+    LOCK_MG();
+
+    if(g_jit_pkey == -1 && (g_jit_pkey = g_real_pkey_alloc(0, PKEY_DISABLE_WRITE)) == -1) {
+        LOG_ERROR("Failed to allocate the JIT protection key");
+        UNLOCK_MG();
+        return NULL;
+    }
+
+    /* The region is mapped inaccessible so it is never writable
+     * and executable before pkey_mprotect tags it with the key */
+    int map_prot = g_mg_syscalls->backed ? PROT_NONE : prot;
+    void *map_ptr;
+
+    if(g_mapguard_policy.randomize_placement) {
+        map_ptr = map_randomized(map_length, map_prot, MAP_PRIVATE | MAP_ANONYMOUS);
+    } else {
+        map_ptr = g_mg_syscalls->mmap(NULL, map_length, map_prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    if(map_ptr == MAP_FAILED) {
+        UNLOCK_MG();
+        return NULL;
+    }
+
+    void *start = map_ptr + g_page_size;
+
+    if(g_mg_syscalls->backed && g_real_pkey_mprotect(start, rounded_length, prot, g_jit_pkey) != 0) {
+        LOG_ERROR("Failed to tag JIT region %p with pkey %d", start, g_jit_pkey);
+        g_mg_syscalls->munmap(map_ptr, map_length);
+        UNLOCK_MG();
+        return NULL;
+    }
+
+    mapguard_cache_entry_t *mce = find_free_mce();
+    mce->start = start;
+    mce->size = rounded_length;
+    mce->immutable_prot = prot;
+    mce->current_prot = prot;
+    mce->jit_enabled = 1;
+    mce->pkey = g_jit_pkey;
+    mce->pkey_access_rights = PKEY_DISABLE_WRITE;
+
+    mapguard_cache_insert(&g_map_cache, mce);
+    mark_guard_pages(mce);
+
+    UNLOCK_MG();
+    return start;
+}
+
+/* Returns a region made by mapguard_jit_alloc(), including its
+ * guard pages, to the kernel */
+int32_t mapguard_jit_free(void *p) {
+    LOCK_MG();
+
+    mapguard_cache_entry_t *mce = get_cache_entry(p);
+
+    if(mce == NULL || mce->start != p || mce->jit_enabled == 0) {
+        UNLOCK_MG();
+        errno = EINVAL;
+        return ERROR;
+    }
+
+    int32_t ret = g_mg_syscalls->munmap(mce->start, mce->size);
+
+    if(ret == 0) {
+        unmap_guard_pages(mce);
+        mapguard_cache_remove(&g_map_cache, mce);
+        free_mce(mce);
+    }
+
+    UNLOCK_MG();
+    return ret;
+}
+
+/* Lets the calling thread write to every JIT region */
+int32_t mapguard_jit_write_begin(void) {
+    if(g_jit_pkey == -1) {
+        return ERROR;
+    }
+
+    return g_real_pkey_set(g_jit_pkey, 0);
+}
+
+/* Makes JIT regions read and execute only for the calling thread again */
+int32_t mapguard_jit_write_end(void) {
+    if(g_jit_pkey == -1) {
+        return ERROR;
+    }
+
+    return g_real_pkey_set(g_jit_pkey, PKEY_DISABLE_WRITE);
+}
+#endif
@@ -0,0 +1,294 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+#include <fcntl.h>
+
+/* Lifetime segregated placement (MG_LIFETIME_PLACEMENT)
+ *
+ * When short lived mappings are placed between long lived ones
+ * every hole they leave behind, guard pages included, fragments
+ * the address space and keeps page table pages alive. With this
+ * option each anonymous mapping is predicted to be short or long
+ * lived and placed into one of two windows of the address space
+ * reserved for that class, so long lived mappings pack densely
+ * and short lived ones reuse each other's holes.
+ *
+ * Lifetimes are measured in mmap calls, which is cheaper than a
+ * clock and scales with how busy the process is. Predictions come
+ * from an exponentially weighted moving average of the lifetimes
+ * seen per call site and size class, kept in a small table. A key
+ * with no history is predicted long lived. Every full munmap of a
+ * placed mapping updates the table and is scored against the
+ * prediction that was made for it.
+ *
+ * Each window is filled next fit from a cursor that wraps around
+ * at its end. Nothing is reserved with the kernel, MAP_FIXED_NOREPLACE
+ * makes sure an occupied address is skipped rather than clobbered,
+ * and after MG_PLACEMENT_RETRIES collisions the kernel picks the
+ * address as usual. The windows are placed at random addresses
+ * the first time they are needed.
+ *
+ * Everything here must be called with _mg_mutex held */
+
+extern mapguard_policy_t g_mapguard_policy;
+extern mapguard_stats_t g_mapguard_stats;
+
+typedef struct {
+    uint32_t key;
+    uint32_t samples;
+    /* Average lifetime in mmap calls */
+    uint64_t average;
+} mapguard_lifetime_slot_t;
+
+typedef struct {
+    uint8_t *base;
+    uint8_t *end;
+    uint8_t *cursor;
+} mapguard_lifetime_region_t;
+
+static mapguard_lifetime_slot_t g_lifetime_table[MG_LIFETIME_TABLE_SIZE];
+static mapguard_lifetime_region_t g_lifetime_regions[MG_LIFETIME_CLASSES];
+static uint64_t g_lifetime_threshold = MG_LIFETIME_DEFAULT_THRESHOLD;
+static bool g_lifetime_ready;
+
+static uint32_t lifetime_key(void *call_site, size_t length) {
+    uint64_t h = ((uintptr_t) call_site * 0x9e3779b97f4a7c15ULL) ^ (63 - __builtin_clzll(length));
+    return (uint32_t) (h >> 32) | 1;
+}
+
+/* Returns the slot of key, claiming the least sampled slot in
+ * the probe window for it if create is set */
+static mapguard_lifetime_slot_t *lifetime_slot(uint32_t key, bool create) {
+    mapguard_lifetime_slot_t *victim = NULL;
+
+    for(uint32_t i = 0; i < MG_CALL_SITE_PROBE; i++) {
+        mapguard_lifetime_slot_t *s = &g_lifetime_table[(key + i) % MG_LIFETIME_TABLE_SIZE];
+
+        if(s->key == key) {
+            return s;
+        }
+
+        if(victim == NULL || s->samples < victim->samples) {
+            victim = s;
+        }
+    }
+
+    if(create == false) {
+        return NULL;
+    }
+
+    victim->key = key;
+    victim->samples = 0;
+    victim->average = 0;
+    return victim;
+}
+
+static void lifetime_init(void) {
+    uint32_t threshold = env_to_int(MG_LIFETIME_THRESHOLD);
+
+    if(threshold != 0) {
+        g_lifetime_threshold = threshold;
+    }
+
+    for(uint32_t i = MG_LIFETIME_SHORT; i < MG_LIFETIME_CLASSES; i++) {
+        uint8_t *base;
+        bool overlaps;
+
+        do {
+            base = (uint8_t *) ((uintptr_t) rand_page_address() & ~(uintptr_t) (MG_LIFETIME_REGION_SIZE - 1));
+            overlaps = base == NULL || (uintptr_t) base + MG_LIFETIME_REGION_SIZE > MG_RAND_HINT_MASK;
+
+            for(uint32_t j = MG_LIFETIME_SHORT; j < i; j++) {
+                overlaps |= (base == g_lifetime_regions[j].base);
+            }
+        } while(overlaps);
+
+        g_lifetime_regions[i].base = base;
+        g_lifetime_regions[i].end = base + MG_LIFETIME_REGION_SIZE;
+        g_lifetime_regions[i].cursor = base;
+    }
+
+    g_lifetime_ready = true;
+    LOG("Placing short lived mappings at %p and long lived ones at %p", g_lifetime_regions[MG_LIFETIME_SHORT].base,
+        g_lifetime_regions[MG_LIFETIME_LONG].base);
+}
+
+/* Maps length bytes in the window of the lifetime predicted for
+ * this call site and size. The key and class to record in the
+ * cache entry are returned in *key and *lifetime_class, which is
+ * MG_LIFETIME_NONE if the kernel had to pick the address */
+void *map_by_lifetime(size_t length, int prot, int flags, void *call_site, uint32_t *key, uint8_t *lifetime_class) {
+    if(g_lifetime_ready == false) {
+        lifetime_init();
+    }
+
+    *key = lifetime_key(call_site, length);
+
+    mapguard_lifetime_slot_t *s = lifetime_slot(*key, false);
+    uint8_t predicted = (s != NULL && s->samples != 0 && s->average < g_lifetime_threshold) ? MG_LIFETIME_SHORT : MG_LIFETIME_LONG;
+    mapguard_lifetime_region_t *r = &g_lifetime_regions[predicted];
+    int32_t saved_errno = errno;
+
+    for(int32_t i = 0; i < MG_PLACEMENT_RETRIES; i++) {
+        if(r->cursor + length > r->end) {
+            r->cursor = r->base;
+        }
+
+        void *hint = r->cursor;
+        void *ptr = g_mg_syscalls->mmap(hint, length, prot, flags | MAP_FIXED_NOREPLACE, -1, 0);
+
+        if(ptr == hint) {
+            r->cursor += length;
+            errno = saved_errno;
+            *lifetime_class = predicted;
+            return ptr;
+        }
+
+        if(ptr != MAP_FAILED) {
+            g_mg_syscalls->munmap(ptr, length);
+            break;
+        }
+
+        if(errno != EEXIST) {
+            break;
+        }
+
+        /* Skip past whatever is in the way if we know its size,
+         * the hint may also have landed on its bottom guard page */
+        mapguard_cache_entry_t *mce = get_cache_entry(hint);
+
+        if(mce == NULL) {
+            mce = get_cache_entry(hint + g_page_size);
+        }
+
+        r->cursor = (mce != NULL) ? mce->start + mce->size + g_page_size : r->cursor + length;
+    }
+
+    g_mapguard_stats.lifetime_fallbacks++;
+    errno = saved_errno;
+    *lifetime_class = MG_LIFETIME_NONE;
+    return g_mg_syscalls->mmap(NULL, length, prot, flags, -1, 0);
+}
+
+/* Starts the lifetime of a newly tracked mapping */
+void lifetime_track(mapguard_cache_entry_t *mce, uint32_t key, uint8_t lifetime_class) {
+    mce->lifetime_key = key;
+    mce->lifetime_class = lifetime_class;
+    mce->lifetime_birth = (uint32_t) g_mapguard_stats.mmap_calls;
+}
+
+/* Feeds the lifetime of a fully unmapped entry back into the
+ * table and scores the prediction made for it */
+void lifetime_record_death(mapguard_cache_entry_t *mce) {
+    if(mce->lifetime_key == 0) {
+        return;
+    }
+
+    uint64_t lifetime = (uint32_t) g_mapguard_stats.mmap_calls - mce->lifetime_birth;
+    uint8_t actual = (lifetime < g_lifetime_threshold) ? MG_LIFETIME_SHORT : MG_LIFETIME_LONG;
+    mapguard_lifetime_slot_t *s = lifetime_slot(mce->lifetime_key, true);
+
+    /* An average with a weight of 1/8 for the newest sample */
+    if(s->samples == 0) {
+        s->average = lifetime;
+    } else {
+        s->average = s->average - (s->average >> 3) + (lifetime >> 3);
+    }
+
+    s->samples++;
+
+    if(mce->lifetime_class != MG_LIFETIME_NONE) {
+        g_mapguard_stats.lifetime_predictions++;
+        g_mapguard_stats.lifetime_correct += (mce->lifetime_class == actual);
+    }
+
+    mce->lifetime_key = 0;
+}
+
+static void *lifetime_account(void *p, void *data) {
+    mapguard_cache_entry_t *mce = (mapguard_cache_entry_t *) p;
+    mapguard_placement_report_t *report = (mapguard_placement_report_t *) data;
+
+    if(mce->lifetime_class == MG_LIFETIME_NONE || mce->lifetime_key == 0) {
+        return NULL;
+    }
+
+    mapguard_placement_region_t *r = &report->regions[mce->lifetime_class];
+    uint8_t *start = mce->start - (mce->guarded_b ? g_page_size : 0);
+    uint8_t *end = mce->start + mce->size + (mce->guarded_t ? g_page_size : 0);
+
+    r->mappings++;
+    r->live_bytes += end - start;
+    r->low = (r->low == NULL || (void *) start < r->low) ? start : r->low;
+    r->high = ((void *) end > r->high) ? end : r->high;
+    return NULL;
+}
+
+/* Returns the value of a "Name: value kB" line of /proc/self/status in bytes */
+static uint64_t proc_status_bytes(const char *name) {
+    char buf[4096];
+    int fd = open("/proc/self/status", O_RDONLY | O_CLOEXEC);
+
+    if(fd == -1) {
+        return 0;
+    }
+
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+
+    if(n <= 0) {
+        return 0;
+    }
+
+    buf[n] = '\0';
+    char *p = strstr(buf, name);
+    return (p != NULL) ? strtoull(p + strlen(name), NULL, 10) * 1024 : 0;
+}
+
+static uint64_t count_vmas(void) {
+    char buf[MG_VERIFY_MAPS_BUFFER];
+    uint64_t lines = 0;
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    ssize_t n;
+
+    if(fd == -1) {
+        return 0;
+    }
+
+    while((n = read(fd, buf, sizeof(buf))) > 0) {
+        for(ssize_t i = 0; i < n; i++) {
+            lines += (buf[i] == '\n');
+        }
+    }
+
+    close(fd);
+    return lines;
+}
+
+/* Fills in how well lifetimes were predicted, how densely each
+ * window is used and the process wide VMA and page table costs */
+void mapguard_placement_report(mapguard_placement_report_t *report) {
+    memset(report, 0x0, sizeof(mapguard_placement_report_t));
+
+    LOCK_MG();
+
+    report->predictions = g_mapguard_stats.lifetime_predictions;
+    report->correct = g_mapguard_stats.lifetime_correct;
+    report->fallbacks = g_mapguard_stats.lifetime_fallbacks;
+
+    if(g_mapguard_policy.use_mapping_cache) {
+        mapguard_cache_for_each(&g_map_cache, lifetime_account, report);
+    }
+
+    for(uint32_t i = MG_LIFETIME_SHORT; i < MG_LIFETIME_CLASSES; i++) {
+        mapguard_placement_region_t *r = &report->regions[i];
+        r->base = g_lifetime_regions[i].base;
+        r->span_bytes = (uint8_t *) r->high - (uint8_t *) r->low;
+    }
+
+    UNLOCK_MG();
+
+    report->vmas = count_vmas();
+    report->page_table_bytes = proc_status_bytes("VmPTE:");
+}
@@ -0,0 +1,160 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+/* Batched madvise
+ *
+ * Guarding a mapping, guarding everything queued for the async
+ * worker and keeping poisoned pages out of a core dump all apply
+ * the same advice to many small ranges, which costs one madvise
+ * syscall per range. Where the kernel allows it these ranges are
+ * submitted with a single process_madvise call on our own pidfd
+ * instead. Linux 6.13 accepts any advice from a process advising
+ * itself and 6.15 added PIDFD_SELF_THREAD_GROUP, which needs no
+ * fd at all. On kernels in between we open a pidfd, and reopen
+ * it in a forked child. io_uring's IORING_OP_MADVISE would also
+ * work but needs a ring per thread for no gain over this.
+ *
+ * process_madvise stops at the first range it fails on. Ranges
+ * from there on are retried with one madvise each, so callers
+ * see the same results as if they had never been batched. The
+ * fake kernel, and any kernel without support, always gets one
+ * madvise per range */
+
+extern mapguard_policy_t g_mapguard_policy;
+extern mapguard_stats_t g_mapguard_stats;
+
+extern void *(*g_real_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+extern int (*g_real_munmap)(void *addr, size_t length);
+
+/* The pidfd process_madvise is called on, -1 if we can't batch */
+static int g_madvise_pidfd = -1;
+
+static bool madvise_probe(int pidfd) {
+    uint8_t *p = g_real_mmap(NULL, g_page_size * 3, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(p == MAP_FAILED) {
+        return false;
+    }
+
+    struct iovec iov[2] = {
+        {p, g_page_size},
+        {p + (g_page_size * 2), g_page_size},
+    };
+
+    ssize_t ret = syscall(__NR_process_madvise, pidfd, iov, 2, MADV_DONTNEED, 0);
+    g_real_munmap(p, g_page_size * 3);
+    return ret == (ssize_t) (g_page_size * 2);
+}
+
+static void madvise_open(void) {
+    int32_t saved_errno = errno;
+
+    g_madvise_pidfd = -1;
+
+    if(madvise_probe(PIDFD_SELF_THREAD_GROUP)) {
+        g_madvise_pidfd = PIDFD_SELF_THREAD_GROUP;
+    } else {
+#if THREAD_SUPPORT
+        int pidfd = syscall(__NR_pidfd_open, getpid(), 0);
+
+        if(pidfd != -1 && madvise_probe(pidfd)) {
+            g_madvise_pidfd = pidfd;
+        } else if(pidfd != -1) {
+            close(pidfd);
+        }
+#endif
+    }
+
+    errno = saved_errno;
+}
+
+#if THREAD_SUPPORT
+/* A pidfd opened by the parent still refers to the parent */
+static void madvise_atfork_child(void) {
+    if(g_madvise_pidfd >= 0) {
+        close(g_madvise_pidfd);
+        madvise_open();
+    }
+}
+#endif
+
+void madvise_init(void) {
+    madvise_open();
+
+#if THREAD_SUPPORT
+    pthread_atfork(NULL, NULL, madvise_atfork_child);
+#endif
+
+    if(g_madvise_pidfd != -1) {
+        LOG("Batching madvise with process_madvise on pidfd %d", g_madvise_pidfd);
+    }
+}
+
+bool madvise_batch_available(void) {
+    return g_madvise_pidfd != -1;
+}
+
+/* Applies advice to count ranges and returns how many of them,
+ * counting from the first, succeeded. Ranges after the first one
+ * that failed are not attempted and errno is that failure's */
+size_t madvise_vector(const mapguard_syscalls_t *sys, struct iovec *iov, size_t count, int advice) {
+    size_t done = 0;
+
+    if(count > 1 && sys == &g_mg_real_syscalls && g_madvise_pidfd != -1) {
+        ssize_t ret = syscall(__NR_process_madvise, g_madvise_pidfd, iov, count, advice, 0);
+
+        /* Skip every range the returned byte count fully covers */
+        for(size_t bytes = 0; ret > 0 && done < count && bytes + iov[done].iov_len <= (size_t) ret; done++) {
+            bytes += iov[done].iov_len;
+        }
+
+        __atomic_fetch_add(&g_mapguard_stats.madvise_batches, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&g_mapguard_stats.madvise_batched_ranges, done, __ATOMIC_RELAXED);
+
+        /* Someone closed our pidfd */
+        if(ret == -1 && errno == EBADF) {
+            g_madvise_pidfd = -1;
+        }
+    }
+
+    for(; done < count; done++) {
+        if(sys->madvise(iov[done].iov_base, iov[done].iov_len, advice) != 0) {
+            break;
+        }
+    }
+
+    return done;
+}
+
+/* Queues a range for batch->advice, submitting the batch first
+ * if it is full. Adjacent ranges are merged */
+void madvise_batch_add(const mapguard_syscalls_t *sys, mapguard_madvise_batch_t *batch, void *p, size_t length) {
+    if(batch->count != 0) {
+        struct iovec *last = &batch->iov[batch->count - 1];
+
+        if((uint8_t *) last->iov_base + last->iov_len == p) {
+            last->iov_len += length;
+            return;
+        }
+    }
+
+    if(batch->count == MG_MADVISE_BATCH_SIZE) {
+        madvise_batch_flush(sys, batch);
+    }
+
+    batch->iov[batch->count].iov_base = p;
+    batch->iov[batch->count].iov_len = length;
+    batch->count++;
+}
+
+/* Submits every queued range. A range that fails is skipped */
+void madvise_batch_flush(const mapguard_syscalls_t *sys, mapguard_madvise_batch_t *batch) {
+    size_t i = 0;
+
+    while(i < batch->count) {
+        i += madvise_vector(sys, &batch->iov[i], batch->count - i, batch->advice) + 1;
+    }
+
+    batch->count = 0;
+}
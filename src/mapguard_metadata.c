@@ -0,0 +1,343 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+/* Metadata directory
+ *
+ * Cache entries live in metadata pages, each allocated with a
+ * guard page on either side. Pages are indexed by a two level
+ * directory, g_metadata_directory.l2[i]->pages[j], instead of a
+ * linked list. Each level keeps a bitmap of the slots below it
+ * that still have a free entry and each page keeps a bitmap of
+ * its free entries, so allocating or freeing an entry touches a
+ * bounded number of words no matter how many pages exist. The
+ * page that owns an entry is found with get_base_page().
+ *
+ * Each NUMA node has its own nonfull bitmaps so entries are
+ * allocated from pages on the calling thread's node, see
+ * mapguard_numa.c. Entries are freed into whichever page owns
+ * them no matter which thread frees them.
+ *
+ * With MG_METADATA_HUGE_PAGES metadata pages and directory tables
+ * are instead carved from 2MB aligned arenas backed by hugetlb
+ * pages when the system has them reserved, or by transparent huge
+ * pages through MADV_HUGEPAGE. Scans over a large directory then
+ * take a TLB miss per arena instead of per page. Guard pages are
+ * only kept at the edges of each arena.
+ *
+ * Everything here is protected by _mg_mutex */
+
+extern mapguard_policy_t g_mapguard_policy;
+extern mapguard_stats_t g_mapguard_stats;
+
+extern void *(*g_real_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+extern int (*g_real_munmap)(void *addr, size_t length);
+
+mapguard_metadata_directory_t g_metadata_directory;
+
+static bool g_metadata_huge_pages;
+/* Cleared the first time a hugetlb mapping fails */
+static bool g_metadata_hugetlb = true;
+/* Next free byte and end of each node's current arena */
+static uint8_t *g_arena_cursor[MG_NUMA_MAX_NODES];
+static uint8_t *g_arena_end[MG_NUMA_MAX_NODES];
+static uint8_t *g_arenas[MG_METADATA_MAX_ARENAS];
+static uint32_t g_arena_count;
+
+static inline void bitmap_set(uint64_t *map, uint32_t bit) {
+    map[bit / 64] |= (1ULL << (bit % 64));
+}
+
+static inline void bitmap_clear(uint64_t *map, uint32_t bit) {
+    map[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+/* Returns the first set bit or -1 */
+static inline int32_t bitmap_first(uint64_t *map, uint32_t words) {
+    for(uint32_t i = 0; i < words; i++) {
+        if(map[i] != 0) {
+            return (i * 64) + __builtin_ctzll(map[i]);
+        }
+    }
+
+    return -1;
+}
+
+static void metadata_mark_nonfull(mapguard_cache_metadata_t *page) {
+    mapguard_metadata_directory_t *dir = &g_metadata_directory;
+    uint32_t l1 = page->index / MG_METADATA_L2_SIZE;
+
+    bitmap_set(dir->l2[l1]->nonfull[page->node], page->index % MG_METADATA_L2_SIZE);
+    bitmap_set(dir->nonfull[page->node], l1);
+}
+
+static void metadata_mark_full(mapguard_cache_metadata_t *page) {
+    mapguard_metadata_directory_t *dir = &g_metadata_directory;
+    uint32_t l1 = page->index / MG_METADATA_L2_SIZE;
+    mapguard_metadata_l2_t *l2 = dir->l2[l1];
+
+    bitmap_clear(l2->nonfull[page->node], page->index % MG_METADATA_L2_SIZE);
+
+    if(bitmap_first(l2->nonfull[page->node], MG_METADATA_L2_SIZE / 64) == -1) {
+        bitmap_clear(dir->nonfull[page->node], l1);
+    }
+}
+
+/* Maps a MG_METADATA_ARENA_SIZE aligned arena on node. The
+ * reservation is made PROT_NONE and trimmed so a guard page
+ * is left on either side of the arena */
+static void metadata_arena_new(uint32_t node) {
+    if(g_arena_count == MG_METADATA_MAX_ARENAS) {
+        LOG_AND_ABORT("Too many metadata arenas");
+    }
+
+    size_t length = (MG_METADATA_ARENA_SIZE * 2) + (g_page_size * 2);
+    uint8_t *reserve = g_real_mmap(rand_page_address(), length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if(reserve == MAP_FAILED) {
+        LOG_AND_ABORT("Failed to reserve a metadata arena");
+    }
+
+    uint8_t *arena = (uint8_t *) (((uintptr_t) reserve + g_page_size + MG_METADATA_ARENA_SIZE - 1) & ~((uintptr_t) MG_METADATA_ARENA_SIZE - 1));
+    uint8_t *tail = arena + MG_METADATA_ARENA_SIZE + g_page_size;
+
+    if(arena - g_page_size != reserve) {
+        g_real_munmap(reserve, (arena - g_page_size) - reserve);
+    }
+
+    if(tail != reserve + length) {
+        g_real_munmap(tail, (reserve + length) - tail);
+    }
+
+    void *ptr = MAP_FAILED;
+
+    if(g_metadata_hugetlb) {
+        ptr = g_real_mmap(arena, MG_METADATA_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0);
+        g_metadata_hugetlb = (ptr != MAP_FAILED);
+    }
+
+    if(ptr == MAP_FAILED) {
+        ptr = g_real_mmap(arena, MG_METADATA_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+
+        if(ptr == MAP_FAILED) {
+            LOG_AND_ABORT("Failed to map a metadata arena");
+        }
+
+        madvise(arena, MG_METADATA_ARENA_SIZE, MADV_HUGEPAGE);
+    } else {
+        g_mapguard_stats.metadata_arenas_hugetlb++;
+    }
+
+    numa_bind(arena, MG_METADATA_ARENA_SIZE, node);
+    exclude_from_core(arena, MG_METADATA_ARENA_SIZE);
+
+    g_arenas[g_arena_count++] = arena;
+    g_arena_cursor[node] = arena;
+    g_arena_end[node] = arena + MG_METADATA_ARENA_SIZE;
+    g_mapguard_stats.metadata_arenas++;
+    LOG("Mapped metadata arena %p on node %u", arena, node);
+}
+
+/* Returns length bytes from node's current arena */
+static void *metadata_arena_alloc(uint32_t node, size_t length) {
+    if(g_arena_cursor[node] == NULL || g_arena_cursor[node] + length > g_arena_end[node]) {
+        metadata_arena_new(node);
+    }
+
+    void *p = g_arena_cursor[node];
+    g_arena_cursor[node] += length;
+    return p;
+}
+
+/* Allocates a metadata page on node and adds it to the directory */
+mapguard_cache_metadata_t *new_mce_page(uint32_t node) {
+    mapguard_metadata_directory_t *dir = &g_metadata_directory;
+    uint32_t index = dir->page_count;
+    uint32_t l1 = index / MG_METADATA_L2_SIZE;
+
+    if(l1 == MG_METADATA_L1_SIZE) {
+        LOG_AND_ABORT("Metadata directory is full at %u pages", index);
+    }
+
+    if(dir->l2[l1] == NULL) {
+        void *l2;
+
+        if(g_metadata_huge_pages) {
+            l2 = metadata_arena_alloc(node, ROUND_UP_PAGE(sizeof(mapguard_metadata_l2_t)));
+        } else {
+            l2 = g_real_mmap(NULL, ROUND_UP_PAGE(sizeof(mapguard_metadata_l2_t)), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        }
+
+        if(l2 == MAP_FAILED) {
+            LOG_AND_ABORT("Failed to allocate metadata directory table");
+        }
+
+        if(g_metadata_huge_pages == false) {
+            exclude_from_core(l2, ROUND_UP_PAGE(sizeof(mapguard_metadata_l2_t)));
+        }
+
+        __atomic_store_n(&dir->l2[l1], l2, __ATOMIC_RELEASE);
+    }
+
+    mapguard_cache_metadata_t *t;
+
+    if(g_metadata_huge_pages) {
+        t = (mapguard_cache_metadata_t *) metadata_arena_alloc(node, g_page_size);
+    } else {
+        /* Produce a random page address as a hint for mmap */
+        void *hint = rand_page_address();
+
+        void *ptr = g_real_mmap(hint, g_page_size * 3, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if(ptr == MAP_FAILED) {
+            LOG_AND_ABORT("Failed to allocate metadata page");
+        }
+
+        numa_bind(ptr + g_page_size, g_page_size, node);
+
+        void *guards[2] = {ptr, ptr + (g_page_size * 2)};
+        install_guard_pages(&g_mg_real_syscalls, guards, 2);
+        exclude_from_core(ptr, g_page_size * 3);
+
+        t = (mapguard_cache_metadata_t *) (ptr + g_page_size);
+    }
+
+    t->index = index;
+    t->node = node;
+    t->total = MIN((g_page_size - sizeof(mapguard_cache_metadata_t)) / sizeof(mapguard_cache_entry_t), MG_METADATA_BITMAP_WORDS * 64);
+    t->free = t->total;
+
+    for(uint32_t i = 0; i < t->total; i++) {
+        bitmap_set(t->free_map, i);
+    }
+
+    /* Published with release stores for lockless snapshot readers */
+    __atomic_store_n(&dir->l2[l1]->pages[index % MG_METADATA_L2_SIZE], t, __ATOMIC_RELEASE);
+    __atomic_store_n(&dir->page_count, index + 1, __ATOMIC_RELEASE);
+    dir->free += t->total;
+    dir->node_free[node] += t->total;
+    metadata_mark_nonfull(t);
+
+    g_mapguard_stats.metadata_pages = dir->page_count;
+    g_mapguard_stats.metadata_node_pages[node]++;
+    return t;
+}
+
+static void mce_tracked(void) {
+    g_mapguard_stats.tracked_mappings++;
+
+    if(g_mapguard_stats.tracked_mappings > g_mapguard_stats.tracked_mappings_peak) {
+        g_mapguard_stats.tracked_mappings_peak = g_mapguard_stats.tracked_mappings;
+    }
+}
+
+mapguard_cache_entry_t *find_free_mce() {
+    mapguard_metadata_directory_t *dir = &g_metadata_directory;
+    mapguard_cache_metadata_t *page = NULL;
+    uint32_t node = numa_current_node();
+    int32_t l1 = bitmap_first(dir->nonfull[node], MG_METADATA_L1_SIZE / 64);
+
+    if(l1 != -1) {
+        int32_t l2 = bitmap_first(dir->l2[l1]->nonfull[node], MG_METADATA_L2_SIZE / 64);
+
+        if(l2 == -1) {
+            LOG_AND_ABORT("Metadata directory table %d has no nonfull page", l1);
+        }
+
+        page = dir->l2[l1]->pages[l2];
+    } else {
+        /* We need a new page */
+        page = new_mce_page(node);
+    }
+
+    int32_t i = bitmap_first(page->free_map, MG_METADATA_BITMAP_WORDS);
+
+    /* This page was supposed to have a free entry */
+    if(i == -1) {
+        LOG_AND_ABORT("Metadata page %p has no free entry", page);
+    }
+
+    bitmap_clear(page->free_map, i);
+    page->free--;
+    dir->free--;
+    dir->node_free[page->node]--;
+
+    if(page->free == 0) {
+        metadata_mark_full(page);
+    }
+
+    mapguard_cache_entry_t *mce = (mapguard_cache_entry_t *) (page + 1) + i;
+    mce->idx = i;
+    mce_tracked();
+    return mce;
+}
+
+/* Allocates metadata pages up front until at least count
+ * entries are available in the calling thread's arena */
+void mce_reserve(size_t count) {
+    uint32_t node = numa_current_node();
+
+    while(g_metadata_directory.node_free[node] < count) {
+        new_mce_page(node);
+    }
+}
+
+/* Returns a cache entry to the metadata page it was allocated from */
+void free_mce(mapguard_cache_entry_t *mce) {
+    mapguard_cache_metadata_t *page = (mapguard_cache_metadata_t *) get_base_page(mce);
+    uint32_t i = mce->idx;
+
+    memset(mce, 0x0, sizeof(mapguard_cache_entry_t));
+    bitmap_set(page->free_map, i);
+    page->free++;
+    g_metadata_directory.free++;
+    g_metadata_directory.node_free[page->node]++;
+
+    if(page->free == 1) {
+        metadata_mark_nonfull(page);
+    }
+
+    g_mapguard_stats.tracked_mappings--;
+}
+
+/* Returns the metadata page at index in the directory */
+mapguard_cache_metadata_t *metadata_page_at(uint32_t index) {
+    return g_metadata_directory.l2[index / MG_METADATA_L2_SIZE]->pages[index % MG_METADATA_L2_SIZE];
+}
+
+void metadata_init(void) {
+    g_metadata_huge_pages = env_to_int(MG_METADATA_HUGE_PAGES) != 0;
+
+    mapguard_cache_metadata_t *page = new_mce_page(numa_current_node());
+    LOG("Allocated first metadata page at %p", page);
+}
+
+/* Unmaps every metadata page, including its guard pages,
+ * and the directory tables */
+void metadata_destroy(void) {
+    mapguard_metadata_directory_t *dir = &g_metadata_directory;
+
+    if(g_metadata_huge_pages) {
+        for(uint32_t i = 0; i < g_arena_count; i++) {
+            g_real_munmap(g_arenas[i] - g_page_size, MG_METADATA_ARENA_SIZE + (g_page_size * 2));
+        }
+
+        g_arena_count = 0;
+        memset(g_arena_cursor, 0x0, sizeof(g_arena_cursor));
+        memset(g_arena_end, 0x0, sizeof(g_arena_end));
+        memset(dir, 0x0, sizeof(mapguard_metadata_directory_t));
+        return;
+    }
+
+    for(uint32_t i = 0; i < dir->page_count; i++) {
+        g_real_munmap((void *) metadata_page_at(i) - g_page_size, g_page_size * 3);
+    }
+
+    for(uint32_t i = 0; i < MG_METADATA_L1_SIZE; i++) {
+        if(dir->l2[i] != NULL) {
+            g_real_munmap(dir->l2[i], ROUND_UP_PAGE(sizeof(mapguard_metadata_l2_t)));
+        }
+    }
+
+    memset(dir, 0x0, sizeof(mapguard_metadata_directory_t));
+}
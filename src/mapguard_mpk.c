@@ -5,7 +5,6 @@
 #if MPK_SUPPORT
 
 extern mapguard_policy_t g_mapguard_policy;
-extern vector_t g_map_cache_vector;
 extern size_t g_page_size;
 
 extern void *(*g_real_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
@@ -38,13 +37,13 @@ int (*g_real_pkey_get)(int pkey);
 
 /* Free XOM allocated with memcpy_xom */
 int free_xom(void *addr, size_t length) {
-    mapguard_cache_entry_t *mce = (mapguard_cache_entry_t *) vector_for_each(&g_map_cache_vector, (vector_for_each_callback_t *) is_mapguard_entry_cached, (void *) addr);
+    mapguard_cache_entry_t *mce = get_cache_entry(addr);
 
     if(mce != NULL) {
         LOG("Found mapguard cache entry for mapping %p", mce->start);
         g_real_munmap(mce->start, mce->size);
-        vector_delete_at(&g_map_cache_vector, mce->cache_index);
-        free(mce);
+        mapguard_cache_remove(&g_map_cache, mce);
+        free_mce(mce);
     } else {
         return ERROR;
     }
@@ -84,8 +83,7 @@ void *memcpy_xom(size_t allocation_size, void *src, size_t src_size) {
 
     memcpy(map_ptr, src, src_size);
 
-    mapguard_cache_entry_t *mce = (mapguard_cache_entry_t *) malloc(sizeof(mapguard_cache_entry_t));
-    memset(mce, 0x0, sizeof(mapguard_cache_entry_t));
+    mapguard_cache_entry_t *mce = find_free_mce();
 
     mce->start = map_ptr;
     mce->size = allocation_size;
@@ -102,11 +100,11 @@ void *memcpy_xom(size_t allocation_size, void *src, size_t src_size) {
     if(ret != 0) {
         LOG("XOM mprotect failed, unmapping memory");
         g_real_munmap(map_ptr, allocation_size);
-        free(mce);
+        free_mce(mce);
         return MAP_FAILED;
     }
 
-    mce->cache_index = vector_push(&g_map_cache_vector, mce);
+    mapguard_cache_insert(&g_map_cache, mce);
 
     return map_ptr;
 }
@@ -148,7 +146,7 @@ int32_t protect_mapping(void *addr) {
         mce->size = g_page_size;
         mce->immutable_prot |= PROT_NONE;
         mce->current_prot = PROT_NONE;
-        mce->cache_index = vector_push(&g_map_cache_vector, mce);
+        mapguard_cache_insert(&g_map_cache, mce);
         new_mce = 1;
     }
 
@@ -186,8 +184,8 @@ fail:
             g_real_pkey_free(mce->pkey);
         }
 
-        vector_delete_at(&g_map_cache_vector, mce->cache_index);
-        free(mce);
+        mapguard_cache_remove(&g_map_cache, mce);
+        free_mce(mce);
     }
 
     return ERROR;
@@ -0,0 +1,107 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+#include <dirent.h>
+#include <sched.h>
+
+/* NUMA aware metadata placement
+ *
+ * Metadata pages are first touched by whichever thread needed a
+ * free entry, and later updated by every thread that maps or
+ * unmaps through them. On a multi socket machine that puts most
+ * of mapguard's bookkeeping on a remote node. Instead each node
+ * gets its own arena in the metadata directory: find_free_mce()
+ * takes an entry from a page on the calling thread's node and new
+ * pages are bound to that node with mbind before they are touched.
+ *
+ * Tracked mappings are poisoned by the thread that mapped them so
+ * first touch already places them on the node they will be used
+ * from, there is no worker to move.
+ *
+ * MG_NUMA_SIMULATE_NODES=N spreads threads over N pretend nodes
+ * by thread id without calling mbind, which exercises the arenas
+ * on a single node machine */
+
+extern mapguard_policy_t g_mapguard_policy;
+
+/* Number of arenas in use, at most MG_NUMA_MAX_NODES */
+static uint32_t g_numa_nodes = 1;
+static bool g_numa_simulated;
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+/* Node ids can be sparse so this is the highest id plus one */
+static uint32_t count_nodes(void) {
+    DIR *d = opendir("/sys/devices/system/node");
+    uint32_t nodes = 0;
+
+    if(d == NULL) {
+        return 1;
+    }
+
+    struct dirent *e;
+
+    while((e = readdir(d)) != NULL) {
+        if(strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9') {
+            nodes = MAX(nodes, (uint32_t) strtoul(e->d_name + 4, NULL, 10) + 1);
+        }
+    }
+
+    closedir(d);
+    return MAX(nodes, 1);
+}
+
+/* Returns the arena of the calling thread */
+uint32_t numa_current_node(void) {
+    if(g_numa_nodes == 1) {
+        return 0;
+    }
+
+    if(g_numa_simulated) {
+        return syscall(SYS_gettid) % g_numa_nodes;
+    }
+
+    unsigned int cpu = 0;
+    unsigned int node = 0;
+
+    if(getcpu(&cpu, &node) != 0) {
+        return 0;
+    }
+
+    return node % g_numa_nodes;
+}
+
+/* Prefers node for the pages in [p, p + length). Must be
+ * called before the pages are first touched */
+void numa_bind(void *p, size_t length, uint32_t node) {
+    if(g_numa_nodes == 1 || g_numa_simulated) {
+        return;
+    }
+
+    unsigned long mask = 1UL << node;
+
+    if(syscall(SYS_mbind, p, length, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) != 0) {
+        LOG_ERROR("Failed to bind %p to node %u", p, node);
+    }
+}
+
+/* Called from mapguard_ctor before the first metadata page is made */
+void numa_init(void) {
+    uint32_t simulated = env_to_int(MG_NUMA_SIMULATE_NODES);
+
+    if(simulated != 0) {
+        g_numa_simulated = true;
+        g_numa_nodes = MIN(simulated, MG_NUMA_MAX_NODES);
+        LOG("Simulating %u NUMA nodes", g_numa_nodes);
+        return;
+    }
+
+    g_numa_nodes = MIN(count_nodes(), MG_NUMA_MAX_NODES);
+
+    if(g_numa_nodes > 1) {
+        LOG("Using metadata arenas on %u NUMA nodes", g_numa_nodes);
+    }
+}
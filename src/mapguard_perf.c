@@ -0,0 +1,232 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+#include <linux/perf_event.h>
+
+/* Self monitoring with perf_event_open (MG_PERF_COUNTERS)
+ *
+ * Guard pages and poisoning cost page faults and dTLB misses in
+ * the application as well as in the hooks. In this mode every
+ * thread opens its own page fault, dTLB miss and context switch
+ * counters the first time it enters a hook. They are read around
+ * each hooked call, guard page installation and poisoning, and
+ * the deltas are added to per scope totals in mapguard_stats_t.
+ * The hooks scope includes the other two.
+ *
+ * Whenever a hook ends more than MG_PERF_WINDOW_NS after the
+ * thread's last window, the change since that window is added to
+ * the window totals. These count the whole thread, application
+ * included, so comparing them across runs with different policies
+ * shows what each policy costs the application.
+ *
+ * The counters of a thread are read together as one perf group.
+ * Events the kernel won't open for us, e.g. because of
+ * perf_event_paranoid or a missing PMU in a VM, are left out and
+ * read as 0. If none can be opened the mode turns itself off.
+ * Kernel side counting is tried first and user only counting if
+ * that is refused */
+
+extern mapguard_policy_t g_mapguard_policy;
+extern mapguard_stats_t g_mapguard_stats;
+
+typedef struct {
+    int leader;
+    int fds[MG_PERF_EVENT_COUNT];
+    /* Position of each event in a group read, -1 if not opened */
+    int8_t slot[MG_PERF_EVENT_COUNT];
+    uint8_t slots;
+    bool opened;
+    uint64_t window_ns;
+    uint64_t window[MG_PERF_EVENT_COUNT];
+} mapguard_perf_thread_t;
+
+static __thread __attribute__((tls_model("initial-exec"))) mapguard_perf_thread_t t_perf;
+
+/* Set once no event could be opened */
+static bool g_perf_unavailable;
+
+#if THREAD_SUPPORT
+static pthread_key_t g_perf_key;
+static pthread_once_t g_perf_once = PTHREAD_ONCE_INIT;
+
+static void perf_thread_setup(void);
+#endif
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} g_perf_events[MG_PERF_EVENT_COUNT] = {
+    [MG_PERF_EVENT_PAGE_FAULTS] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    [MG_PERF_EVENT_DTLB_MISSES] = {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    [MG_PERF_EVENT_CONTEXT_SWITCHES] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+static int perf_open_event(uint32_t event, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0x0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = g_perf_events[event].type;
+    attr.config = g_perf_events[event].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_hv = 1;
+
+    int fd = syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+
+    if(fd == -1 && (errno == EACCES || errno == EPERM)) {
+        attr.exclude_kernel = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+    }
+
+    return fd;
+}
+
+static void perf_open(void) {
+    int32_t saved_errno = errno;
+
+    t_perf.opened = true;
+    t_perf.leader = -1;
+    t_perf.slots = 0;
+
+    for(uint32_t i = 0; i < MG_PERF_EVENT_COUNT; i++) {
+        t_perf.slot[i] = -1;
+        t_perf.fds[i] = perf_open_event(i, t_perf.leader);
+
+        if(t_perf.fds[i] != -1) {
+            t_perf.slot[i] = t_perf.slots++;
+            t_perf.leader = (t_perf.leader == -1) ? t_perf.fds[i] : t_perf.leader;
+            __atomic_fetch_or(&g_mapguard_stats.perf_events, 1ULL << i, __ATOMIC_RELAXED);
+        }
+    }
+
+    if(t_perf.leader == -1) {
+        LOG_ERROR("perf_event_open failed (%s), MG_PERF_COUNTERS is disabled", strerror(errno));
+        g_perf_unavailable = true;
+        errno = saved_errno;
+        return;
+    }
+
+    __atomic_fetch_add(&g_mapguard_stats.perf_threads, 1, __ATOMIC_RELAXED);
+    t_perf.window_ns = get_monotonic_ns();
+    perf_read(t_perf.window);
+
+#if THREAD_SUPPORT
+    /* Only so the destructor runs when the thread exits, the
+     * policy may have been turned on after mapguard_ctor */
+    pthread_once(&g_perf_once, perf_thread_setup);
+    pthread_setspecific(g_perf_key, &t_perf);
+#endif
+
+    errno = saved_errno;
+}
+
+/* Reads the calling thread's counters into values, indexed by
+ * MG_PERF_EVENT_*. Returns false if there are none */
+bool perf_read(uint64_t values[MG_PERF_EVENT_COUNT]) {
+    if(g_mapguard_policy.perf_counters == 0 || g_perf_unavailable) {
+        return false;
+    }
+
+    if(t_perf.opened == false) {
+        perf_open();
+    }
+
+    uint64_t group[MG_PERF_EVENT_COUNT + 1];
+
+    if(t_perf.leader == -1 || read(t_perf.leader, group, sizeof(group)) <= 0) {
+        return false;
+    }
+
+    for(uint32_t i = 0; i < MG_PERF_EVENT_COUNT; i++) {
+        values[i] = (t_perf.slot[i] != -1) ? group[1 + t_perf.slot[i]] : 0;
+    }
+
+    return true;
+}
+
+/* Starts measuring a scope in the calling thread */
+void perf_begin(mapguard_perf_sample_t *sample) {
+    int32_t saved_errno = errno;
+    sample->valid = perf_read(sample->values);
+    errno = saved_errno;
+}
+
+/* Adds what the calling thread counted since perf_begin to scope */
+void perf_end(mapguard_perf_sample_t *sample, uint32_t scope) {
+    uint64_t now[MG_PERF_EVENT_COUNT];
+    int32_t saved_errno = errno;
+
+    if(sample->valid == false || perf_read(now) == false) {
+        errno = saved_errno;
+        return;
+    }
+
+    for(uint32_t i = 0; i < MG_PERF_EVENT_COUNT; i++) {
+        __atomic_fetch_add(&g_mapguard_stats.perf_scope_counts[scope][i], now[i] - sample->values[i], __ATOMIC_RELAXED);
+    }
+
+    uint64_t ns = get_monotonic_ns();
+
+    if(scope == MG_PERF_SCOPE_HOOKS && ns - t_perf.window_ns >= MG_PERF_WINDOW_NS) {
+        for(uint32_t i = 0; i < MG_PERF_EVENT_COUNT; i++) {
+            __atomic_fetch_add(&g_mapguard_stats.perf_window_counts[i], now[i] - t_perf.window[i], __ATOMIC_RELAXED);
+            t_perf.window[i] = now[i];
+        }
+
+        __atomic_fetch_add(&g_mapguard_stats.perf_windows, 1, __ATOMIC_RELAXED);
+        t_perf.window_ns = ns;
+    }
+
+    errno = saved_errno;
+}
+
+#if THREAD_SUPPORT
+static void perf_close(void) {
+    for(uint32_t i = 0; i < MG_PERF_EVENT_COUNT; i++) {
+        if(t_perf.slot[i] != -1) {
+            close(t_perf.fds[i]);
+        }
+    }
+
+    t_perf.opened = false;
+}
+
+/* Counts the rest of the last window of an exiting thread */
+static void perf_thread_exit(void *arg) {
+    uint64_t now[MG_PERF_EVENT_COUNT];
+
+    if(t_perf.opened && perf_read(now)) {
+        for(uint32_t i = 0; i < MG_PERF_EVENT_COUNT; i++) {
+            __atomic_fetch_add(&g_mapguard_stats.perf_window_counts[i], now[i] - t_perf.window[i], __ATOMIC_RELAXED);
+        }
+
+        __atomic_fetch_add(&g_mapguard_stats.perf_windows, 1, __ATOMIC_RELAXED);
+    }
+
+    perf_close();
+}
+
+/* The counters were opened for the parent's thread */
+static void perf_atfork_child(void) {
+    if(t_perf.opened) {
+        perf_close();
+    }
+}
+
+static void perf_thread_setup(void) {
+    pthread_key_create(&g_perf_key, perf_thread_exit);
+    pthread_atfork(NULL, NULL, perf_atfork_child);
+}
+#endif
+
+/* Called from mapguard_ctor */
+void perf_init(void) {
+    if(g_mapguard_policy.perf_counters == 0) {
+        return;
+    }
+
+#if THREAD_SUPPORT
+    pthread_once(&g_perf_once, perf_thread_setup);
+#endif
+}
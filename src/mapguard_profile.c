@@ -0,0 +1,231 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+#include <fcntl.h>
+#include <limits.h>
+
+/* Persistent workload profile (MG_PROFILE_PATH)
+ *
+ * Every process starts with a single metadata page and grows
+ * it one page at a time. When MG_PROFILE_PATH names a file we
+ * write a small fixed size profile of this run at exit and load
+ * it again at startup so the next run can pre-size the metadata
+ * arena and the mapping cache index. The profile describes the
+ * most recent run only, it records the peak number of tracked
+ * mappings, the mapping size class distribution, how often mremap
+ * was called relative to mmap and the call sites that mapped
+ * memory most often. Only the peak is used to pre-size anything,
+ * the rest describes the workload for whoever reads the profile.
+ * The file is not trusted, a peak above what the kernel could
+ * ever map is capped.
+ *
+ * Call sites are stored as an offset from the base of the object
+ * that contains them plus a hash of the object path so they are
+ * stable across runs with ASLR */
+
+extern mapguard_policy_t g_mapguard_policy;
+extern mapguard_stats_t g_mapguard_stats;
+
+mapguard_profile_t g_mapguard_loaded_profile;
+bool g_mapguard_profile_loaded;
+
+static bool g_profile_enabled;
+static char g_profile_path[PATH_MAX];
+static pid_t g_profile_pid;
+
+typedef struct {
+    void *addr;
+    uint64_t count;
+} mapguard_call_site_slot_t;
+
+/* Approximate heavy hitter table, protected by _mg_mutex */
+static mapguard_call_site_slot_t g_call_sites[MG_CALL_SITE_TABLE_SIZE];
+
+static uint64_t fnv1a_hash(const char *str) {
+    uint64_t hash = 0xcbf29ce484222325;
+
+    while(*str != '\0') {
+        hash ^= (uint8_t) *str++;
+        hash *= 0x100000001b3;
+    }
+
+    return hash;
+}
+
+/* Records an mmap from call site addr. Probing is bounded, if no
+ * matching or empty slot is found the least used slot in the probe
+ * window is replaced. Must be called with _mg_mutex held */
+void profile_record_call_site(void *addr) {
+    if(g_profile_enabled == false) {
+        return;
+    }
+
+    uint32_t slot = ((uintptr_t) addr >> 4) % MG_CALL_SITE_TABLE_SIZE;
+    mapguard_call_site_slot_t *victim = &g_call_sites[slot];
+
+    for(uint32_t i = 0; i < MG_CALL_SITE_PROBE; i++) {
+        mapguard_call_site_slot_t *cs = &g_call_sites[(slot + i) % MG_CALL_SITE_TABLE_SIZE];
+
+        if(cs->addr == addr || cs->addr == NULL) {
+            cs->addr = addr;
+            cs->count++;
+            return;
+        }
+
+        if(cs->count < victim->count) {
+            victim = cs;
+        }
+    }
+
+    victim->addr = addr;
+    victim->count = 1;
+}
+
+static void profile_collect_call_sites(mapguard_profile_t *profile) {
+    bool taken[MG_CALL_SITE_TABLE_SIZE] = {0};
+
+    /* Selection of the top MG_PROFILE_CALL_SITES, the table is small */
+    for(uint32_t n = 0; n < MG_PROFILE_CALL_SITES; n++) {
+        int32_t best = -1;
+
+        for(uint32_t i = 0; i < MG_CALL_SITE_TABLE_SIZE; i++) {
+            if(taken[i] == false && g_call_sites[i].addr != NULL && (best == -1 || g_call_sites[i].count > g_call_sites[best].count)) {
+                best = i;
+            }
+        }
+
+        if(best == -1) {
+            break;
+        }
+
+        taken[best] = true;
+
+        Dl_info info;
+        mapguard_call_site_t *cs = &profile->call_sites[profile->call_site_count];
+
+        if(dladdr(g_call_sites[best].addr, &info) != 0 && info.dli_fname != NULL) {
+            cs->module_hash = fnv1a_hash(info.dli_fname);
+            cs->offset = (uintptr_t) g_call_sites[best].addr - (uintptr_t) info.dli_fbase;
+        } else {
+            cs->module_hash = 0;
+            cs->offset = (uintptr_t) g_call_sites[best].addr;
+        }
+
+        cs->count = g_call_sites[best].count;
+        profile->call_site_count++;
+    }
+}
+
+/* Returns twice vm.max_map_count, more than any run can track */
+static uint64_t profile_max_tracked(void) {
+    char buf[32];
+    uint64_t max_map_count = MG_DEFAULT_MAX_MAP_COUNT;
+    int fd = open("/proc/sys/vm/max_map_count", O_RDONLY | O_CLOEXEC);
+
+    if(fd != -1) {
+        ssize_t n = read(fd, buf, sizeof(buf) - 1);
+
+        if(n > 0) {
+            buf[n] = '\0';
+            max_map_count = strtoull(buf, NULL, 10);
+        }
+
+        close(fd);
+    }
+
+    return max_map_count * 2;
+}
+
+static bool profile_valid(mapguard_profile_t *profile) {
+    return profile->magic == MG_PROFILE_MAGIC && profile->version == MG_PROFILE_VERSION &&
+           profile->page_size == g_page_size && profile->call_site_count <= MG_PROFILE_CALL_SITES;
+}
+
+/* Loads the profile named by MG_PROFILE_PATH, if any, and uses
+ * it to pre-size the metadata arena. Called from mapguard_ctor */
+void profile_load(void) {
+    char *path = getenv(MG_PROFILE_PATH);
+
+    if(path == NULL || strlen(path) >= sizeof(g_profile_path)) {
+        return;
+    }
+
+    /* The environment can change before our destructor runs */
+    strncpy(g_profile_path, path, sizeof(g_profile_path) - 1);
+    g_profile_pid = getpid();
+    g_profile_enabled = true;
+
+    int fd = open(g_profile_path, O_RDONLY | O_CLOEXEC);
+
+    if(fd == -1) {
+        LOG("No profile found at %s", g_profile_path);
+        return;
+    }
+
+    ssize_t ret = read(fd, &g_mapguard_loaded_profile, sizeof(mapguard_profile_t));
+    close(fd);
+
+    if(ret != sizeof(mapguard_profile_t) || profile_valid(&g_mapguard_loaded_profile) == false) {
+        LOG_ERROR("Ignoring invalid profile %s", g_profile_path);
+        memset(&g_mapguard_loaded_profile, 0x0, sizeof(mapguard_profile_t));
+        return;
+    }
+
+    uint64_t max_tracked = profile_max_tracked();
+
+    if(g_mapguard_loaded_profile.peak_tracked > max_tracked) {
+        LOG_ERROR("Capping the peak of %lu tracked mappings in profile %s to %lu", g_mapguard_loaded_profile.peak_tracked, g_profile_path,
+                  max_tracked);
+        g_mapguard_loaded_profile.peak_tracked = max_tracked;
+    }
+
+    g_mapguard_profile_loaded = true;
+    LOG("Loaded profile %s, peak tracked mappings %lu, %lu mremap calls per %lu mmap calls", g_profile_path,
+        g_mapguard_loaded_profile.peak_tracked, g_mapguard_loaded_profile.mremap_calls, g_mapguard_loaded_profile.mmap_calls);
+
+    if(g_mapguard_policy.use_mapping_cache) {
+        mce_reserve(g_mapguard_loaded_profile.peak_tracked);
+        mapguard_cache_reserve(&g_map_cache, g_mapguard_loaded_profile.peak_tracked);
+    }
+}
+
+/* Writes the profile for this run. The file is written under a
+ * temporary name and renamed so readers never see a partial file */
+void profile_save(void) {
+    if(g_profile_enabled == false || g_profile_pid != getpid()) {
+        return;
+    }
+
+    mapguard_profile_t profile;
+    memset(&profile, 0x0, sizeof(profile));
+
+    LOCK_MG();
+    profile.magic = MG_PROFILE_MAGIC;
+    profile.version = MG_PROFILE_VERSION;
+    profile.page_size = g_page_size;
+    profile.peak_tracked = g_mapguard_stats.tracked_mappings_peak;
+    profile.mmap_calls = g_mapguard_stats.mmap_calls;
+    profile.mremap_calls = g_mapguard_stats.mremap_calls;
+    memcpy(profile.size_classes, g_mapguard_stats.size_classes, sizeof(profile.size_classes));
+    profile_collect_call_sites(&profile);
+    UNLOCK_MG();
+
+    char tmp_path[PATH_MAX + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", g_profile_path, g_profile_pid);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    if(fd == -1) {
+        LOG_ERROR("Failed to open profile %s", tmp_path);
+        return;
+    }
+
+    ssize_t ret = write(fd, &profile, sizeof(profile));
+    close(fd);
+
+    if(ret != sizeof(profile) || rename(tmp_path, g_profile_path) != 0) {
+        LOG_ERROR("Failed to write profile %s", g_profile_path);
+        unlink(tmp_path);
+    }
+}
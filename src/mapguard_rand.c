@@ -0,0 +1,131 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+#include <pthread.h>
+
+/* MapGuard needs a lot of random values: hint addresses for
+ * metadata pages and, when MG_RANDOMIZE_PLACEMENT is set, a
+ * hint for every tracked mapping. Calling getrandom() each
+ * time puts a syscall on the mmap path. Instead each thread
+ * keeps a small ChaCha20 keystream buffer that is seeded from
+ * getrandom() and rekeyed from its own output after every
+ * refill (fast key erasure). The kernel is only consulted
+ * again every MG_RAND_RESEED_BYTES bytes or after a fork */
+
+/* Bumped in the child after fork() so every thread state
+ * inherited from the parent is reseeded before it is used */
+static volatile uint64_t g_rand_generation = 1;
+
+static __thread mapguard_rand_state_t g_rand_state;
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define CHACHA_QUARTER_ROUND(a, b, c, d) \
+    a += b;                              \
+    d ^= a;                              \
+    d = ROTL32(d, 16);                   \
+    c += d;                              \
+    b ^= c;                              \
+    b = ROTL32(b, 12);                   \
+    a += b;                              \
+    d ^= a;                              \
+    d = ROTL32(d, 8);                    \
+    c += d;                              \
+    b ^= c;                              \
+    b = ROTL32(b, 7);
+
+static void chacha20_block(const uint32_t key[8], uint64_t counter, uint32_t out[16]) {
+    const uint32_t in[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+                             key[0], key[1], key[2], key[3],
+                             key[4], key[5], key[6], key[7],
+                             (uint32_t) counter, (uint32_t) (counter >> 32), 0, 0};
+    uint32_t x[16];
+
+    memcpy(x, in, sizeof(x));
+
+    for(int32_t i = 0; i < 10; i++) {
+        CHACHA_QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        CHACHA_QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        CHACHA_QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        CHACHA_QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        CHACHA_QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        CHACHA_QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        CHACHA_QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        CHACHA_QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for(int32_t i = 0; i < 16; i++) {
+        out[i] = x[i] + in[i];
+    }
+}
+
+/* Mixes fresh kernel entropy into the key. We XOR rather
+ * than overwrite so a failed getrandom() never leaves the
+ * state weaker than it was */
+static void rand_reseed(mapguard_rand_state_t *state) {
+    uint32_t seed[8] = {0};
+
+    syscall(SYS_getrandom, seed, sizeof(seed), GRND_NONBLOCK);
+
+    for(int32_t i = 0; i < 8; i++) {
+        state->key[i] ^= seed[i];
+    }
+
+    memset(seed, 0x0, sizeof(seed));
+    state->generated = 0;
+    state->generation = g_rand_generation;
+}
+
+static void rand_refill(mapguard_rand_state_t *state) {
+    if(state->generation != g_rand_generation || state->generated >= MG_RAND_RESEED_BYTES) {
+        rand_reseed(state);
+    }
+
+    for(uint32_t i = 0; i < MG_RAND_BUFFER_SIZE / MG_CHACHA_BLOCK_SIZE; i++) {
+        chacha20_block(state->key, i, (uint32_t *) &state->buffer[i * MG_CHACHA_BLOCK_SIZE]);
+    }
+
+    /* The first 32 bytes of output become the next key and
+     * are never handed out, so a leaked state cannot be used
+     * to recover values that were already returned */
+    memcpy(state->key, state->buffer, sizeof(state->key));
+    memset(state->buffer, 0x0, sizeof(state->key));
+    state->position = sizeof(state->key);
+    state->generated += MG_RAND_BUFFER_SIZE;
+}
+
+static void rand_atfork_child(void) {
+    g_rand_generation++;
+}
+
+void rand_init(void) {
+    pthread_atfork(NULL, NULL, rand_atfork_child);
+}
+
+uint64_t rand_uint64(void) {
+    mapguard_rand_state_t *state = &g_rand_state;
+    uint64_t val;
+
+    if(state->position + sizeof(val) > MG_RAND_BUFFER_SIZE || state->generation != g_rand_generation) {
+        rand_refill(state);
+    }
+
+    memcpy(&val, &state->buffer[state->position], sizeof(val));
+    memset(&state->buffer[state->position], 0x0, sizeof(val));
+    state->position += sizeof(val);
+    return val;
+}
+
+/* Returns a random page aligned address suitable as an mmap
+ * hint. We stay above 4GB to avoid colliding with non-PIE
+ * binaries and brk heaps, and below the 47 bit user limit */
+void *rand_page_address(void) {
+    uint64_t hint = rand_uint64() & MG_RAND_HINT_MASK;
+
+    if(hint < MG_RAND_HINT_MIN) {
+        hint += MG_RAND_HINT_MIN;
+    }
+
+    return (void *) hint;
+}
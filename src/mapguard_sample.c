@@ -0,0 +1,504 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+#include <signal.h>
+
+/* Sampled guarded malloc (MG_SAMPLE_MALLOC_RATE)
+ *
+ * Guard pages only protect allocations that reach mmap, but most
+ * overflows happen in small heap objects. With this option about
+ * one in MG_SAMPLE_MALLOC_RATE malloc, calloc and realloc calls
+ * of at most a page is served from a pool of slots instead of the
+ * glibc heap. Each slot is one data page followed by a guard page
+ * and the object is placed at the end of its page, so a linear
+ * overflow faults on the guard page. Freed slots are made PROT_NONE
+ * and are reused in round robin order, which keeps them quarantined
+ * for as long as possible so a use after free faults too. A fault
+ * in the pool is reported on stderr before the signal is passed on.
+ *
+ * The pool is mapped and guarded once by sample_init, so the
+ * sampled path only ever calls mprotect and never mmap. When the
+ * pool is full, or sampling is off, every call goes to glibc.
+ *
+ * These hooks run before mapguard_ctor and from inside mapguard
+ * itself, so they never take _mg_mutex. The pool has a lock of its
+ * own. Calls that aren't sampled go to the next allocator, found
+ * with dlsym(RTLD_NEXT) on first use so an allocator preloaded
+ * after us still works. dlsym may itself allocate, what it asks
+ * for while the allocator is being resolved is carved from a small
+ * static buffer and never freed.
+ *
+ * The hooks are only built with SAMPLE_MALLOC_SUPPORT, so the
+ * default build leaves the heap alone */
+
+extern mapguard_policy_t g_mapguard_policy;
+extern mapguard_stats_t g_mapguard_stats;
+
+extern void *(*g_real_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+extern int (*g_real_mprotect)(void *addr, size_t len, int prot);
+
+#if SAMPLE_MALLOC_SUPPORT
+static void *(*g_real_malloc)(size_t size);
+static void *(*g_real_calloc)(size_t nmemb, size_t size);
+static void *(*g_real_realloc)(void *ptr, size_t size);
+static void (*g_real_free)(void *ptr);
+static size_t (*g_real_malloc_usable_size)(void *ptr);
+
+/* Serves allocations made by dlsym while the allocator is being
+ * resolved. Each one is preceded by a 16 byte header holding its
+ * size */
+static uint8_t g_bootstrap_heap[MG_SAMPLE_BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+static size_t g_bootstrap_used;
+
+#define MG_SAMPLE_SLOT_FREE 0
+#define MG_SAMPLE_SLOT_ALLOCATED 1
+#define MG_SAMPLE_SLOT_QUARANTINED 2
+
+typedef struct {
+    void *ptr;
+    size_t size;
+    uint8_t state;
+} mapguard_sample_slot_t;
+
+/* Zero until the pool is ready */
+static uint32_t g_sample_rate;
+static uint32_t g_sample_slot_count;
+static uint32_t g_sample_cursor;
+static uint8_t *g_sample_pool;
+static uint8_t *g_sample_pool_end;
+static mapguard_sample_slot_t *g_sample_slots;
+static struct sigaction g_sample_old_action;
+
+#if THREAD_SUPPORT
+static pthread_mutex_t g_sample_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_SAMPLE() pthread_mutex_lock(&g_sample_mutex);
+#define UNLOCK_SAMPLE() pthread_mutex_unlock(&g_sample_mutex);
+#else
+#define LOCK_SAMPLE()
+#define UNLOCK_SAMPLE()
+#endif
+
+/* Calls left until this thread samples again, 0 if it hasn't
+ * picked its first interval yet */
+static __thread __attribute__((tls_model("initial-exec"))) uint32_t t_sample_countdown;
+/* Set while this thread is inside the pool so anything mapguard
+ * itself allocates goes straight to the next allocator */
+static __thread __attribute__((tls_model("initial-exec"))) bool t_in_sample;
+/* Set while this thread is resolving the next allocator */
+static __thread __attribute__((tls_model("initial-exec"))) bool t_resolving;
+
+static inline bool in_sample_pool(void *p) {
+    return (uint8_t *) p >= g_sample_pool && (uint8_t *) p < g_sample_pool_end;
+}
+
+static inline bool in_bootstrap_heap(void *p) {
+    return (uint8_t *) p >= g_bootstrap_heap && (uint8_t *) p < g_bootstrap_heap + sizeof(g_bootstrap_heap);
+}
+
+static void *bootstrap_alloc(size_t size) {
+    size_t length = 16 + ((size + 15) & ~(size_t) 15);
+    size_t offset = __atomic_fetch_add(&g_bootstrap_used, length, __ATOMIC_RELAXED);
+
+    if(size > sizeof(g_bootstrap_heap) || offset + length > sizeof(g_bootstrap_heap)) {
+        return NULL;
+    }
+
+    *(size_t *) (g_bootstrap_heap + offset) = size;
+    return g_bootstrap_heap + offset + 16;
+}
+
+static inline size_t bootstrap_size(void *p) {
+    return *(size_t *) ((uint8_t *) p - 16);
+}
+
+/* Looks up the allocator after us in the search order */
+static void resolve_allocator(void) {
+    t_resolving = true;
+    __atomic_store_n(&g_real_malloc, dlsym(RTLD_NEXT, "malloc"), __ATOMIC_RELEASE);
+    __atomic_store_n(&g_real_calloc, dlsym(RTLD_NEXT, "calloc"), __ATOMIC_RELEASE);
+    __atomic_store_n(&g_real_realloc, dlsym(RTLD_NEXT, "realloc"), __ATOMIC_RELEASE);
+    __atomic_store_n(&g_real_malloc_usable_size, dlsym(RTLD_NEXT, "malloc_usable_size"), __ATOMIC_RELEASE);
+    __atomic_store_n(&g_real_free, dlsym(RTLD_NEXT, "free"), __ATOMIC_RELEASE);
+    t_resolving = false;
+
+    if(g_real_malloc == NULL || g_real_calloc == NULL || g_real_realloc == NULL || g_real_free == NULL) {
+        LOG_AND_ABORT("Failed to find the next malloc implementation");
+    }
+}
+
+/* Returns false if the caller must use the bootstrap heap */
+static inline bool allocator_ready(void) {
+    if(__builtin_expect(__atomic_load_n(&g_real_free, __ATOMIC_ACQUIRE) != NULL, 1)) {
+        return true;
+    }
+
+    if(t_resolving) {
+        return false;
+    }
+
+    resolve_allocator();
+    return true;
+}
+
+static inline uint8_t *sample_slot_page(uint32_t slot) {
+    return g_sample_pool + (g_page_size * ((slot * 2) + 1));
+}
+
+/* Intervals are drawn uniformly from [1, 2 * rate - 1] so the
+ * average is one sample per rate calls but the next one can't
+ * be predicted */
+static bool should_sample(size_t size) {
+    if(g_sample_rate == 0 || size == 0 || size > g_page_size || t_in_sample) {
+        return false;
+    }
+
+    if(t_sample_countdown > 1) {
+        t_sample_countdown--;
+        return false;
+    }
+
+    bool first = (t_sample_countdown == 0);
+    t_in_sample = true;
+    t_sample_countdown = 1 + (rand_uint64() % ((g_sample_rate * 2) - 1));
+    t_in_sample = false;
+    return first == false;
+}
+
+/* Returns an object of size bytes that ends on a guard page
+ * or NULL if every slot is in use */
+static void *sample_alloc(size_t size) {
+    void *p = NULL;
+
+    t_in_sample = true;
+    LOCK_SAMPLE();
+
+    for(uint32_t i = 0; i < g_sample_slot_count; i++) {
+        uint32_t slot = (g_sample_cursor + i) % g_sample_slot_count;
+        mapguard_sample_slot_t *s = &g_sample_slots[slot];
+
+        if(s->state == MG_SAMPLE_SLOT_ALLOCATED) {
+            continue;
+        }
+
+        uint8_t *page = sample_slot_page(slot);
+
+        if(g_real_mprotect(page, g_page_size, PROT_READ | PROT_WRITE) != 0) {
+            break;
+        }
+
+        include_in_core(page, g_page_size);
+
+        /* Keep malloc's alignment, the slack is at most 15 bytes */
+        p = page + g_page_size - ((size + 15) & ~(size_t) 15);
+        s->ptr = p;
+        s->size = size;
+        s->state = MG_SAMPLE_SLOT_ALLOCATED;
+        g_sample_cursor = slot + 1;
+        g_mapguard_stats.sampled_allocations++;
+        break;
+    }
+
+    if(p == NULL) {
+        g_mapguard_stats.sample_pool_exhausted++;
+    }
+
+    UNLOCK_SAMPLE();
+    t_in_sample = false;
+    return p;
+}
+
+/* Returns the slot of a pointer into the pool or NULL
+ * if it points at a guard page */
+static mapguard_sample_slot_t *sample_slot_of(void *p) {
+    size_t page = ((uint8_t *) p - g_sample_pool) / g_page_size;
+
+    if((page % 2) == 0) {
+        return NULL;
+    }
+
+    return &g_sample_slots[page / 2];
+}
+
+static void sample_free(void *p) {
+    t_in_sample = true;
+    LOCK_SAMPLE();
+
+    mapguard_sample_slot_t *s = sample_slot_of(p);
+
+    if(s == NULL || s->state != MG_SAMPLE_SLOT_ALLOCATED || s->ptr != p) {
+        LOG_AND_ABORT("Invalid or double free of sampled allocation %p", p);
+    }
+
+    g_real_mprotect(get_base_page(p), g_page_size, PROT_NONE);
+    exclude_from_core(get_base_page(p), g_page_size);
+    s->state = MG_SAMPLE_SLOT_QUARANTINED;
+    g_mapguard_stats.sampled_frees++;
+
+    UNLOCK_SAMPLE();
+    t_in_sample = false;
+}
+
+/* Hook malloc in libc */
+void *malloc(size_t size) {
+    if(allocator_ready() == false) {
+        return bootstrap_alloc(size);
+    }
+
+    if(should_sample(size)) {
+        void *p = sample_alloc(size);
+
+        if(p != NULL) {
+            return p;
+        }
+    }
+
+    return g_real_malloc(size);
+}
+
+/* Hook calloc in libc */
+void *calloc(size_t nmemb, size_t size) {
+    size_t total;
+
+    /* The bootstrap heap is never reused so it is still zeroed */
+    if(allocator_ready() == false) {
+        return __builtin_mul_overflow(nmemb, size, &total) ? NULL : bootstrap_alloc(total);
+    }
+
+    if(__builtin_mul_overflow(nmemb, size, &total) == false && should_sample(total)) {
+        void *p = sample_alloc(total);
+
+        /* Quarantined slots still hold their old contents */
+        if(p != NULL) {
+            memset(p, 0x0, total);
+            return p;
+        }
+    }
+
+    return g_real_calloc(nmemb, size);
+}
+
+/* Hook realloc in libc */
+void *realloc(void *ptr, size_t size) {
+    if(in_bootstrap_heap(ptr) || allocator_ready() == false) {
+        void *p = malloc(size);
+
+        if(p != NULL && ptr != NULL) {
+            memcpy(p, ptr, MIN(bootstrap_size(ptr), size));
+        }
+
+        return p;
+    }
+
+    if(in_sample_pool(ptr) == false) {
+        return g_real_realloc(ptr, size);
+    }
+
+    if(size == 0) {
+        sample_free(ptr);
+        return NULL;
+    }
+
+    void *p = malloc(size);
+
+    if(p != NULL) {
+        mapguard_sample_slot_t *s = sample_slot_of(ptr);
+        memcpy(p, ptr, MIN(s->size, size));
+        sample_free(ptr);
+    }
+
+    return p;
+}
+
+/* Hook free in libc */
+void free(void *ptr) {
+    if(in_sample_pool(ptr)) {
+        sample_free(ptr);
+        return;
+    }
+
+    /* Bootstrap allocations are never freed */
+    if(ptr == NULL || in_bootstrap_heap(ptr)) {
+        return;
+    }
+
+    allocator_ready();
+    g_real_free(ptr);
+}
+
+/* Hook malloc_usable_size in libc */
+size_t malloc_usable_size(void *ptr) {
+    if(in_sample_pool(ptr)) {
+        mapguard_sample_slot_t *s = sample_slot_of(ptr);
+        return (s != NULL) ? s->size : 0;
+    }
+
+    if(in_bootstrap_heap(ptr)) {
+        return bootstrap_size(ptr);
+    }
+
+    allocator_ready();
+    return g_real_malloc_usable_size(ptr);
+}
+
+/* Async signal safe formatting for the fault report */
+static size_t msg_append(char *msg, size_t len, const char *str) {
+    while(*str != '\0' && len < MG_SAMPLE_REPORT_SIZE - 1) {
+        msg[len++] = *str++;
+    }
+
+    return len;
+}
+
+static size_t msg_append_number(char *msg, size_t len, uint64_t value, uint32_t base) {
+    char digits[24];
+    size_t n = 0;
+
+    do {
+        digits[n++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while(value != 0);
+
+    if(base == 16) {
+        len = msg_append(msg, len, "0x");
+    }
+
+    while(n > 0 && len < MG_SAMPLE_REPORT_SIZE - 1) {
+        msg[len++] = digits[--n];
+    }
+
+    return len;
+}
+
+/* Appends "<what> of sampled allocation <ptr> (<size> bytes)" */
+static size_t msg_append_slot(char *msg, size_t len, const char *what, mapguard_sample_slot_t *s) {
+    len = msg_append(msg, len, what);
+    len = msg_append(msg, len, " of sampled allocation ");
+    len = msg_append_number(msg, len, (uintptr_t) s->ptr, 16);
+    len = msg_append(msg, len, " (");
+    len = msg_append_number(msg, len, s->size, 10);
+    return msg_append(msg, len, " bytes)");
+}
+
+/* Reports faults in the pool and passes the signal on */
+static void sample_signal_handler(int sig, siginfo_t *info, void *context) {
+    int32_t saved_errno = errno;
+
+    if(info != NULL && info->si_code > 0 && in_sample_pool(info->si_addr)) {
+        uint8_t *addr = info->si_addr;
+        size_t page = (addr - g_sample_pool) / g_page_size;
+        char msg[MG_SAMPLE_REPORT_SIZE];
+        size_t len = msg_append(msg, 0, "[MapGuard] ");
+
+        if(page % 2 == 1) {
+            mapguard_sample_slot_t *s = &g_sample_slots[page / 2];
+            len = msg_append_slot(msg, len, (s->state == MG_SAMPLE_SLOT_QUARANTINED) ? "Use after free" : "Invalid access", s);
+        } else if(page > 0 && g_sample_slots[(page / 2) - 1].state == MG_SAMPLE_SLOT_ALLOCATED) {
+            /* The guard page directly above a slot */
+            len = msg_append_slot(msg, len, "Overflow", &g_sample_slots[(page / 2) - 1]);
+        } else {
+            len = msg_append(msg, len, "Access to a guard page of the sample pool");
+        }
+
+        len = msg_append(msg, len, " at ");
+        len = msg_append_number(msg, len, (uintptr_t) addr, 16);
+        len = msg_append(msg, len, "\n");
+
+        if(write(STDERR_FILENO, msg, len) < 0) {
+            /* Nothing more we can do */
+        }
+    }
+
+    errno = saved_errno;
+
+    /* Faults raised by the kernel fire again under the previous
+     * handler when we return, signals sent by a process have to
+     * be raised again */
+    sigaction(sig, &g_sample_old_action, NULL);
+
+    if(info == NULL || info->si_code <= 0) {
+        raise(sig);
+    }
+}
+
+#if THREAD_SUPPORT
+static void sample_atfork_prepare(void) {
+    pthread_mutex_lock(&g_sample_mutex);
+}
+
+static void sample_atfork_release(void) {
+    pthread_mutex_unlock(&g_sample_mutex);
+}
+#endif
+
+/* Maps the guarded pool if MG_SAMPLE_MALLOC_RATE is set.
+ * Called from mapguard_ctor */
+void sample_init(void) {
+    uint32_t rate = env_to_int(MG_SAMPLE_MALLOC_RATE);
+
+    if(rate == 0) {
+        return;
+    }
+
+    uint32_t slots = env_to_int(MG_SAMPLE_MALLOC_SLOTS);
+
+    if(slots == 0) {
+        slots = MG_SAMPLE_DEFAULT_SLOTS;
+    }
+
+    size_t pool_size = g_page_size * ((slots * 2) + 1);
+    uint8_t *pool = g_real_mmap(NULL, pool_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    mapguard_sample_slot_t *meta = g_real_mmap(NULL, ROUND_UP_PAGE(slots * sizeof(mapguard_sample_slot_t)), PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(pool == MAP_FAILED || meta == MAP_FAILED) {
+        LOG_ERROR("Failed to map a sample pool of %u slots", slots);
+        return;
+    }
+
+    /* Slots stay PROT_NONE until they are first used, the guard
+     * pages in between never become accessible. Only slots in
+     * use are included in core dumps */
+    void *guards[MG_MADVISE_BATCH_SIZE];
+
+    for(uint32_t i = 0; i <= slots;) {
+        size_t n = 0;
+
+        for(; n < MG_MADVISE_BATCH_SIZE && i <= slots; n++, i++) {
+            guards[n] = pool + (g_page_size * i * 2);
+        }
+
+        install_guard_pages(&g_mg_real_syscalls, guards, n);
+    }
+
+    exclude_from_core(pool, pool_size);
+
+    struct sigaction sa;
+    memset(&sa, 0x0, sizeof(sa));
+    sa.sa_sigaction = sample_signal_handler;
+    sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&sa.sa_mask);
+
+    if(sigaction(SIGSEGV, &sa, &g_sample_old_action) != 0) {
+        LOG_ERROR("Failed to install the sample pool SIGSEGV handler");
+    }
+
+#if THREAD_SUPPORT
+    pthread_atfork(sample_atfork_prepare, sample_atfork_release, sample_atfork_release);
+#endif
+
+    g_sample_slots = meta;
+    g_sample_slot_count = slots;
+    g_sample_pool = pool;
+    g_sample_pool_end = pool + pool_size;
+    __atomic_store_n(&g_sample_rate, rate, __ATOMIC_RELEASE);
+
+    LOG("Sampling 1 in %u allocations into %u guarded slots at %p", rate, slots, pool);
+}
+#else
+void sample_init(void) {
+    if(env_to_int(MG_SAMPLE_MALLOC_RATE) != 0) {
+        LOG("MG_SAMPLE_MALLOC_RATE requires SAMPLE_MALLOC_SUPPORT, allocations will not be sampled");
+    }
+}
+#endif
@@ -0,0 +1,220 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+/* Pooled allocator for small secrets
+ *
+ * Keys and tokens are too small to deserve a guarded mapping
+ * each. mapguard_secret_alloc() hands out fixed size slots, in
+ * power of two classes from MG_SECRET_MIN_SLOT to
+ * MG_SECRET_MAX_SLOT bytes, carved from one page chunks. Every
+ * chunk has a guard page on either side, is mlocked so it never
+ * reaches swap, is excluded from core dumps with MADV_DONTDUMP
+ * and reads as zero in a forked child thanks to MADV_WIPEONFORK.
+ * Slot bookkeeping lives outside the chunks so an overflowing
+ * secret can't corrupt it. Freed slots are zeroed with non
+ * temporal stores so the secret doesn't linger in the cache.
+ *
+ * With MPK_SUPPORT chunks are also tagged with a dedicated pkey
+ * and mapguard_secret_protect() makes every secret inaccessible
+ * to the calling thread until mapguard_secret_unprotect().
+ *
+ * Chunks are never returned to the kernel. Everything here is
+ * protected by _mg_mutex */
+
+extern mapguard_policy_t g_mapguard_policy;
+extern mapguard_stats_t g_mapguard_stats;
+
+extern void *(*g_real_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+
+#if MPK_SUPPORT
+extern int (*g_real_pkey_mprotect)(void *addr, size_t len, int prot, int pkey);
+extern int (*g_real_pkey_alloc)(unsigned int flags, unsigned int access_rights);
+extern int (*g_real_pkey_set)(int pkey, unsigned int access_rights);
+
+static int32_t g_secret_pkey = -1;
+#endif
+
+typedef struct {
+    uint8_t *base;
+    uint32_t slot_size;
+    uint32_t slots;
+    uint32_t used;
+    /* Set bits are free slots */
+    uint64_t free_map[MG_SECRET_BITMAP_WORDS];
+} mapguard_secret_chunk_t;
+
+static mapguard_secret_chunk_t g_secret_chunks[MG_SECRET_MAX_CHUNKS];
+static uint32_t g_secret_chunk_count;
+
+/* Overwrites length bytes at p, a multiple of 8, with zeroes
+ * without pulling the lines into the cache */
+static void secret_zero(void *p, size_t length) {
+#if __x86_64__
+    uint64_t *q = (uint64_t *) p;
+
+    for(size_t i = 0; i < length / sizeof(uint64_t); i++) {
+        __asm__ volatile("movnti %1, %0"
+                         : "=m"(q[i])
+                         : "r"((uint64_t) 0));
+    }
+
+    __asm__ volatile("sfence" ::: "memory");
+#else
+    explicit_bzero(p, length);
+#endif
+}
+
+static mapguard_secret_chunk_t *secret_chunk_new(uint32_t slot_size) {
+    if(g_secret_chunk_count == MG_SECRET_MAX_CHUNKS) {
+        return NULL;
+    }
+
+    uint8_t *ptr = g_real_mmap(rand_page_address(), g_page_size * 3, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(ptr == MAP_FAILED) {
+        return NULL;
+    }
+
+    void *guards[2] = {ptr, ptr + (g_page_size * 2)};
+    install_guard_pages(&g_mg_real_syscalls, guards, 2);
+
+    uint8_t *base = ptr + g_page_size;
+
+    if(mlock(base, g_page_size) != 0) {
+        g_mapguard_stats.secret_mlock_failures++;
+        LOG_ERROR("Failed to mlock secret chunk %p", base);
+    }
+
+    exclude_from_core(base, g_page_size);
+    madvise(base, g_page_size, MADV_WIPEONFORK);
+
+#if MPK_SUPPORT
+    if(g_secret_pkey == -1) {
+        g_secret_pkey = g_real_pkey_alloc(0, 0);
+    }
+
+    if(g_secret_pkey != -1) {
+        g_real_pkey_mprotect(base, g_page_size, PROT_READ | PROT_WRITE, g_secret_pkey);
+    }
+#endif
+
+    mapguard_secret_chunk_t *chunk = &g_secret_chunks[g_secret_chunk_count++];
+    chunk->base = base;
+    chunk->slot_size = slot_size;
+    chunk->slots = MIN(g_page_size / slot_size, MG_SECRET_BITMAP_WORDS * 64);
+    chunk->used = 0;
+
+    for(uint32_t i = 0; i < chunk->slots; i++) {
+        chunk->free_map[i / 64] |= (1ULL << (i % 64));
+    }
+
+    g_mapguard_stats.secret_chunks++;
+    LOG("Mapped secret chunk %p for %u byte slots", base, slot_size);
+    return chunk;
+}
+
+/* Returns a zeroed slot of at least size bytes or NULL. Secrets
+ * larger than MG_SECRET_MAX_SLOT are refused with EINVAL */
+void *mapguard_secret_alloc(size_t size) {
+    if(size == 0 || size > MG_SECRET_MAX_SLOT) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    uint32_t slot_size = MG_SECRET_MIN_SLOT;
+
+    while(slot_size < size) {
+        slot_size <<= 1;
+    }
+
+    LOCK_MG();
+
+    mapguard_secret_chunk_t *chunk = NULL;
+
+    for(uint32_t i = 0; i < g_secret_chunk_count; i++) {
+        if(g_secret_chunks[i].slot_size == slot_size && g_secret_chunks[i].used < g_secret_chunks[i].slots) {
+            chunk = &g_secret_chunks[i];
+            break;
+        }
+    }
+
+    if(chunk == NULL && (chunk = secret_chunk_new(slot_size)) == NULL) {
+        UNLOCK_MG();
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    uint32_t slot = 0;
+
+    for(uint32_t i = 0; i < MG_SECRET_BITMAP_WORDS; i++) {
+        if(chunk->free_map[i] != 0) {
+            slot = (i * 64) + __builtin_ctzll(chunk->free_map[i]);
+            break;
+        }
+    }
+
+    chunk->free_map[slot / 64] &= ~(1ULL << (slot % 64));
+    chunk->used++;
+    g_mapguard_stats.secret_slots++;
+
+    void *p = chunk->base + (slot * slot_size);
+    UNLOCK_MG();
+    return p;
+}
+
+/* Zeroes and releases a slot from mapguard_secret_alloc() */
+void mapguard_secret_free(void *p) {
+    if(p == NULL) {
+        return;
+    }
+
+    LOCK_MG();
+
+    mapguard_secret_chunk_t *chunk = NULL;
+
+    for(uint32_t i = 0; i < g_secret_chunk_count; i++) {
+        if(g_secret_chunks[i].base == get_base_page(p)) {
+            chunk = &g_secret_chunks[i];
+            break;
+        }
+    }
+
+    if(chunk == NULL) {
+        LOG_AND_ABORT("Freeing %p which is not a secret", p);
+    }
+
+    uint32_t offset = (uint8_t *) p - chunk->base;
+    uint32_t slot = offset / chunk->slot_size;
+
+    if(offset % chunk->slot_size != 0 || slot >= chunk->slots || (chunk->free_map[slot / 64] & (1ULL << (slot % 64)))) {
+        LOG_AND_ABORT("Invalid or double free of secret %p", p);
+    }
+
+    secret_zero(p, chunk->slot_size);
+
+    chunk->free_map[slot / 64] |= (1ULL << (slot % 64));
+    chunk->used--;
+    g_mapguard_stats.secret_slots--;
+    UNLOCK_MG();
+}
+
+#if MPK_SUPPORT
+/* Makes every secret inaccessible to the calling thread */
+int32_t mapguard_secret_protect(void) {
+    if(g_secret_pkey == -1) {
+        return ERROR;
+    }
+
+    return g_real_pkey_set(g_secret_pkey, PKEY_DISABLE_ACCESS);
+}
+
+/* Makes secrets accessible to the calling thread again */
+int32_t mapguard_secret_unprotect(void) {
+    if(g_secret_pkey == -1) {
+        return ERROR;
+    }
+
+    return g_real_pkey_set(g_secret_pkey, 0);
+}
+#endif
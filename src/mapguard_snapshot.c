@@ -0,0 +1,199 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+#include <sched.h>
+
+/* Snapshots of the tracked mappings
+ *
+ * mapguard_snapshot() copies every live cache entry without
+ * holding _mg_mutex. LOCK_MG and UNLOCK_MG bump _mg_seq so it
+ * is odd while any thread is inside the lock. The reader walks
+ * the metadata directory, which is never freed while mapguard
+ * is loaded, and keeps the copy only if _mg_seq was even and
+ * unchanged across the walk. If that fails MG_SNAPSHOT_RETRIES
+ * times we copy under the lock instead. Either way the cost is
+ * linear in the number of metadata pages and is reported through
+ * mapguard_get_stats() */
+
+extern mapguard_stats_t g_mapguard_stats;
+
+extern void *(*g_real_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+extern int (*g_real_munmap)(void *addr, size_t length);
+
+static size_t snapshot_entries_per_page(void) {
+    return MIN((g_page_size - sizeof(mapguard_cache_metadata_t)) / sizeof(mapguard_cache_entry_t), MG_METADATA_BITMAP_WORDS * 64);
+}
+
+/* Makes sure *snapshot can hold every entry of page_count
+ * metadata pages. Returns false if the allocation failed */
+static bool snapshot_reserve(mapguard_snapshot_t **snapshot, size_t *capacity, uint32_t page_count) {
+    size_t needed = snapshot_entries_per_page() * page_count;
+
+    if(*snapshot != NULL && needed <= *capacity) {
+        return true;
+    }
+
+    mapguard_snapshot_free(*snapshot);
+
+    size_t length = ROUND_UP_PAGE(sizeof(mapguard_snapshot_t) + (needed * sizeof(mapguard_mapping_t)));
+    mapguard_snapshot_t *s = g_real_mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(s == MAP_FAILED) {
+        *snapshot = NULL;
+        return false;
+    }
+
+    s->mappings = (mapguard_mapping_t *) (s + 1);
+    s->length = length;
+    *snapshot = s;
+    *capacity = needed;
+    return true;
+}
+
+/* Copies the live entries of the first page_count metadata
+ * pages. Without the lock held any of the reads can race with
+ * a writer so nothing read here is trusted beyond bounds checks
+ * until the caller has validated _mg_seq */
+static bool snapshot_copy(mapguard_snapshot_t *snapshot, size_t capacity, uint32_t page_count) {
+    mapguard_metadata_directory_t *dir = &g_metadata_directory;
+    size_t per_page = snapshot_entries_per_page();
+
+    snapshot->count = 0;
+
+    for(uint32_t i = 0; i < page_count; i++) {
+        mapguard_metadata_l2_t *l2 = __atomic_load_n(&dir->l2[i / MG_METADATA_L2_SIZE], __ATOMIC_ACQUIRE);
+
+        if(l2 == NULL) {
+            return false;
+        }
+
+        mapguard_cache_metadata_t *page = __atomic_load_n(&l2->pages[i % MG_METADATA_L2_SIZE], __ATOMIC_ACQUIRE);
+
+        if(page == NULL) {
+            return false;
+        }
+
+        mapguard_cache_entry_t *mce = (mapguard_cache_entry_t *) (page + 1);
+
+        for(size_t j = 0; j < per_page; j++, mce++) {
+            if(mce->start == NULL) {
+                continue;
+            }
+
+            if(snapshot->count == capacity) {
+                return false;
+            }
+
+            mapguard_mapping_t *m = &snapshot->mappings[snapshot->count++];
+            m->start = mce->start;
+            m->size = mce->size;
+            m->immutable_prot = mce->immutable_prot;
+            m->current_prot = mce->current_prot;
+            m->guarded_b = mce->guarded_b;
+            m->guarded_t = mce->guarded_t;
+            m->fd_type = mce->fd_type;
+        }
+    }
+
+    return true;
+}
+
+static void snapshot_record(mapguard_snapshot_t *snapshot) {
+    __atomic_fetch_add(&g_mapguard_stats.snapshots, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_mapguard_stats.snapshot_retries, snapshot->retries, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&g_mapguard_stats.snapshot_ns_total, snapshot->snapshot_ns, __ATOMIC_RELAXED);
+
+    if(snapshot->locked) {
+        __atomic_fetch_add(&g_mapguard_stats.snapshot_locked, 1, __ATOMIC_RELAXED);
+    }
+
+    uint64_t max = __atomic_load_n(&g_mapguard_stats.snapshot_ns_max, __ATOMIC_RELAXED);
+
+    while(snapshot->snapshot_ns > max && __atomic_compare_exchange_n(&g_mapguard_stats.snapshot_ns_max, &max, snapshot->snapshot_ns, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED) == false) {
+    }
+}
+
+/* Returns a point in time copy of every tracked mapping or
+ * NULL if memory for it could not be allocated. The caller
+ * must release it with mapguard_snapshot_free() */
+mapguard_snapshot_t *mapguard_snapshot(void) {
+    mapguard_snapshot_t *snapshot = NULL;
+    size_t capacity = 0;
+    uint64_t start = get_monotonic_ns();
+    uint32_t retries = 0;
+    bool valid = false;
+
+    for(; retries < MG_SNAPSHOT_RETRIES; retries++) {
+        uint64_t seq = __atomic_load_n(&_mg_seq, __ATOMIC_ACQUIRE);
+
+        /* A writer is inside the lock, let it finish */
+        if(seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        uint32_t page_count = __atomic_load_n(&g_metadata_directory.page_count, __ATOMIC_ACQUIRE);
+
+        if(snapshot_reserve(&snapshot, &capacity, page_count) == false) {
+            return NULL;
+        }
+
+        valid = snapshot_copy(snapshot, capacity, page_count);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if(valid && __atomic_load_n(&_mg_seq, __ATOMIC_RELAXED) == seq) {
+            snapshot->sequence = seq;
+            break;
+        }
+
+        valid = false;
+    }
+
+    if(valid == false) {
+        LOCK_MG();
+
+        if(snapshot_reserve(&snapshot, &capacity, g_metadata_directory.page_count) == false) {
+            UNLOCK_MG();
+            return NULL;
+        }
+
+        snapshot_copy(snapshot, capacity, g_metadata_directory.page_count);
+        snapshot->sequence = _mg_seq;
+        snapshot->locked = true;
+        UNLOCK_MG();
+    }
+
+    snapshot->retries = retries;
+    snapshot->snapshot_ns = get_monotonic_ns() - start;
+    snapshot_record(snapshot);
+    return snapshot;
+}
+
+void mapguard_snapshot_free(mapguard_snapshot_t *snapshot) {
+    if(snapshot != NULL) {
+        g_real_munmap(snapshot, snapshot->length);
+    }
+}
+
+/* Calls cb for every mapping in a fresh snapshot until cb
+ * returns a non-NULL value, which is then returned. Hooked
+ * calls are never blocked for the duration of the walk. The
+ * snapshot is freed before returning, so the value must not
+ * point into it. Copy a mapping out through data instead */
+void *mapguard_for_each_mapping(mapguard_mapping_callback_t *cb, void *data) {
+    mapguard_snapshot_t *snapshot = mapguard_snapshot();
+
+    if(snapshot == NULL) {
+        return NULL;
+    }
+
+    void *ret = NULL;
+
+    for(size_t i = 0; i < snapshot->count && ret == NULL; i++) {
+        ret = cb(&snapshot->mappings[i], data);
+    }
+
+    mapguard_snapshot_free(snapshot);
+    return ret;
+}
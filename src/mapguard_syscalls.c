@@ -0,0 +1,49 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+/* Every mmap, munmap, mprotect, mremap and madvise made on
+ * behalf of a hooked call goes through g_mg_syscalls. By default
+ * that is the real kernel via the g_real_* pointers. Tests and
+ * benchmarks can switch to the in-memory fake kernel, see
+ * mapguard_fake_kernel.c, to exercise the cache and policy code
+ * without paying for real syscalls */
+
+extern void *(*g_real_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+extern int (*g_real_munmap)(void *addr, size_t length);
+extern int (*g_real_mprotect)(void *addr, size_t len, int prot);
+extern void *(*g_real_mremap)(void *__addr, size_t __old_len, size_t __new_len, int __flags, ...);
+
+/* The g_real_* pointers are only resolved in mapguard_ctor
+ * so the table can't point at them directly */
+static void *real_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    return g_real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+static int real_munmap(void *addr, size_t length) {
+    return g_real_munmap(addr, length);
+}
+
+static int real_mprotect(void *addr, size_t len, int prot) {
+    return g_real_mprotect(addr, len, prot);
+}
+
+static void *real_mremap(void *addr, size_t old_len, size_t new_len, int flags, void *new_address) {
+    if(new_address != NULL) {
+        return g_real_mremap(addr, old_len, new_len, flags, new_address);
+    }
+
+    return g_real_mremap(addr, old_len, new_len, flags);
+}
+
+const mapguard_syscalls_t g_mg_real_syscalls = {
+    .name = "real",
+    .backed = true,
+    .mmap = real_mmap,
+    .munmap = real_munmap,
+    .mprotect = real_mprotect,
+    .mremap = real_mremap,
+    .madvise = madvise,
+};
+
+const mapguard_syscalls_t *g_mg_syscalls = &g_mg_real_syscalls;
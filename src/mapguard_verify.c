@@ -0,0 +1,623 @@
+/* MapGuard - Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.h"
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+/* Background verification of the mapping cache (MG_VERIFY_RATE)
+ *
+ * The cache is only as accurate as the hooks that maintain it.
+ * Raw syscalls, partial unmaps and mremap flags we don't model
+ * all leave entries that disagree with the kernel, and a stale
+ * guard page entry can make a later munmap release someone
+ * else's memory. When MG_VERIFY_RATE is set a worker thread picks
+ * that many random tracked entries per second and compares each
+ * with the kernel's VMAs using the PROCMAP_QUERY ioctl, or by
+ * reading /proc/self/maps on kernels without it. Drift is counted
+ * in mapguard_stats_t and, with MG_VERIFY_REPAIR, fixed: missing
+ * mappings are evicted, truncated ones shrunk, protections taken
+ * from the kernel and lost guard pages forgotten.
+ *
+ * Each entry is checked with _mg_mutex held so it can't change
+ * while the kernel is queried, and the lock is released between
+ * entries. Without PROCMAP_QUERY /proc/self/maps is read into a
+ * buffer before taking the lock and only read again if _mg_seq
+ * shows the lock was taken by anyone else since, so a pass
+ * parses it once rather than once per entry. After
+ * MG_VERIFY_MAPS_RETRIES stale reads it is read with the lock
+ * held. The thread sleeps whenever its CPU time, averaged since
+ * it started, exceeds MG_VERIFY_BUDGET percent of one CPU.
+ * mapguard_verify() runs a pass on demand */
+
+extern mapguard_policy_t g_mapguard_policy;
+extern mapguard_stats_t g_mapguard_stats;
+extern uint8_t g_guard_method;
+
+typedef struct {
+    uintptr_t start;
+    uintptr_t end;
+    int32_t prot;
+} mapguard_vma_t;
+
+/* The VMAs in /proc/self/maps, in address order */
+typedef struct {
+    mapguard_vma_t *vmas;
+    size_t count;
+    size_t capacity;
+    /* _mg_seq when they were read */
+    uint64_t seq;
+    /* Set while _mg_mutex is held and nothing has changed
+     * since the VMAs were read */
+    bool valid;
+} mapguard_maps_t;
+
+static uint64_t g_verify_rate;
+static uint64_t g_verify_budget;
+static bool g_verify_repair;
+
+/* Cleared the first time PROCMAP_QUERY isn't supported */
+static bool g_verify_procmap_query = true;
+
+extern void *(*g_real_mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+extern int (*g_real_munmap)(void *addr, size_t length);
+
+#if THREAD_SUPPORT
+static pthread_t g_verifier;
+
+/* 0 = not running, 1 = starting, 2 = running */
+static int32_t g_verifier_state;
+static bool g_verifier_stop;
+
+/* The fork handlers take _mg_mutex unless the guard page
+ * worker already registered handlers that do */
+static bool g_verify_fork_lock;
+#endif
+
+/* Parses the address range and permissions at the start
+ * of a /proc/self/maps line */
+static bool parse_maps_line(const char *line, mapguard_vma_t *vma) {
+    char *end = NULL;
+
+    vma->start = strtoull(line, &end, 16);
+
+    if(*end != '-') {
+        return false;
+    }
+
+    vma->end = strtoull(end + 1, &end, 16);
+
+    if(*end != ' ' || end[1] == '\0' || end[2] == '\0' || end[3] == '\0') {
+        return false;
+    }
+
+    vma->prot = (end[1] == 'r' ? PROT_READ : 0) | (end[2] == 'w' ? PROT_WRITE : 0) | (end[3] == 'x' ? PROT_EXEC : 0);
+    return true;
+}
+
+static void maps_free(mapguard_maps_t *maps) {
+    if(maps->vmas != NULL) {
+        g_real_munmap(maps->vmas, maps->capacity * sizeof(mapguard_vma_t));
+    }
+
+    memset(maps, 0x0, sizeof(mapguard_maps_t));
+}
+
+static bool maps_append(mapguard_maps_t *maps, mapguard_vma_t *vma) {
+    if(maps->count == maps->capacity) {
+        size_t capacity = (maps->capacity != 0) ? maps->capacity * 2 : MG_VERIFY_MAPS_VMAS;
+        mapguard_vma_t *vmas = g_real_mmap(NULL, capacity * sizeof(mapguard_vma_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if(vmas == MAP_FAILED) {
+            return false;
+        }
+
+        if(maps->vmas != NULL) {
+            memcpy(vmas, maps->vmas, maps->count * sizeof(mapguard_vma_t));
+            g_real_munmap(maps->vmas, maps->capacity * sizeof(mapguard_vma_t));
+        }
+
+        maps->vmas = vmas;
+        maps->capacity = capacity;
+    }
+
+    maps->vmas[maps->count++] = *vma;
+    return true;
+}
+
+/* Reads every VMA in /proc/self/maps. Only the first bytes of
+ * each line are kept so path names of any length are fine */
+static bool maps_read(int fd, mapguard_maps_t *maps) {
+    char buf[MG_VERIFY_MAPS_BUFFER];
+    char line[64];
+    size_t line_len = 0;
+    mapguard_vma_t vma;
+    ssize_t n;
+
+    maps->count = 0;
+    maps->seq = __atomic_load_n(&_mg_seq, __ATOMIC_ACQUIRE);
+
+    if(lseek(fd, 0, SEEK_SET) != 0) {
+        return false;
+    }
+
+    while((n = read(fd, buf, sizeof(buf))) > 0) {
+        for(ssize_t i = 0; i < n; i++) {
+            if(buf[i] != '\n') {
+                if(line_len < sizeof(line) - 1) {
+                    line[line_len++] = buf[i];
+                }
+
+                continue;
+            }
+
+            line[line_len] = '\0';
+            line_len = 0;
+
+            if(parse_maps_line(line, &vma) && maps_append(maps, &vma) == false) {
+                return false;
+            }
+        }
+    }
+
+    return n == 0;
+}
+
+/* Takes _mg_mutex with maps matching the kernel, reading them
+ * without the lock held when possible. The caller must unlock */
+static void maps_lock(int fd, mapguard_maps_t *maps) {
+    if(g_verify_procmap_query) {
+        LOCK_MG();
+        return;
+    }
+
+    for(int32_t tries = 0; tries < MG_VERIFY_MAPS_RETRIES; tries++) {
+        uint64_t seq = __atomic_load_n(&_mg_seq, __ATOMIC_ACQUIRE);
+
+        if((seq & 1) == 0 && (seq != maps->seq || maps->count == 0)) {
+            maps_read(fd, maps);
+        }
+
+        LOCK_MG();
+
+        /* Our LOCK_MG is the only bump since they were read */
+        maps->valid = (maps->count != 0 && (maps->seq & 1) == 0 && _mg_seq == maps->seq + 1);
+
+        if(maps->valid) {
+            return;
+        }
+
+        UNLOCK_MG();
+    }
+
+    LOCK_MG();
+    maps->valid = maps_read(fd, maps);
+}
+
+/* Releases _mg_mutex taken by maps_lock. Nothing changed the
+ * kernel's VMAs through the hooks while it was held, so the
+ * VMAs read are still good if no one else takes it next */
+static void maps_unlock(mapguard_maps_t *maps) {
+    if(maps->valid) {
+        maps->seq = _mg_seq + 1;
+    }
+
+    maps->valid = false;
+    UNLOCK_MG();
+}
+
+/* Finds the first VMA in maps ending above addr */
+static bool maps_query(int fd, mapguard_maps_t *maps, uintptr_t addr, mapguard_vma_t *vma) {
+    /* PROCMAP_QUERY was found missing with the lock held */
+    if(maps->valid == false) {
+        maps->valid = maps_read(fd, maps);
+    }
+
+    size_t low = 0;
+    size_t high = maps->count;
+
+    while(low < high) {
+        size_t mid = low + ((high - low) / 2);
+
+        if(maps->vmas[mid].end > addr) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    if(low == maps->count) {
+        return false;
+    }
+
+    *vma = maps->vmas[low];
+    return true;
+}
+
+/* Finds the VMA covering addr or, if there is none, the next
+ * one above it. Returns false if no VMA ends above addr */
+static bool vma_query(int fd, mapguard_maps_t *maps, uintptr_t addr, mapguard_vma_t *vma) {
+    if(g_verify_procmap_query) {
+        struct procmap_query q;
+        memset(&q, 0x0, sizeof(q));
+        q.size = sizeof(q);
+        q.query_flags = PROCMAP_QUERY_COVERING_OR_NEXT_VMA;
+        q.query_addr = addr;
+
+        if(ioctl(fd, PROCMAP_QUERY, &q) == 0) {
+            vma->start = q.vma_start;
+            vma->end = q.vma_end;
+            vma->prot = ((q.vma_flags & PROCMAP_QUERY_VMA_READABLE) ? PROT_READ : 0) |
+                        ((q.vma_flags & PROCMAP_QUERY_VMA_WRITABLE) ? PROT_WRITE : 0) |
+                        ((q.vma_flags & PROCMAP_QUERY_VMA_EXECUTABLE) ? PROT_EXEC : 0);
+            return true;
+        }
+
+        if(errno == ENOENT) {
+            return false;
+        }
+
+        LOG("PROCMAP_QUERY is not supported, verifying with /proc/self/maps");
+        g_verify_procmap_query = false;
+    }
+
+    return maps_query(fd, maps, addr, vma);
+}
+
+/* Returns true if the guard page at p is still mapped and,
+ * when guards are made with mprotect, inaccessible. Guard
+ * regions installed with MADV_GUARD_INSTALL aren't visible
+ * in the VMA so for those we can only check the former */
+static bool guard_page_intact(int fd, mapguard_maps_t *maps, void *p) {
+    mapguard_vma_t vma;
+
+    if(vma_query(fd, maps, (uintptr_t) p, &vma) == false || vma.start > (uintptr_t) p) {
+        return false;
+    }
+
+    return g_guard_method == MG_GUARD_METHOD_MADVISE || vma.prot == PROT_NONE;
+}
+
+/* Compares mce with the kernel's VMAs and repairs it if
+ * MG_VERIFY_REPAIR is set. Returns true if it had drifted.
+ * Must be called with _mg_mutex held */
+static bool verify_entry(int fd, mapguard_maps_t *maps, mapguard_cache_entry_t *mce) {
+    uintptr_t start = (uintptr_t) mce->start;
+    uintptr_t end = start + mce->size;
+    uintptr_t addr = start;
+    int32_t first_prot = -1;
+    bool prot_seen = false;
+    mapguard_vma_t vma;
+
+    g_mapguard_stats.verify_samples++;
+
+    /* Walk the VMAs the entry spans. mprotect can split it and
+     * we only record the last protection, so it is enough for
+     * one of them to have it */
+    while(addr < end && vma_query(fd, maps, addr, &vma) && vma.start <= addr) {
+        if(first_prot == -1) {
+            first_prot = vma.prot;
+        }
+
+        prot_seen |= (vma.prot == mce->current_prot);
+        addr = vma.end;
+    }
+
+    size_t mapped = MIN(addr, end) - start;
+
+    if(mapped == 0) {
+        g_mapguard_stats.verify_missing++;
+        LOG_ERROR("Tracked mapping %p (%zu bytes) is no longer mapped", mce->start, mce->size);
+
+        if(g_verify_repair) {
+            mapguard_cache_remove(&g_map_cache, mce);
+            free_mce(mce);
+            g_mapguard_stats.verify_repairs++;
+        }
+
+        return true;
+    }
+
+    bool drift = false;
+
+    if(mapped < mce->size) {
+        g_mapguard_stats.verify_truncated++;
+        LOG_ERROR("Tracked mapping %p is %zu bytes but only %zu are mapped", mce->start, mce->size, mapped);
+
+        /* The top guard page is no longer adjacent to the mapping */
+        if(g_verify_repair) {
+            mce->size = mapped;
+            mce->guarded_t = MG_GUARD_NONE;
+            g_mapguard_stats.verify_repairs++;
+        }
+
+        drift = true;
+    } else if(prot_seen == false) {
+        g_mapguard_stats.verify_prot++;
+        LOG_ERROR("Tracked mapping %p has protections 0x%x, the kernel has 0x%x", mce->start, mce->current_prot, first_prot);
+
+        if(g_verify_repair) {
+            mce->immutable_prot |= first_prot;
+            mce->current_prot = first_prot;
+            g_mapguard_stats.verify_repairs++;
+        }
+
+        drift = true;
+    }
+
+    /* A missing guard page must be forgotten, otherwise unmapping
+     * the entry would unmap whatever now lives at its address */
+    if(mce->guarded_b == MG_GUARD_INSTALLED && guard_page_intact(fd, maps, mce->start - g_page_size) == false) {
+        g_mapguard_stats.verify_guard++;
+        LOG_ERROR("Bottom guard page of tracked mapping %p is missing", mce->start);
+
+        if(g_verify_repair) {
+            mce->guarded_b = MG_GUARD_NONE;
+            g_mapguard_stats.verify_repairs++;
+        }
+
+        drift = true;
+    }
+
+    if(mce->guarded_t == MG_GUARD_INSTALLED && guard_page_intact(fd, maps, mce->start + mce->size) == false) {
+        g_mapguard_stats.verify_guard++;
+        LOG_ERROR("Top guard page of tracked mapping %p is missing", mce->start);
+
+        if(g_verify_repair) {
+            mce->guarded_t = MG_GUARD_NONE;
+            g_mapguard_stats.verify_repairs++;
+        }
+
+        drift = true;
+    }
+
+    return drift;
+}
+
+/* Returns a random tracked entry or NULL. Must be called
+ * with _mg_mutex held */
+static mapguard_cache_entry_t *verify_pick(void) {
+    uint32_t page_count = g_metadata_directory.page_count;
+
+    if(g_mapguard_stats.tracked_mappings == 0 || page_count == 0) {
+        return NULL;
+    }
+
+    for(int32_t tries = 0; tries < MG_VERIFY_PICK_RETRIES; tries++) {
+        mapguard_cache_metadata_t *page = metadata_page_at(rand_uint64() % page_count);
+
+        if(page->free == page->total) {
+            continue;
+        }
+
+        mapguard_cache_entry_t *entries = (mapguard_cache_entry_t *) (page + 1);
+        uint32_t first = rand_uint64() % page->total;
+
+        for(uint32_t i = 0; i < page->total; i++) {
+            mapguard_cache_entry_t *mce = &entries[(first + i) % page->total];
+
+            if(mce->start != NULL) {
+                return mce;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Checks one random entry. Returns true if it had drifted */
+static bool verify_sample(int fd, mapguard_maps_t *maps) {
+    bool drift = false;
+
+    maps_lock(fd, maps);
+
+    /* Entries created on the fake kernel have nothing to compare with */
+    if(g_mg_syscalls->backed) {
+        mapguard_cache_entry_t *mce = verify_pick();
+
+        if(mce != NULL) {
+            drift = verify_entry(fd, maps, mce);
+        }
+    }
+
+    maps_unlock(maps);
+    return drift;
+}
+
+/* Checks count random tracked entries, or every tracked entry
+ * if count is 0, against the kernel. Drift is repaired if
+ * MG_VERIFY_REPAIR is set. Returns the number of entries that
+ * had drifted */
+size_t mapguard_verify(size_t count) {
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    mapguard_maps_t maps;
+    size_t drifted = 0;
+
+    if(fd == -1) {
+        return 0;
+    }
+
+    memset(&maps, 0x0, sizeof(maps));
+
+    if(count != 0) {
+        for(size_t i = 0; i < count; i++) {
+            drifted += verify_sample(fd, &maps);
+        }
+
+        maps_free(&maps);
+        close(fd);
+        return drifted;
+    }
+
+    maps_lock(fd, &maps);
+
+    for(uint32_t i = 0; i < g_metadata_directory.page_count && g_mg_syscalls->backed; i++) {
+        mapguard_cache_metadata_t *page = metadata_page_at(i);
+        mapguard_cache_entry_t *mce = (mapguard_cache_entry_t *) (page + 1);
+
+        for(uint32_t j = 0; j < page->total; j++, mce++) {
+            if(mce->start != NULL) {
+                drifted += verify_entry(fd, &maps, mce);
+            }
+        }
+    }
+
+    maps_unlock(&maps);
+    maps_free(&maps);
+    close(fd);
+    return drifted;
+}
+
+#if THREAD_SUPPORT
+static uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static void *verifier_main(void *arg) {
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    mapguard_maps_t maps;
+
+    if(fd == -1) {
+        LOG_ERROR("Failed to open /proc/self/maps, the verifier is not running");
+        return NULL;
+    }
+
+    memset(&maps, 0x0, sizeof(maps));
+
+    struct timespec tick = {.tv_sec = 0, .tv_nsec = MG_VERIFY_TICK_NS};
+    uint64_t begin = get_monotonic_ns();
+    uint64_t last = begin;
+    /* Samples owed, scaled by a second so that rates below
+     * one sample per tick still add up. At most a second of
+     * samples is carried over */
+    uint64_t credit = 0;
+
+    while(__atomic_load_n(&g_verifier_stop, __ATOMIC_ACQUIRE) == false) {
+        nanosleep(&tick, NULL);
+
+        uint64_t now = get_monotonic_ns();
+        credit = MIN(credit + ((now - last) * g_verify_rate), g_verify_rate * 1000000000ULL);
+        last = now;
+        /* Samples taken in one tick are a batch and share one
+         * read of /proc/self/maps */
+        maps.count = 0;
+
+        while(credit >= 1000000000ULL) {
+            uint64_t cpu = thread_cpu_ns();
+
+            if(cpu * 100 > (get_monotonic_ns() - begin) * g_verify_budget) {
+                LOCK_MG();
+                g_mapguard_stats.verify_throttled++;
+                g_mapguard_stats.verify_cpu_ns = cpu;
+                UNLOCK_MG();
+                break;
+            }
+
+            credit -= 1000000000ULL;
+            verify_sample(fd, &maps);
+        }
+
+        LOCK_MG();
+        g_mapguard_stats.verify_cpu_ns = thread_cpu_ns();
+        UNLOCK_MG();
+    }
+
+    maps_free(&maps);
+    close(fd);
+    return NULL;
+}
+
+/* Starts the verifier the first time it is needed. Like the
+ * guard page worker this must be called without _mg_mutex held */
+void start_verifier(void) {
+    if(g_verify_rate == 0 || __atomic_load_n(&g_verifier_state, __ATOMIC_ACQUIRE) != 0) {
+        return;
+    }
+
+    int32_t expected = 0;
+
+    if(__atomic_compare_exchange_n(&g_verifier_state, &expected, 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) == false) {
+        return;
+    }
+
+    g_verifier_stop = false;
+
+    if(pthread_create(&g_verifier, NULL, verifier_main, NULL) != 0) {
+        LOG_ERROR("Failed to start the verifier");
+        g_verify_rate = 0;
+        return;
+    }
+
+    __atomic_store_n(&g_verifier_state, 2, __ATOMIC_RELEASE);
+}
+
+/* Waits for the verifier to exit, it notices within a tick.
+ * Called from mapguard_dtor without _mg_mutex held */
+void stop_verifier(void) {
+    if(__atomic_load_n(&g_verifier_state, __ATOMIC_ACQUIRE) != 2) {
+        return;
+    }
+
+    __atomic_store_n(&g_verifier_stop, true, __ATOMIC_RELEASE);
+    pthread_join(g_verifier, NULL);
+    __atomic_store_n(&g_verifier_state, 0, __ATOMIC_RELEASE);
+}
+
+static void verify_atfork_prepare(void) {
+    if(g_verify_fork_lock) {
+        LOCK_MG();
+    }
+}
+
+static void verify_atfork_parent(void) {
+    if(g_verify_fork_lock) {
+        UNLOCK_MG();
+    }
+}
+
+/* The verifier doesn't exist in the child, the next mmap starts one */
+static void verify_atfork_child(void) {
+    g_verifier_state = 0;
+
+    if(g_verify_fork_lock) {
+        UNLOCK_MG();
+    }
+}
+#else
+void start_verifier(void) {
+}
+
+void stop_verifier(void) {
+}
+#endif
+
+/* Reads the MG_VERIFY_* configuration. Called from mapguard_ctor */
+void verify_init(void) {
+    g_verify_rate = env_to_int(MG_VERIFY_RATE);
+    g_verify_repair = env_to_int(MG_VERIFY_REPAIR) != 0;
+    g_verify_budget = env_to_int(MG_VERIFY_BUDGET);
+
+    if(g_verify_budget == 0) {
+        g_verify_budget = MG_VERIFY_DEFAULT_BUDGET;
+    }
+
+    g_verify_budget = MIN(g_verify_budget, 100);
+
+    if(g_verify_rate == 0) {
+        return;
+    }
+
+#if THREAD_SUPPORT
+    g_verify_fork_lock = (g_mapguard_policy.async_guard_pages == 0);
+    pthread_atfork(verify_atfork_prepare, verify_atfork_parent, verify_atfork_child);
+    LOG("Verifying %lu tracked mappings per second within %lu%% of a CPU", g_verify_rate, g_verify_budget);
+#else
+    LOG("MG_VERIFY_RATE requires THREAD_SUPPORT, use mapguard_verify() instead");
+#endif
+}
@@ -0,0 +1,173 @@
+/* MapGuard mapping cache benchmark
+ * Copyright Chris Rohlf - 2025
+ *
+ * Replays an identical synthetic trace against every mapping
+ * cache backend at several cache sizes. Each trace inserts all
+ * entries in a random order, performs lookups that hit and miss,
+ * churns entries by removing and reinserting them at new addresses
+ * and finally removes everything. Results are printed in ns/op.
+ *
+ * It then switches to the fake kernel and times the mmap and
+ * munmap hooks end to end, so the cost of the cache and policy
+ * code is measured without real syscall noise.
+ *
+ * The entries are synthetic and never dereferenced as memory, so
+ * their addresses are only used as keys */
+
+#include "mapguard.h"
+
+#define BENCH_VECTOR_MAX_ENTRIES 10000
+#define BENCH_LOOKUPS 100000
+#define BENCH_CHURN 10000
+#define BENCH_HOOK_MAPPINGS 200000
+
+static size_t bench_sizes[] = {20, 1000, 100000};
+
+typedef struct {
+    uint64_t insert_ns;
+    uint64_t lookup_ns;
+    uint64_t churn_ns;
+    uint64_t remove_ns;
+    uint64_t hits;
+} bench_result_t;
+
+static uint64_t xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Entries are 2 pages long and spaced 4 pages apart so half
+ * of the random lookups in the covered range miss */
+static void *entry_address(size_t slot) {
+    return (void *) (MG_RAND_HINT_MIN + (slot * 4 * g_page_size));
+}
+
+static void run_trace(const mapguard_cache_ops_t *ops, size_t count, bench_result_t *result) {
+    mapguard_cache_entry_t *entries = calloc(count, sizeof(mapguard_cache_entry_t));
+    size_t *order = calloc(count, sizeof(size_t));
+    mapguard_cache_t cache;
+    uint64_t seed = 0x9e3779b97f4a7c15;
+    uint64_t start;
+
+    memset(result, 0x0, sizeof(bench_result_t));
+
+    for(size_t i = 0; i < count; i++) {
+        entries[i].start = entry_address(i);
+        entries[i].size = g_page_size * 2;
+        order[i] = i;
+    }
+
+    /* Fisher-Yates shuffle of the insertion order */
+    for(size_t i = count - 1; i > 0; i--) {
+        size_t j = xorshift64(&seed) % (i + 1);
+        size_t t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+
+    mapguard_cache_init(&cache, ops);
+
+    start = now_ns();
+
+    for(size_t i = 0; i < count; i++) {
+        mapguard_cache_insert(&cache, &entries[order[i]]);
+    }
+
+    result->insert_ns = (now_ns() - start) / count;
+
+    start = now_ns();
+
+    for(size_t i = 0; i < BENCH_LOOKUPS; i++) {
+        void *addr = entry_address(0) + (xorshift64(&seed) % (count * 4 * g_page_size));
+
+        if(mapguard_cache_lookup(&cache, addr) != NULL) {
+            result->hits++;
+        }
+    }
+
+    result->lookup_ns = (now_ns() - start) / BENCH_LOOKUPS;
+
+    size_t next_slot = count;
+    start = now_ns();
+
+    for(size_t i = 0; i < BENCH_CHURN; i++) {
+        mapguard_cache_entry_t *mce = &entries[xorshift64(&seed) % count];
+        mapguard_cache_rekey(&cache, mce, entry_address(next_slot++));
+    }
+
+    result->churn_ns = (now_ns() - start) / BENCH_CHURN;
+
+    start = now_ns();
+
+    for(size_t i = 0; i < count; i++) {
+        mapguard_cache_remove(&cache, &entries[order[i]]);
+    }
+
+    result->remove_ns = (now_ns() - start) / count;
+
+    mapguard_cache_destroy(&cache);
+    free(entries);
+    free(order);
+}
+
+static void run_hooks() {
+    void **ptrs = calloc(BENCH_HOOK_MAPPINGS, sizeof(void *));
+    uint64_t start;
+    uint64_t mmap_ns;
+    size_t vmas;
+
+    mapguard_fake_kernel_enable();
+
+    start = now_ns();
+
+    for(size_t i = 0; i < BENCH_HOOK_MAPPINGS; i++) {
+        ptrs[i] = mmap(NULL, g_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+
+    mmap_ns = (now_ns() - start) / BENCH_HOOK_MAPPINGS;
+    vmas = mapguard_fake_kernel_vma_count();
+
+    start = now_ns();
+
+    for(size_t i = 0; i < BENCH_HOOK_MAPPINGS; i++) {
+        munmap(ptrs[i], g_page_size);
+    }
+
+    printf("fake,%d,%lu,%lu,%zu\n", BENCH_HOOK_MAPPINGS, mmap_ns, (now_ns() - start) / BENCH_HOOK_MAPPINGS, vmas);
+    free(ptrs);
+}
+
+int main(int argc, char *argv[]) {
+    bench_result_t result;
+
+    printf("backend,entries,insert_ns,lookup_ns,churn_ns,remove_ns,hits\n");
+
+    for(size_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+        for(int32_t b = 0; b < MG_CACHE_BACKEND_COUNT; b++) {
+            const mapguard_cache_ops_t *ops = &g_cache_backends[b];
+
+            if(ops->id == MG_CACHE_BACKEND_VECTOR && bench_sizes[s] > BENCH_VECTOR_MAX_ENTRIES) {
+                continue;
+            }
+
+            run_trace(ops, bench_sizes[s], &result);
+            printf("%s,%zu,%lu,%lu,%lu,%lu,%lu\n", ops->name, bench_sizes[s], result.insert_ns,
+                   result.lookup_ns, result.churn_ns, result.remove_ns, result.hits);
+        }
+    }
+
+    printf("kernel,mappings,mmap_ns,munmap_ns,vmas\n");
+    run_hooks();
+
+    return OK;
+}
@@ -0,0 +1,83 @@
+/* MapGuard C++ interface tests
+ * Copyright Chris Rohlf - 2025 */
+
+#include "mapguard.hpp"
+
+#include <memory_resource>
+#include <vector>
+
+#define ALLOC_SIZE 4096 * 16
+
+void guarded_buffer_test() {
+    mg::guarded_buffer<> buffer(ALLOC_SIZE);
+
+    if(buffer.as<uint8_t>()[0] != MG_POISON_BYTE) {
+        LOG("Failure: guarded buffer was not poisoned");
+        return;
+    }
+
+    memset(buffer.data(), 0x41, buffer.size());
+
+    if(buffer.protect<PROT_READ>() == false) {
+        LOG("Failure: to make guarded buffer read only");
+        return;
+    }
+
+    /* Written then executable is a W^X transition */
+    if(buffer.protect(PROT_READ | PROT_EXEC)) {
+        LOG("Failure: guarded buffer transitioned from W to X");
+        return;
+    }
+
+    mg::guarded_buffer<> moved(std::move(buffer));
+
+    if(buffer || moved.as<uint8_t>()[0] != 0x41) {
+        LOG("Failure: guarded buffer was not moved");
+        return;
+    }
+
+    LOG("Success: guarded buffer %p", moved.data());
+}
+
+void guarded_buffer_policy_test() {
+    mg::guarded_buffer<mg::guard_only_policy> buffer(ALLOC_SIZE);
+
+    if(buffer.protect(PROT_READ | PROT_EXEC) == false) {
+        LOG("Failure: guard only policy enforced W^X");
+        return;
+    }
+
+    LOG("Success: guard only policy allowed W to X");
+}
+
+void guarded_resource_test() {
+    mg::guarded_resource<> resource;
+    void *first = nullptr;
+
+    {
+        std::pmr::vector<uint64_t> v(&resource);
+        v.resize(1000, 0x41);
+        first = v.data();
+    }
+
+    std::pmr::vector<uint64_t> v(&resource);
+    v.resize(1000);
+
+    /* The same size class is reused from the pool */
+    if(v.data() != first) {
+        LOG("Failure: guarded resource did not reuse a pooled block");
+        return;
+    }
+
+    LOG("Success: guarded resource reused %p", first);
+}
+
+int main(int argc, char *argv[]) {
+    guarded_buffer_test();
+    guarded_buffer_policy_test();
+    guarded_resource_test();
+
+    LOG("Done testing");
+
+    return OK;
+}
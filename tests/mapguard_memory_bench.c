@@ -0,0 +1,212 @@
+/* MapGuard memory overhead benchmark
+ * Copyright Chris Rohlf - 2025
+ *
+ * Runs each workload in a forked child and reports how much the
+ * mappings it left behind grew the resident set size, page table
+ * memory (VmPTE), VMAs in /proc/self/maps and the bytes of
+ * mapguard metadata. Results are printed as CSV, one
+ * line per workload, labelled with argv[1].
+ *
+ * This program is not linked against mapguard so it can run with
+ * and without the preload. run_memory_bench.sh runs it under each
+ * policy combination and adds the overhead against a run without
+ * mapguard to every line. Metadata is read with dlsym and is 0
+ * when mapguard isn't loaded */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mapguard.h"
+
+#define BENCH_SMALL_MAPPINGS 10000
+#define BENCH_LARGE_MAPPINGS 64
+#define BENCH_LARGE_SIZE (1024 * 1024)
+#define BENCH_CHURN_LIVE 2000
+#define BENCH_CHURN_ROUNDS 50000
+#define BENCH_SPLIT_MAPPINGS 2000
+#define BENCH_SPLIT_PAGES 8
+
+typedef void (mapguard_get_stats_t)(mapguard_stats_t *stats);
+
+typedef struct {
+    uint64_t rss_kb;
+    uint64_t pte_kb;
+    uint64_t vmas;
+    uint64_t metadata_bytes;
+} bench_memory_t;
+
+typedef struct {
+    const char *name;
+    size_t (*run)(void);
+} bench_workload_t;
+
+static size_t page_size;
+
+static uint64_t xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void *map_pages(size_t size) {
+    uint8_t *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(p == MAP_FAILED) {
+        fprintf(stderr, "mmap of %zu bytes failed\n", size);
+        exit(ERROR);
+    }
+
+    /* Touch one byte per page like a real user of the memory */
+    for(size_t i = 0; i < size; i += page_size) {
+        p[i] = 0x41;
+    }
+
+    return p;
+}
+
+/* Many single page mappings, such as small allocator slabs */
+static size_t run_small(void) {
+    for(size_t i = 0; i < BENCH_SMALL_MAPPINGS; i++) {
+        map_pages(page_size);
+    }
+
+    return BENCH_SMALL_MAPPINGS;
+}
+
+/* A few large mappings, such as heap arenas */
+static size_t run_large(void) {
+    for(size_t i = 0; i < BENCH_LARGE_MAPPINGS; i++) {
+        map_pages(BENCH_LARGE_SIZE);
+    }
+
+    return BENCH_LARGE_MAPPINGS;
+}
+
+/* Mappings of random sizes replaced at random, leaving holes
+ * wherever the address space is reused unevenly */
+static size_t run_churn(void) {
+    void *ptrs[BENCH_CHURN_LIVE];
+    size_t sizes[BENCH_CHURN_LIVE];
+    uint64_t seed = 0x9e3779b97f4a7c15;
+
+    for(size_t i = 0; i < BENCH_CHURN_LIVE; i++) {
+        sizes[i] = ((xorshift64(&seed) % 16) + 1) * page_size;
+        ptrs[i] = map_pages(sizes[i]);
+    }
+
+    for(size_t i = 0; i < BENCH_CHURN_ROUNDS; i++) {
+        size_t slot = xorshift64(&seed) % BENCH_CHURN_LIVE;
+        munmap(ptrs[slot], sizes[slot]);
+        sizes[slot] = ((xorshift64(&seed) % 16) + 1) * page_size;
+        ptrs[slot] = map_pages(sizes[slot]);
+    }
+
+    return BENCH_CHURN_LIVE;
+}
+
+/* Mappings with alternating page protections, like a JIT or a
+ * loader, each one split into BENCH_SPLIT_PAGES VMAs */
+static size_t run_split(void) {
+    for(size_t i = 0; i < BENCH_SPLIT_MAPPINGS; i++) {
+        uint8_t *p = map_pages(page_size * BENCH_SPLIT_PAGES);
+
+        for(size_t j = 0; j < BENCH_SPLIT_PAGES; j += 2) {
+            mprotect(p + (j * page_size), page_size, PROT_READ);
+        }
+    }
+
+    return BENCH_SPLIT_MAPPINGS;
+}
+
+static bench_workload_t workloads[] = {
+    {"small", run_small},
+    {"large", run_large},
+    {"churn", run_churn},
+    {"split", run_split},
+};
+
+/* Returns the value of a "Name: value kB" line of /proc/self/status */
+static uint64_t proc_status_kb(const char *status, const char *name) {
+    const char *p = strstr(status, name);
+    return (p != NULL) ? strtoull(p + strlen(name), NULL, 10) : 0;
+}
+
+static void measure(bench_memory_t *m) {
+    char buf[8192];
+    ssize_t n;
+    int fd = open("/proc/self/status", O_RDONLY);
+
+    memset(m, 0x0, sizeof(bench_memory_t));
+
+    if(fd != -1) {
+        n = read(fd, buf, sizeof(buf) - 1);
+        buf[(n > 0) ? n : 0] = '\0';
+        m->rss_kb = proc_status_kb(buf, "VmRSS:");
+        m->pte_kb = proc_status_kb(buf, "VmPTE:");
+        close(fd);
+    }
+
+    fd = open("/proc/self/maps", O_RDONLY);
+
+    if(fd != -1) {
+        while((n = read(fd, buf, sizeof(buf))) > 0) {
+            for(ssize_t i = 0; i < n; i++) {
+                m->vmas += (buf[i] == '\n');
+            }
+        }
+
+        close(fd);
+    }
+
+    mapguard_get_stats_t *get_stats = (mapguard_get_stats_t *) dlsym(RTLD_DEFAULT, "mapguard_get_stats");
+
+    if(get_stats != NULL) {
+        mapguard_stats_t stats;
+        get_stats(&stats);
+        m->metadata_bytes = stats.metadata_pages * page_size;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    const char *label = (argc > 1) ? argv[1] : "none";
+
+    page_size = getpagesize();
+
+    for(size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+        pid_t pid = fork();
+
+        if(pid == 0) {
+            bench_memory_t before, after;
+
+            measure(&before);
+            size_t mappings = workloads[w].run();
+            measure(&after);
+
+            /* One write so the lines of every child stay in order */
+            printf("%s,%s,%zu,%ld,%ld,%ld,%ld\n", label, workloads[w].name, mappings, (int64_t) (after.rss_kb - before.rss_kb),
+                   (int64_t) (after.pte_kb - before.pte_kb), (int64_t) (after.vmas - before.vmas),
+                   (int64_t) (after.metadata_bytes - before.metadata_bytes));
+            fflush(stdout);
+            _exit(OK);
+        }
+
+        int status = 0;
+
+        if(pid == -1 || waitpid(pid, &status, 0) != pid || WIFEXITED(status) == 0 || WEXITSTATUS(status) != OK) {
+            fprintf(stderr, "%s workload %s failed\n", label, workloads[w].name);
+            return ERROR;
+        }
+    }
+
+    return OK;
+}
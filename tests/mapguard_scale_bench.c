@@ -0,0 +1,321 @@
+/* MapGuard scale benchmark
+ * Copyright Chris Rohlf - 2025
+ *
+ * Grows the number of live tracked mappings in steps, doubling
+ * from BENCH_FIRST_STEP up to argv[1] (1M by default), and at
+ * each step times mmap, munmap and mprotect of randomly chosen
+ * mappings through the hooks. Results are printed as CSV with the
+ * mean and 99th percentile latency per call, one line per step.
+ *
+ * The real kernel refuses mappings past vm.max_map_count. When
+ * the requested count needs more VMAs than that, the limit is
+ * raised if we're allowed to write it, otherwise the benchmark
+ * runs against the fake kernel, which has no limit. A raised
+ * limit is restored before exiting. Passing "fake" as argv[2]
+ * always uses the fake kernel.
+ *
+ * Finally the slope of log(latency) over log(mappings) is fitted
+ * for every call. It is close to 0 when the cost of the hooks is
+ * constant or logarithmic in the number of mappings and close to
+ * 1 when it is linear, and any slope over BENCH_MAX_SLOPE makes
+ * the benchmark fail */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <math.h>
+
+#include "mapguard.h"
+
+#define BENCH_DEFAULT_MAPPINGS 1000000
+#define BENCH_FIRST_STEP 1024
+#define BENCH_SAMPLES 1000
+/* VMAs left for the rest of the process when checking the limit */
+#define BENCH_VMA_SLACK 4096
+#define BENCH_MAX_SLOPE 0.6
+#define BENCH_MAX_STEPS 32
+
+#define BENCH_OP_MMAP 0
+#define BENCH_OP_MUNMAP 1
+#define BENCH_OP_MPROTECT 2
+#define BENCH_OP_COUNT 3
+
+static const char *bench_op_names[BENCH_OP_COUNT] = {"mmap", "munmap", "mprotect"};
+
+typedef struct {
+    size_t mappings;
+    uint64_t mean_ns[BENCH_OP_COUNT];
+    uint64_t p99_ns[BENCH_OP_COUNT];
+    size_t vmas;
+} bench_step_t;
+
+static bool use_fake_kernel;
+/* vm.max_map_count before we raised it, 0 if we didn't */
+static size_t saved_max_map_count;
+
+static uint64_t xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void *map_page() {
+    return mmap(NULL, g_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+static size_t count_vmas() {
+    char buf[8192];
+    size_t lines = 0;
+    ssize_t n;
+
+    if(use_fake_kernel) {
+        return mapguard_fake_kernel_vma_count();
+    }
+
+    int fd = open("/proc/self/maps", O_RDONLY);
+
+    if(fd == -1) {
+        return 0;
+    }
+
+    while((n = read(fd, buf, sizeof(buf))) > 0) {
+        for(ssize_t i = 0; i < n; i++) {
+            lines += (buf[i] == '\n');
+        }
+    }
+
+    close(fd);
+    return lines;
+}
+
+static size_t read_max_map_count() {
+    char buf[32];
+    int fd = open("/proc/sys/vm/max_map_count", O_RDONLY);
+
+    if(fd == -1) {
+        return 0;
+    }
+
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    buf[(n > 0) ? n : 0] = '\0';
+    return strtoull(buf, NULL, 10);
+}
+
+static bool write_max_map_count(size_t count) {
+    char buf[32];
+    int fd = open("/proc/sys/vm/max_map_count", O_WRONLY);
+
+    if(fd == -1) {
+        return false;
+    }
+
+    int len = snprintf(buf, sizeof(buf), "%zu\n", count);
+    bool ret = write(fd, buf, len) == len;
+    close(fd);
+    return ret;
+}
+
+/* Returns how many VMAs each hooked mapping costs under the
+ * current policy, guard pages may or may not be VMAs of their own */
+static size_t vmas_per_mapping() {
+    void *ptrs[64];
+    size_t before = count_vmas();
+
+    for(size_t i = 0; i < 64; i++) {
+        ptrs[i] = map_page();
+    }
+
+    size_t after = count_vmas();
+
+    for(size_t i = 0; i < 64; i++) {
+        if(ptrs[i] != MAP_FAILED) {
+            munmap(ptrs[i], g_page_size);
+        }
+    }
+
+    return (after > before) ? ((after - before) + 63) / 64 : 1;
+}
+
+/* Picks the real kernel if it can hold count mappings, raising
+ * vm.max_map_count if needed and permitted */
+static void pick_kernel(size_t count) {
+    size_t limit = read_max_map_count();
+    size_t needed = ((count + BENCH_SAMPLES) * vmas_per_mapping()) + count_vmas() + BENCH_VMA_SLACK;
+
+    if(use_fake_kernel || limit >= needed) {
+        return;
+    }
+
+    if(write_max_map_count(needed)) {
+        saved_max_map_count = limit;
+        fprintf(stderr, "Raised vm.max_map_count from %zu to %zu\n", limit, needed);
+        return;
+    }
+
+    fprintf(stderr, "vm.max_map_count is %zu but %zu VMAs are needed, using the fake kernel\n", limit, needed);
+    use_fake_kernel = true;
+}
+
+static uint64_t summarize(uint64_t *samples, uint64_t *p99) {
+    uint64_t total = 0;
+
+    for(size_t i = 0; i < BENCH_SAMPLES; i++) {
+        total += samples[i];
+    }
+
+    qsort(samples, BENCH_SAMPLES, sizeof(uint64_t), compare_u64);
+    *p99 = samples[(BENCH_SAMPLES * 99) / 100];
+    return total / BENCH_SAMPLES;
+}
+
+/* Times BENCH_SAMPLES calls of each kind with live mappings in
+ * ptrs. New mappings replace randomly chosen ones as they are
+ * unmapped so the count is the same afterwards */
+static bool measure_step(void **ptrs, size_t live, void **extra, uint64_t *samples, uint64_t *seed, bench_step_t *step) {
+    uint64_t start;
+
+    for(size_t i = 0; i < BENCH_SAMPLES; i++) {
+        start = now_ns();
+        extra[i] = map_page();
+        samples[i] = now_ns() - start;
+
+        if(extra[i] == MAP_FAILED) {
+            return false;
+        }
+    }
+
+    step->mean_ns[BENCH_OP_MMAP] = summarize(samples, &step->p99_ns[BENCH_OP_MMAP]);
+    step->vmas = count_vmas();
+
+    for(size_t i = 0; i < BENCH_SAMPLES; i++) {
+        size_t slot = xorshift64(seed) % live;
+        start = now_ns();
+        munmap(ptrs[slot], g_page_size);
+        samples[i] = now_ns() - start;
+        ptrs[slot] = extra[i];
+    }
+
+    step->mean_ns[BENCH_OP_MUNMAP] = summarize(samples, &step->p99_ns[BENCH_OP_MUNMAP]);
+
+    for(size_t i = 0; i < BENCH_SAMPLES; i++) {
+        size_t slot = xorshift64(seed) % live;
+        start = now_ns();
+        mprotect(ptrs[slot], g_page_size, PROT_READ);
+        samples[i] = now_ns() - start;
+        mprotect(ptrs[slot], g_page_size, PROT_READ | PROT_WRITE);
+    }
+
+    step->mean_ns[BENCH_OP_MPROTECT] = summarize(samples, &step->p99_ns[BENCH_OP_MPROTECT]);
+    step->mappings = live;
+    return true;
+}
+
+/* Least squares slope of log(mean latency) over log(mappings) */
+static double fit_slope(bench_step_t *steps, size_t count, int32_t op) {
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+
+    for(size_t i = 0; i < count; i++) {
+        double x = log((double) steps[i].mappings);
+        double y = log((double) (steps[i].mean_ns[op] ? steps[i].mean_ns[op] : 1));
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    double d = (count * sxx) - (sx * sx);
+    return (d != 0) ? ((count * sxy) - (sx * sy)) / d : 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t target = (argc > 1) ? strtoull(argv[1], NULL, 10) : BENCH_DEFAULT_MAPPINGS;
+    bench_step_t steps[BENCH_MAX_STEPS];
+    size_t step_count = 0;
+    size_t live = 0;
+    uint64_t seed = 0x9e3779b97f4a7c15;
+    int32_t ret = OK;
+
+    use_fake_kernel = (argc > 2 && strcmp(argv[2], "fake") == 0);
+
+    if(target < BENCH_FIRST_STEP) {
+        target = BENCH_FIRST_STEP;
+    }
+
+    /* Everything is allocated before the fake kernel is enabled,
+     * its mappings are not backed by memory */
+    void **ptrs = calloc(target, sizeof(void *));
+    void **extra = calloc(BENCH_SAMPLES, sizeof(void *));
+    uint64_t *samples = calloc(BENCH_SAMPLES, sizeof(uint64_t));
+
+    if(ptrs == NULL || extra == NULL || samples == NULL) {
+        fprintf(stderr, "Failed to allocate %zu mapping slots\n", target);
+        return ERROR;
+    }
+
+    pick_kernel(target);
+    printf("kernel,mappings,vmas,mmap_ns,mmap_p99_ns,munmap_ns,munmap_p99_ns,mprotect_ns,mprotect_p99_ns\n");
+    fflush(stdout);
+
+    if(use_fake_kernel) {
+        mapguard_fake_kernel_enable();
+    }
+
+    for(size_t next = BENCH_FIRST_STEP; live < target && step_count < BENCH_MAX_STEPS; next *= 2) {
+        next = (next > target) ? target : next;
+
+        for(; live < next; live++) {
+            ptrs[live] = map_page();
+
+            if(ptrs[live] == MAP_FAILED) {
+                fprintf(stderr, "mmap failed after %zu mappings (%s)\n", live, strerror(errno));
+                break;
+            }
+        }
+
+        if(live < next || measure_step(ptrs, live, extra, samples, &seed, &steps[step_count]) == false) {
+            ret = ERROR;
+            break;
+        }
+
+        bench_step_t *s = &steps[step_count++];
+        printf("%s,%zu,%zu,%lu,%lu,%lu,%lu,%lu,%lu\n", use_fake_kernel ? "fake" : "real", s->mappings, s->vmas,
+               s->mean_ns[BENCH_OP_MMAP], s->p99_ns[BENCH_OP_MMAP], s->mean_ns[BENCH_OP_MUNMAP], s->p99_ns[BENCH_OP_MUNMAP],
+               s->mean_ns[BENCH_OP_MPROTECT], s->p99_ns[BENCH_OP_MPROTECT]);
+        fflush(stdout);
+    }
+
+    printf("call,slope\n");
+
+    for(int32_t op = 0; op < BENCH_OP_COUNT && step_count > 1; op++) {
+        double slope = fit_slope(steps, step_count, op);
+        printf("%s,%.3f\n", bench_op_names[op], slope);
+
+        if(slope > BENCH_MAX_SLOPE) {
+            fprintf(stderr, "%s latency grows with a slope of %.3f, the hooks may be O(n) again\n", bench_op_names[op], slope);
+            ret = ERROR;
+        }
+    }
+
+    if(saved_max_map_count != 0) {
+        write_max_map_count(saved_max_map_count);
+    }
+
+    /* Mappings made by the fake kernel can't be touched, and the
+     * process is about to exit anyway */
+    return ret;
+}
@@ -3,11 +3,14 @@
 
 #define _GNU_SOURCE
 #include <assert.h>
+#include <fcntl.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include "mapguard.h"
@@ -183,6 +186,1018 @@ void check_map_partial_unmap_top_test() {
     munmap(ptr, 4096);
 }
 
+void check_randomized_placement_test() {
+    void *ptr = map_memory("Randomized", PROT_READ | PROT_WRITE);
+    void *ptr2 = map_memory("Randomized", PROT_READ | PROT_WRITE);
+
+    if(ptr == MAP_FAILED || ptr2 == MAP_FAILED) {
+        LOG("Failure: to map randomized memory");
+    } else if(ptr2 + ALLOC_SIZE + (4096 * 2) == ptr || ptr + ALLOC_SIZE + (4096 * 2) == ptr2) {
+        LOG("Failure: mappings were placed adjacent to each other %p %p", ptr, ptr2);
+    } else {
+        LOG("Success: mapped randomized memory @ %p %p", ptr, ptr2);
+    }
+
+    if(rand_uint64() == rand_uint64()) {
+        LOG("Failure: rand_uint64 returned the same value twice");
+    }
+
+    unmap_memory(ptr);
+    unmap_memory(ptr2);
+}
+
+/* Returns data rather than mapping, which is gone by the
+ * time mapguard_for_each_mapping returns */
+static void *find_snapshot_mapping(mapguard_mapping_t *mapping, void *data) {
+    if(mapping->start == data) {
+        return data;
+    }
+
+    return NULL;
+}
+
+void check_snapshot_test() {
+    void *ptr = map_memory("Snapshot", PROT_READ | PROT_WRITE);
+    void *ptr2 = map_memory("Snapshot", PROT_READ);
+    mapguard_snapshot_t *snapshot = mapguard_snapshot();
+
+    if(snapshot == NULL || snapshot->count < 2) {
+        LOG("Failure: snapshot is missing tracked mappings");
+    } else if(mapguard_for_each_mapping(find_snapshot_mapping, ptr) == NULL ||
+              mapguard_for_each_mapping(find_snapshot_mapping, ptr2) == NULL) {
+        LOG("Failure: mapping not found in snapshot");
+    } else {
+        LOG("Success: snapshot of %zu mappings took %lu ns", snapshot->count, snapshot->snapshot_ns);
+    }
+
+    mapguard_snapshot_free(snapshot);
+    unmap_memory(ptr);
+    unmap_memory(ptr2);
+}
+
+void check_dump_test() {
+    void *ptr = map_memory("Dump", PROT_READ | PROT_WRITE);
+    mapguard_dump_header_t header;
+
+    memset(&header, 0x0, sizeof(header));
+
+    if(mapguard_dump("/tmp/mapguard_test.dump") != OK) {
+        LOG("Failure: to write a metadata dump");
+    } else {
+        int fd = open("/tmp/mapguard_test.dump", O_RDONLY);
+
+        if(fd != -1) {
+            read(fd, &header, sizeof(header));
+            close(fd);
+        }
+
+        if(header.version != MG_DUMP_VERSION || header.fd_type_offset != offsetof(mapguard_cache_entry_t, fd_type) ||
+           header.alloc_flags_offset != offsetof(mapguard_cache_entry_t, alloc_flags) ||
+           header.lifetime_key_offset != offsetof(mapguard_cache_entry_t, lifetime_key) ||
+           header.lifetime_birth_offset != offsetof(mapguard_cache_entry_t, lifetime_birth) ||
+           header.lifetime_class_offset != offsetof(mapguard_cache_entry_t, lifetime_class)) {
+            LOG("Failure: metadata dump header version %u does not describe every entry field", header.version);
+        } else {
+            LOG("Success: wrote a metadata dump");
+        }
+    }
+
+    unlink("/tmp/mapguard_test.dump");
+    unmap_memory(ptr);
+}
+
+/* Run with MG_POISON_ON_ALLOCATION=1 and MG_DONTDUMP_POISONED=1 */
+void check_dump_savings_test() {
+    mapguard_stats_t stats;
+    size_t page_size = getpagesize();
+    uint64_t before = mapguard_dump_savings();
+    uint8_t *ptr = map_memory("Dump savings", PROT_READ | PROT_WRITE);
+    uint64_t poisoned = mapguard_dump_savings();
+
+    ptr[0] = 0x41;
+    uint64_t written = mapguard_dump_savings();
+    mapguard_get_stats(&stats);
+
+    /* Every page is poisoned and it has two guard pages */
+    if(poisoned - before < ALLOC_SIZE + (page_size * 2)) {
+        LOG("Failure: dump savings only grew by %lu bytes for a poisoned mapping", poisoned - before);
+    } else if(poisoned - written != page_size) {
+        LOG("Failure: writing a page changed the dump savings by %lu bytes", poisoned - written);
+    } else if(stats.dontdump_bytes == 0) {
+        LOG("Failure: metadata is not excluded from core dumps");
+    } else {
+        LOG("Success: %lu bytes are kept out of core dumps", written);
+    }
+
+    unmap_memory(ptr);
+}
+
+void check_zero_length_test() {
+    void *ptr = mmap(NULL, 0, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+    if(ptr != MAP_FAILED || errno != EINVAL) {
+        LOG("Failure: zero length mapping returned %p", ptr);
+    } else {
+        LOG("Success: zero length mapping was refused");
+    }
+}
+
+/* Allocates entries until the directory grows past its first
+ * L2 table, then checks the directory and its nonfull bitmaps */
+void check_metadata_directory_test() {
+    mapguard_metadata_directory_t *dir = &g_metadata_directory;
+    size_t max = (MG_METADATA_L2_SIZE + 1) * MG_METADATA_BITMAP_WORDS * 64;
+    mapguard_cache_entry_t **entries = calloc(max, sizeof(mapguard_cache_entry_t *));
+    mapguard_cache_metadata_t *page = NULL;
+    size_t count = 0;
+    bool ok = true;
+
+    if(entries == NULL) {
+        LOG("Failure: to allocate the entry list");
+        return;
+    }
+
+    LOCK_MG();
+
+    while(count < max && (page == NULL || page->index < MG_METADATA_L2_SIZE)) {
+        entries[count] = find_free_mce();
+        page = get_base_page(entries[count++]);
+    }
+
+    uint32_t node = page->node;
+
+    for(uint32_t i = 0; i < dir->page_count; i++) {
+        if(metadata_page_at(i)->index != i) {
+            LOG("Failure: metadata page %u is at index %u", metadata_page_at(i)->index, i);
+            ok = false;
+        }
+    }
+
+    if(page->index < MG_METADATA_L2_SIZE || dir->l2[1] == NULL || metadata_page_at(page->index) != page) {
+        LOG("Failure: directory did not grow past one L2 table, %u pages", dir->page_count);
+        ok = false;
+    }
+
+    /* Every page of ours in the first table is full */
+    if((dir->nonfull[node][0] & 1) || (dir->nonfull[node][0] & 2) == 0) {
+        LOG("Failure: L1 nonfull bitmap is %lx", dir->nonfull[node][0]);
+        ok = false;
+    }
+
+    /* Freeing an entry makes its page and table nonfull again
+     * and it is the next entry handed out */
+    mapguard_cache_entry_t *mce = entries[0];
+    mapguard_cache_metadata_t *first = get_base_page(mce);
+    uint32_t bit = first->index % MG_METADATA_L2_SIZE;
+    free_mce(mce);
+
+    if((dir->nonfull[node][0] & 1) == 0 || (dir->l2[0]->nonfull[node][bit / 64] & (1ULL << (bit % 64))) == 0) {
+        LOG("Failure: freeing an entry of page %u did not mark it nonfull", first->index);
+        ok = false;
+    }
+
+    entries[0] = find_free_mce();
+
+    if(entries[0] != mce || (dir->nonfull[node][0] & 1)) {
+        LOG("Failure: freed entry %p was not reused, got %p", mce, entries[0]);
+        ok = false;
+    }
+
+    for(size_t i = 0; i < count; i++) {
+        free_mce(entries[i]);
+    }
+
+    UNLOCK_MG();
+    free(entries);
+
+    if(ok) {
+        LOG("Success: metadata directory grew to %u pages across two L2 tables", dir->page_count);
+    }
+}
+
+/* Run with MG_SELF_CALIBRATE=1 */
+void check_calibration_test() {
+    extern mapguard_policy_t g_mapguard_policy;
+    extern uint8_t g_guard_method;
+    mapguard_stats_t stats;
+    mapguard_get_stats(&stats);
+    mapguard_calibration_t *cal = &stats.calibration;
+
+    if(g_mapguard_policy.self_calibrate == 0) {
+        LOG("Success: MG_SELF_CALIBRATE is not set, nothing to check");
+        return;
+    }
+
+    uint8_t fastest_guard = (cal->guard_ns[MG_GUARD_METHOD_MADVISE] < cal->guard_ns[MG_GUARD_METHOD_MPROTECT]) ? MG_GUARD_METHOD_MADVISE
+                                                                                                              : MG_GUARD_METHOD_MPROTECT;
+    uint8_t fastest_lock = (cal->lock_ns[MG_LOCK_METHOD_ADAPTIVE] < cal->lock_ns[MG_LOCK_METHOD_MUTEX]) ? MG_LOCK_METHOD_ADAPTIVE
+                                                                                                       : MG_LOCK_METHOD_MUTEX;
+    bool poison_ok = true;
+
+    for(uint8_t m = 0; m < MG_POISON_METHOD_COUNT; m++) {
+        poison_ok &= (cal->poison_ns[m] >= cal->poison_ns[cal->poison_method]);
+    }
+
+    if(cal->calibration_ns == 0 || cal->guard_ns[MG_GUARD_METHOD_MPROTECT] == UINT64_MAX) {
+        LOG("Failure: calibration did not time anything");
+    } else if(cal->guard_method != fastest_guard || g_guard_method != fastest_guard) {
+        LOG("Failure: guard method %d was selected over the faster %d", cal->guard_method, fastest_guard);
+    } else if(poison_ok == false) {
+        LOG("Failure: poison method %d is not the fastest", cal->poison_method);
+    } else if(cal->lock_method != fastest_lock) {
+        LOG("Failure: lock method %d was selected over the faster %d (%lu ns vs %lu ns)", cal->lock_method, fastest_lock,
+            cal->lock_ns[cal->lock_method], cal->lock_ns[fastest_lock]);
+    } else {
+        LOG("Success: calibrated in %lu ns, guard method %d poison method %d lock method %d", cal->calibration_ns, cal->guard_method,
+            cal->poison_method, cal->lock_method);
+    }
+}
+
+/* Saves a profile and loads it back, then loads a profile with
+ * an impossible peak. Runs in a child so the profile isn't saved
+ * again when the test exits */
+void check_profile_test() {
+    extern mapguard_policy_t g_mapguard_policy;
+    extern mapguard_profile_t g_mapguard_loaded_profile;
+    extern bool g_mapguard_profile_loaded;
+    char path[64];
+
+    snprintf(path, sizeof(path), "/tmp/mapguard_profile_test.%d", getpid());
+    pid_t pid = fork();
+
+    if(pid == 0) {
+        mapguard_stats_t stats;
+        setenv(MG_PROFILE_PATH, path, 1);
+        profile_load();
+        unmap_memory(map_memory("Profile", PROT_READ | PROT_WRITE));
+        profile_save();
+        mapguard_get_stats(&stats);
+
+        g_mapguard_profile_loaded = false;
+        profile_load();
+
+        if(g_mapguard_profile_loaded == false || g_mapguard_loaded_profile.peak_tracked != stats.tracked_mappings_peak) {
+            LOG("Failure: profile with a peak of %lu tracked mappings did not load back", stats.tracked_mappings_peak);
+            _exit(0);
+        }
+
+        if(g_mapguard_loaded_profile.mmap_calls != stats.mmap_calls || g_mapguard_loaded_profile.mremap_calls != stats.mremap_calls ||
+           memcmp(g_mapguard_loaded_profile.size_classes, stats.size_classes, sizeof(stats.size_classes)) != 0 ||
+           g_mapguard_loaded_profile.call_site_count != 1 || g_mapguard_loaded_profile.call_sites[0].count != 1) {
+            LOG("Failure: profile size classes, remap counts or call sites did not load back");
+            _exit(0);
+        }
+
+        mapguard_profile_t hostile = g_mapguard_loaded_profile;
+        hostile.peak_tracked = 1ULL << 48;
+        FILE *fp = fopen(path, "w");
+        fwrite(&hostile, sizeof(hostile), 1, fp);
+        fclose(fp);
+
+        /* Only the cap is checked, nothing is reserved */
+        g_mapguard_policy.use_mapping_cache = 0;
+        profile_load();
+
+        if(g_mapguard_loaded_profile.peak_tracked >= hostile.peak_tracked) {
+            LOG("Failure: a profile peak of %lu tracked mappings was not capped", hostile.peak_tracked);
+        } else {
+            LOG("Success: profile loaded back with %lu tracked mappings, a hostile peak was capped to %lu", stats.tracked_mappings_peak,
+                g_mapguard_loaded_profile.peak_tracked);
+        }
+
+        _exit(0);
+    }
+
+    waitpid(pid, NULL, 0);
+    unlink(path);
+}
+
+void check_verify_test() {
+    mapguard_stats_t before, after;
+    void *ptr = map_memory("Verify", PROT_READ | PROT_WRITE);
+
+    mapguard_get_stats(&before);
+
+    /* Unmap it behind mapguard's back */
+    syscall(SYS_munmap, ptr, ALLOC_SIZE);
+    mapguard_verify(0);
+    mapguard_get_stats(&after);
+
+    if(after.verify_missing == before.verify_missing) {
+        LOG("Failure: verifier missed an unmapped mapping");
+    } else {
+        LOG("Success: verifier found %lu drifted mappings in %lu samples", after.verify_missing, after.verify_samples);
+    }
+
+    unmap_memory(ptr);
+}
+
+void *numa_thread(void *tid) {
+    *(pid_t *) tid = syscall(SYS_gettid);
+    return map_memory("NUMA", PROT_READ | PROT_WRITE);
+}
+
+/* Run with MG_NUMA_SIMULATE_NODES=2, threads are assigned to
+ * simulated nodes by thread id. Threads are started until one
+ * lands on the other node from this one */
+void check_numa_test() {
+    mapguard_stats_t stats;
+    pthread_t thread;
+    pid_t tid = syscall(SYS_gettid);
+    pid_t main_tid = tid;
+    void *ptrs[64];
+    int32_t count = 0;
+    void *ptr = map_memory("NUMA", PROT_READ | PROT_WRITE);
+
+    while(count < 64 && (tid % 2) == (main_tid % 2)) {
+        if(pthread_create(&thread, NULL, numa_thread, &tid) != 0 || pthread_join(thread, &ptrs[count]) != 0) {
+            LOG("Failure: to run the NUMA thread");
+            break;
+        }
+
+        count++;
+    }
+
+    mapguard_get_stats(&stats);
+
+    if((tid % 2) == (main_tid % 2)) {
+        LOG("Failure: no thread was assigned to the other node in %d tries", count);
+    } else if(stats.metadata_node_pages[0] == 0 || stats.metadata_node_pages[1] == 0) {
+        LOG("Failure: metadata pages were not allocated per node, node 0: %lu node 1: %lu", stats.metadata_node_pages[0],
+            stats.metadata_node_pages[1]);
+    } else {
+        LOG("Success: metadata pages on node 0: %lu node 1: %lu", stats.metadata_node_pages[0], stats.metadata_node_pages[1]);
+    }
+
+    unmap_memory(ptr);
+
+    for(int32_t i = 0; i < count; i++) {
+        unmap_memory(ptrs[i]);
+    }
+}
+
+/* Run with MG_TRACK_FILE_MAPPINGS=1 */
+void check_file_mapping_test() {
+    mapguard_stats_t before, after;
+    int fd = memfd_create("mapguard_test", 0);
+
+    if(fd == -1 || ftruncate(fd, ALLOC_SIZE) != 0) {
+        LOG("Failure: to create a memfd");
+        return;
+    }
+
+    mapguard_get_stats(&before);
+
+    void *ptr = mmap(0, ALLOC_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    void *ptr2 = mmap(0, ALLOC_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    void *ptr3 = mmap(0, ALLOC_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    mapguard_get_stats(&after);
+
+    /* The read only mapping isn't tracked and the fd is only classified once */
+    if(ptr == MAP_FAILED || ptr2 == MAP_FAILED || ptr3 == MAP_FAILED) {
+        LOG("Failure: to map the memfd");
+    } else if(after.file_mappings - before.file_mappings != 2 || after.fd_classifications - before.fd_classifications != 1) {
+        LOG("Failure: tracked %lu memfd mappings with %lu fstat calls", after.file_mappings - before.file_mappings,
+            after.fd_classifications - before.fd_classifications);
+    } else if(mprotect(ptr, ALLOC_SIZE, PROT_READ | PROT_WRITE) == 0) {
+        LOG("Failure: memfd mapping transitioned from X to W");
+    } else {
+        LOG("Success: memfd mapping could not transition from X to W");
+    }
+
+    munmap(ptr, ALLOC_SIZE);
+    munmap(ptr2, ALLOC_SIZE);
+    munmap(ptr3, ALLOC_SIZE);
+    close(fd);
+}
+
+void close_with_fclose(int fd) {
+    fclose(fdopen(fd, "r"));
+}
+
+void close_with_close_range(int fd) {
+    close_range(fd, fd, 0);
+}
+
+void close_with_closefrom(int fd) {
+    closefrom(fd);
+}
+
+/* Maps /dev/zero at a high fd so its type is cached, closes the
+ * fd with closer and checks that a memfd given the same fd number
+ * is classified again instead of inheriting the stale type */
+bool fd_reuse_reclassified(void (*closer)(int fd)) {
+    int zero = open("/dev/zero", O_RDWR);
+    int fd = fcntl(zero, F_DUPFD, MG_FD_CACHE_SIZE / 2);
+    close(zero);
+
+    void *ptr = mmap(0, ALLOC_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+    if(ptr == MAP_FAILED) {
+        return false;
+    }
+
+    munmap(ptr, ALLOC_SIZE);
+    closer(fd);
+
+    int memfd = memfd_create("mapguard_test", 0);
+    ftruncate(memfd, ALLOC_SIZE);
+    int reused = fcntl(memfd, F_DUPFD, fd);
+    close(memfd);
+
+    ptr = mmap(0, ALLOC_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, reused, 0);
+    mapguard_cache_entry_t *mce = (ptr != MAP_FAILED) ? get_cache_entry(ptr) : NULL;
+    bool ret = (reused == fd && mce != NULL && mce->fd_type == MG_FD_MEMFD);
+
+    if(ptr != MAP_FAILED) {
+        munmap(ptr, ALLOC_SIZE);
+    }
+
+    close(reused);
+    return ret;
+}
+
+/* Run with MG_TRACK_FILE_MAPPINGS=1 */
+void check_fd_reuse_test() {
+    if(fd_reuse_reclassified(close_with_fclose) == false) {
+        LOG("Failure: fd closed by fclose kept its cached type");
+    } else if(fd_reuse_reclassified(close_with_close_range) == false) {
+        LOG("Failure: fd closed by close_range kept its cached type");
+    } else if(fd_reuse_reclassified(close_with_closefrom) == false) {
+        LOG("Failure: fd closed by closefrom kept its cached type");
+    } else {
+        LOG("Success: fds closed by fclose, close_range and closefrom were classified again");
+    }
+}
+
+/* Returns true if the entry covering p is [start, start + size) */
+bool entry_is(void *p, void *start, size_t size) {
+    mapguard_cache_entry_t *mce = get_cache_entry(p);
+    return mce != NULL && mce->start == start && mce->size == size;
+}
+
+/* Maps four adjacent pages one at a time and checks they are merged
+ * into one entry, split by a partial mprotect, munmap and mremap, and
+ * merged again when the pages match their neighbours */
+void check_coalesce_test() {
+    extern mapguard_policy_t g_mapguard_policy;
+    mapguard_policy_t saved = g_mapguard_policy;
+    size_t page_size = getpagesize();
+    int flags = MAP_ANONYMOUS | MAP_PRIVATE;
+
+    g_mapguard_policy.coalesce_mappings = 1;
+    g_mapguard_policy.enable_guard_pages = 0;
+    g_mapguard_policy.prevent_static_address = 0;
+
+    uint8_t *p = mmap(0, page_size * 4, PROT_READ | PROT_WRITE, flags, -1, 0);
+    bool mapped = (p != MAP_FAILED && munmap(p + page_size, page_size * 3) == 0);
+
+    for(int32_t i = 1; i < 4 && mapped; i++) {
+        mapped = mmap(p + (page_size * i), page_size, PROT_READ | PROT_WRITE, flags | MAP_FIXED_NOREPLACE, -1, 0) == p + (page_size * i);
+    }
+
+    if(mapped == false) {
+        LOG("Failure: to map four adjacent pages");
+    } else if(entry_is(p + (page_size * 3), p, page_size * 4) == false) {
+        LOG("Failure: four adjacent pages at %p were not merged", p);
+    } else if(mprotect(p + page_size, page_size, PROT_READ) != 0 || entry_is(p, p, page_size) == false ||
+              entry_is(p + page_size, p + page_size, page_size) == false || entry_is(p + (page_size * 2), p + (page_size * 2), page_size * 2) == false) {
+        LOG("Failure: mprotect of one page did not split the entry at %p", p);
+    } else if(mprotect(p + page_size, page_size, PROT_READ | PROT_WRITE) != 0 || entry_is(p, p, page_size * 4) == false) {
+        LOG("Failure: restoring the protections at %p did not merge the entries", p + page_size);
+    } else if(munmap(p + page_size, page_size) != 0 || entry_is(p, p, page_size) == false || get_cache_entry(p + page_size) != NULL ||
+              entry_is(p + (page_size * 2), p + (page_size * 2), page_size * 2) == false) {
+        LOG("Failure: munmap of one page did not split the entry at %p", p);
+    } else if(mmap(p + page_size, page_size, PROT_READ | PROT_WRITE, flags | MAP_FIXED_NOREPLACE, -1, 0) != p + page_size ||
+              entry_is(p, p, page_size * 4) == false) {
+        LOG("Failure: refilling the hole at %p did not merge the entries", p + page_size);
+    } else if(mremap(p + (page_size * 2), page_size * 2, page_size, 0) != p + (page_size * 2) || entry_is(p, p, page_size * 3) == false) {
+        LOG("Failure: shrinking the top of the entry at %p with mremap", p);
+    } else {
+        /* The page above is taken so growing the middle page moves it */
+        uint8_t *n = mremap(p + page_size, page_size, page_size * 2, MREMAP_MAYMOVE);
+
+        if(n == MAP_FAILED || n == p + page_size || entry_is(p, p, page_size) == false || entry_is(n, n, page_size * 2) == false ||
+           entry_is(p + (page_size * 2), p + (page_size * 2), page_size) == false) {
+            LOG("Failure: moving the middle of the entry at %p with mremap", p);
+        } else {
+            LOG("Success: adjacent mappings were merged and split again by mprotect, munmap and mremap");
+        }
+
+        if(n != MAP_FAILED) {
+            munmap(n, page_size * 2);
+        }
+    }
+
+    if(p != MAP_FAILED) {
+        munmap(p, page_size * 4);
+    }
+
+    g_mapguard_policy = saved;
+}
+
+void check_secret_test() {
+    mapguard_stats_t stats;
+    uint8_t *secrets[300];
+
+    for(int32_t i = 0; i < 300; i++) {
+        secrets[i] = mapguard_secret_alloc(32);
+
+        if(secrets[i] == NULL) {
+            LOG("Failure: to allocate secret %d", i);
+            return;
+        }
+
+        memset(secrets[i], 0x41, 32);
+    }
+
+    uint8_t *first = secrets[0];
+
+    for(int32_t i = 0; i < 300; i++) {
+        mapguard_secret_free(secrets[i]);
+    }
+
+    mapguard_get_stats(&stats);
+
+    /* 300 secrets of 32 bytes need at least 3 chunks */
+    if(stats.secret_slots != 0 || stats.secret_chunks < 3) {
+        LOG("Failure: %lu secret slots in use in %lu chunks", stats.secret_slots, stats.secret_chunks);
+    } else if(first[0] != 0 || first[31] != 0) {
+        LOG("Failure: freed secret was not zeroed");
+    } else if(mapguard_secret_alloc(MG_SECRET_MAX_SLOT + 1) != NULL) {
+        LOG("Failure: allocated a secret larger than %d bytes", MG_SECRET_MAX_SLOT);
+    } else {
+        LOG("Success: secrets were zeroed and returned to %lu chunks", stats.secret_chunks);
+    }
+}
+
+/* Returns true if a child running fn on p died with SIGSEGV */
+bool child_faults(void (*fn)(uint8_t *p), uint8_t *p) {
+    pid_t pid = fork();
+
+    if(pid == 0) {
+        fn(p);
+        _exit(0);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV;
+}
+
+void overflow_sampled(uint8_t *p) {
+    p[32] = 0x41;
+}
+
+void use_sampled_after_free(uint8_t *p) {
+    uint8_t *volatile dangling = p;
+    free(p);
+    dangling[0] = 0x41;
+}
+
+/* A SIGSEGV sent by a process must still be fatal */
+void kill_self_segv(uint8_t *p) {
+    kill(getpid(), SIGSEGV);
+}
+
+/* Run with MG_SAMPLE_MALLOC_RATE=1 */
+void check_sample_malloc_test() {
+    mapguard_stats_t before, after;
+    uint8_t *p = NULL;
+
+    /* The first call of every thread only picks an interval */
+    for(int32_t i = 0; i < 4 && p == NULL; i++) {
+        mapguard_get_stats(&before);
+        uint8_t *q = malloc(32);
+        mapguard_get_stats(&after);
+
+        if(after.sampled_allocations != before.sampled_allocations) {
+            p = q;
+        } else {
+            free(q);
+        }
+    }
+
+    if(p == NULL) {
+        LOG("Failure: no allocation was sampled");
+        return;
+    }
+
+    memset(p, 0x41, 32);
+
+    if(((uintptr_t) (p + 32) & (getpagesize() - 1)) != 0) {
+        LOG("Failure: sampled allocation %p doesn't end on a guard page", p);
+    } else if(child_faults(overflow_sampled, p) == false) {
+        LOG("Failure: overflow of sampled allocation %p was not detected", p);
+    } else if(child_faults(use_sampled_after_free, p) == false) {
+        LOG("Failure: use after free of sampled allocation %p was not detected", p);
+    } else if(child_faults(kill_self_segv, p) == false) {
+        LOG("Failure: SIGSEGV sent with kill was swallowed by the sample pool handler");
+    } else {
+        LOG("Success: overflow and use after free of sampled allocation %p faulted", p);
+    }
+
+    free(p);
+}
+
+/* Every mapping made here dies right away */
+static void *map_short_lived(bool keep) {
+    void *ptr = mmap(0, ALLOC_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+    if(keep == false) {
+        munmap(ptr, ALLOC_SIZE);
+    }
+
+    return ptr;
+}
+
+static void *map_long_lived() {
+    return mmap(0, ALLOC_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+}
+
+void check_lifetime_test() {
+    extern mapguard_policy_t g_mapguard_policy;
+    mapguard_placement_report_t report;
+    void *ptrs[4];
+
+    /* Not exported by run_tests.sh, it replaces MG_RANDOMIZE_PLACEMENT */
+    g_mapguard_policy.lifetime_placement = 1;
+
+    for(int32_t i = 0; i < 4; i++) {
+        ptrs[i] = map_long_lived();
+    }
+
+    for(int32_t i = 0; i < 32; i++) {
+        map_short_lived(false);
+    }
+
+    void *ptr = map_short_lived(true);
+    mapguard_placement_report(&report);
+    mapguard_cache_entry_t *long_lived = get_cache_entry(ptrs[0]);
+    mapguard_cache_entry_t *short_lived = get_cache_entry(ptr);
+
+    if(long_lived == NULL || short_lived == NULL || long_lived->lifetime_key == short_lived->lifetime_key) {
+        LOG("Failure: mappings from different call sites share a lifetime key");
+    } else if(report.predictions == 0 || report.correct == 0) {
+        LOG("Failure: no lifetime was predicted correctly (%lu of %lu)", report.correct, report.predictions);
+    } else if(report.regions[MG_LIFETIME_SHORT].mappings == 0 || report.regions[MG_LIFETIME_LONG].mappings < 4) {
+        LOG("Failure: mappings were not segregated by lifetime");
+    } else {
+        LOG("Success: %lu of %lu lifetimes predicted, %lu vmas and %lu bytes of page tables", report.correct,
+            report.predictions, report.vmas, report.page_table_bytes);
+    }
+
+    munmap(ptr, ALLOC_SIZE);
+
+    for(int32_t i = 0; i < 4; i++) {
+        munmap(ptrs[i], ALLOC_SIZE);
+    }
+
+    g_mapguard_policy.lifetime_placement = 0;
+}
+
+/* Lifetime placed mappings are adjacent when there are no guard
+ * pages, but must not be coalesced or their deaths are never seen */
+void check_lifetime_coalesce_test() {
+    extern mapguard_policy_t g_mapguard_policy;
+    mapguard_policy_t saved = g_mapguard_policy;
+    mapguard_placement_report_t before, after;
+    void *ptrs[4];
+    bool separate = true;
+
+    g_mapguard_policy.lifetime_placement = 1;
+    g_mapguard_policy.coalesce_mappings = 1;
+    g_mapguard_policy.enable_guard_pages = 0;
+
+    mapguard_placement_report(&before);
+
+    for(int32_t i = 0; i < 4; i++) {
+        ptrs[i] = map_long_lived();
+    }
+
+    for(int32_t i = 0; i < 4; i++) {
+        mapguard_cache_entry_t *mce = get_cache_entry(ptrs[i]);
+        separate &= (entry_is(ptrs[i], ptrs[i], ALLOC_SIZE) && mce->lifetime_key != 0);
+    }
+
+    for(int32_t i = 0; i < 4; i++) {
+        munmap(ptrs[i], ALLOC_SIZE);
+    }
+
+    mapguard_placement_report(&after);
+    g_mapguard_policy = saved;
+
+    if(separate == false) {
+        LOG("Failure: lifetime placed mappings were coalesced");
+    } else if(after.predictions - before.predictions != 4) {
+        LOG("Failure: %lu of 4 lifetime placed mappings were scored when unmapped", after.predictions - before.predictions);
+    } else {
+        LOG("Success: lifetime placed mappings kept their keys with coalescing enabled");
+    }
+}
+
+void touch_page_below(uint8_t *p) {
+    *(volatile uint8_t *) (p - 1) = 0x41;
+}
+
+/* Returns true if the VmFlags of the mapping at p in
+ * /proc/self/smaps include flag */
+bool vma_has_flag(void *p, const char *flag) {
+    FILE *fp = fopen("/proc/self/smaps", "r");
+    char line[512];
+    bool found = false;
+    bool in_vma = false;
+
+    if(fp == NULL) {
+        return false;
+    }
+
+    while(found == false && fgets(line, sizeof(line), fp) != NULL) {
+        uintptr_t start, end;
+
+        if(sscanf(line, "%lx-%lx ", &start, &end) == 2 && strchr(line, '-') < strchr(line, ' ')) {
+            in_vma = ((uintptr_t) p >= start && (uintptr_t) p < end);
+        } else if(in_vma && strncmp(line, "VmFlags:", 8) == 0) {
+            for(char *f = strtok(line + 8, " \n"); f != NULL; f = strtok(NULL, " \n")) {
+                found |= (strcmp(f, flag) == 0);
+            }
+        }
+    }
+
+    fclose(fp);
+    return found;
+}
+
+void touch_page(uint8_t *p) {
+    *(volatile uint8_t *) p = 0x41;
+}
+
+/* Run with MG_METADATA_HUGE_PAGES=1 */
+void check_metadata_huge_pages_test() {
+    mapguard_stats_t stats;
+    mapguard_get_stats(&stats);
+
+    if(env_to_int(MG_METADATA_HUGE_PAGES) == 0) {
+        LOG("Success: MG_METADATA_HUGE_PAGES is not set, nothing to check");
+        return;
+    }
+
+    uint8_t *arena = (uint8_t *) ((uintptr_t) metadata_page_at(0) & ~((uintptr_t) MG_METADATA_ARENA_SIZE - 1));
+    bool thp = access("/sys/kernel/mm/transparent_hugepage/enabled", F_OK) == 0;
+
+    if(stats.metadata_arenas == 0) {
+        LOG("Failure: no metadata arena was mapped");
+    } else if(child_faults(touch_page_below, arena) == false) {
+        LOG("Failure: no guard page below metadata arena %p", arena);
+    } else if(child_faults(touch_page, arena + MG_METADATA_ARENA_SIZE) == false) {
+        LOG("Failure: no guard page above metadata arena %p", arena);
+    } else if(stats.metadata_arenas_hugetlb == 0 && thp && vma_has_flag(arena, "hg") == false) {
+        LOG("Failure: metadata arena %p is not hugetlb and was not advised MADV_HUGEPAGE", arena);
+    } else {
+        LOG("Success: %lu metadata arenas, %lu hugetlb, are guarded at their edges", stats.metadata_arenas, stats.metadata_arenas_hugetlb);
+    }
+}
+
+void check_madvise_batch_test() {
+    extern uint8_t g_guard_method;
+    extern mapguard_policy_t g_mapguard_policy;
+    mapguard_stats_t before, after;
+    uint8_t saved_method = g_guard_method;
+
+    /* The worker installs guard pages after mmap returns */
+    if((mapguard_probe_features() & MG_FEATURE_GUARD_INSTALL) == 0 || g_mapguard_policy.async_guard_pages) {
+        LOG("Success: guard pages are not installed by mmap, nothing to batch");
+        return;
+    }
+
+    /* Both guard pages of a mapping go in one batch */
+    g_guard_method = MG_GUARD_METHOD_MADVISE;
+    mapguard_get_stats(&before);
+    uint8_t *ptr = map_memory("Batched guards", PROT_READ | PROT_WRITE);
+    mapguard_get_stats(&after);
+    g_guard_method = saved_method;
+
+    if(ptr == MAP_FAILED) {
+        LOG("Failure: to map memory with batched guard pages");
+        return;
+    }
+
+    if(madvise_batch_available() && after.madvise_batched_ranges - before.madvise_batched_ranges != 2) {
+        LOG("Failure: %lu guard pages were batched instead of 2", after.madvise_batched_ranges - before.madvise_batched_ranges);
+    } else if(child_faults(touch_page_below, ptr) == false) {
+        LOG("Failure: batched guard page below %p is accessible", ptr);
+    } else {
+        LOG("Success: guard pages of %p installed in %lu batches", ptr, after.madvise_batches - before.madvise_batches);
+    }
+
+    unmap_memory(ptr);
+}
+
+void check_perf_counters_test() {
+    extern mapguard_policy_t g_mapguard_policy;
+    mapguard_stats_t before, after;
+    uint8_t saved = g_mapguard_policy.perf_counters;
+
+    g_mapguard_policy.perf_counters = 1;
+    mapguard_get_stats(&before);
+
+    uint8_t *ptr = map_memory("Perf counters", PROT_READ | PROT_WRITE);
+
+    if(ptr == MAP_FAILED) {
+        g_mapguard_policy.perf_counters = saved;
+        LOG("Failure: to map memory with perf counters");
+        return;
+    }
+
+    /* Poisoning faults in every page it writes */
+    poison_pages(ptr, 4096);
+    mapguard_get_stats(&after);
+    g_mapguard_policy.perf_counters = saved;
+
+    uint64_t faults = after.perf_scope_counts[MG_PERF_SCOPE_POISON][MG_PERF_EVENT_PAGE_FAULTS] -
+                      before.perf_scope_counts[MG_PERF_SCOPE_POISON][MG_PERF_EVENT_PAGE_FAULTS];
+
+    if((after.perf_events & (1 << MG_PERF_EVENT_PAGE_FAULTS)) == 0) {
+        LOG("Success: page fault counter is not available here");
+    } else if(faults == 0) {
+        LOG("Failure: no page faults were attributed to poisoning %p", ptr);
+    } else {
+        LOG("Success: %lu page faults attributed to poisoning %p", faults, ptr);
+    }
+
+    unmap_memory(ptr);
+}
+
+/* Toggles MG_ASYNC_GUARD_PAGES at runtime, so it must run after
+ * every test whose forked children call into the hooks */
+void check_async_guard_test() {
+    extern mapguard_policy_t g_mapguard_policy;
+    mapguard_stats_t before, after;
+    uint8_t *ptrs[8];
+    uint8_t saved = g_mapguard_policy.async_guard_pages;
+
+    g_mapguard_policy.async_guard_pages = 1;
+    mapguard_get_stats(&before);
+
+    /* The first mapping starts the worker, the rest are queued */
+    for(int32_t i = 0; i < 8; i++) {
+        ptrs[i] = map_memory("Async guards", PROT_READ | PROT_WRITE);
+
+        if(ptrs[i] == MAP_FAILED) {
+            g_mapguard_policy.async_guard_pages = saved;
+            LOG("Failure: to map memory with async guard pages");
+            return;
+        }
+    }
+
+    bool installed = false;
+
+    for(int32_t tries = 0; tries < 1000 && installed == false; tries++) {
+        installed = true;
+
+        for(int32_t i = 0; i < 8; i++) {
+            mapguard_cache_entry_t *mce = get_cache_entry(ptrs[i]);
+            installed &= (mce != NULL && mce->guarded_b == MG_GUARD_INSTALLED && mce->guarded_t == MG_GUARD_INSTALLED);
+        }
+
+        if(installed == false) {
+            usleep(1000);
+        }
+    }
+
+    mapguard_get_stats(&after);
+    g_mapguard_policy.async_guard_pages = saved;
+
+    uint64_t installs = (after.guard_installs_async + after.guard_installs_sync) - (before.guard_installs_async + before.guard_installs_sync);
+
+    if(installed == false) {
+        LOG("Failure: pending guard pages were never installed");
+    } else if(installs < 8 || after.guard_installs_async == before.guard_installs_async) {
+        LOG("Failure: %lu guard installs, %lu of them by the worker", installs, after.guard_installs_async - before.guard_installs_async);
+    } else if(child_faults(touch_page_below, ptrs[7]) == false) {
+        LOG("Failure: async guard page below %p is accessible", ptrs[7]);
+    } else {
+        LOG("Success: the worker installed guard pages for %lu mappings, queue depth peaked at %lu", after.guard_installs_async - before.guard_installs_async,
+            after.guard_queue_max_depth);
+    }
+
+    for(int32_t i = 0; i < 8; i++) {
+        unmap_memory(ptrs[i]);
+    }
+}
+
+/* Unmaps the bottom page of mappings whose guard pages are still
+ * queued. The remaining range must end up with both guards */
+void check_async_guard_partial_unmap_test() {
+    extern mapguard_policy_t g_mapguard_policy;
+    uint8_t saved = g_mapguard_policy.async_guard_pages;
+    int32_t pending = 0;
+    bool guarded = true;
+
+    g_mapguard_policy.async_guard_pages = 1;
+
+    for(int32_t i = 0; i < 1000 && guarded && pending < 8; i++) {
+        uint8_t *ptr = map_memory("Async partial unmap", PROT_READ | PROT_WRITE);
+
+        if(ptr == MAP_FAILED) {
+            g_mapguard_policy.async_guard_pages = saved;
+            LOG("Failure: to map memory with async guard pages");
+            return;
+        }
+
+        mapguard_cache_entry_t *mce = get_cache_entry(ptr);
+        bool was_pending = (mce != NULL && mce->guarded_t == MG_GUARD_PENDING);
+
+        munmap(ptr, 4096);
+        mce = get_cache_entry(ptr + 4096);
+
+        if(mce == NULL || mce->guarded_b != MG_GUARD_INSTALLED || mce->guarded_t != MG_GUARD_INSTALLED) {
+            guarded = false;
+        } else if(was_pending) {
+            pending++;
+            guarded = child_faults(touch_page, ptr + ALLOC_SIZE) && child_faults(touch_page_below, ptr + 4096);
+        }
+
+        munmap(ptr + 4096, ALLOC_SIZE - 4096);
+    }
+
+    g_mapguard_policy.async_guard_pages = saved;
+
+    if(guarded == false) {
+        LOG("Failure: guard pages were lost after a partial munmap of a pending mapping");
+    } else if(pending == 0) {
+        LOG("Failure: no mapping was still pending when it was unmapped");
+    } else {
+        LOG("Success: %d partial munmaps of pending mappings kept both guard pages", pending);
+    }
+}
+
+void check_fake_kernel_test() {
+    void *ptrs[1000];
+
+    mapguard_fake_kernel_enable();
+
+    /* File mappings stay on the real kernel */
+    int fd = open("/proc/self/exe", O_RDONLY);
+    char *file = (fd != -1) ? mmap(NULL, g_page_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+
+    if(fd != -1) {
+        close(fd);
+    }
+
+    if(file == MAP_FAILED || memcmp(file, "\x7f" "ELF", 4) != 0) {
+        LOG("Failure: file mapping %p is not backed while the fake kernel is enabled", file);
+    } else {
+        LOG("Success: file mapping %p is backed while the fake kernel is enabled", file);
+        munmap(file, g_page_size);
+    }
+
+    for(int32_t i = 0; i < 1000; i++) {
+        ptrs[i] = map_memory("Fake", PROT_READ | PROT_WRITE);
+
+        if(ptrs[i] == MAP_FAILED) {
+            LOG("Failure: to map fake kernel memory");
+            return;
+        }
+    }
+
+    if(mapguard_fake_kernel_vma_count() < 1000) {
+        LOG("Failure: fake kernel is tracking %zu VMAs", mapguard_fake_kernel_vma_count());
+    }
+
+    ptrs[0] = remap_memory_test("Fake", ptrs[0]);
+    munmap(ptrs[0], ALLOC_SIZE * 2);
+
+    for(int32_t i = 1; i < 1000; i++) {
+        unmap_memory(ptrs[i]);
+    }
+
+    if(mapguard_fake_kernel_vma_count() != 0) {
+        LOG("Failure: fake kernel leaked %zu VMAs", mapguard_fake_kernel_vma_count());
+    } else {
+        LOG("Success: fake kernel mapped and unmapped 1000 mappings");
+    }
+
+    ptrs[0] = map_memory("Fake", PROT_READ | PROT_WRITE);
+    mapguard_fake_kernel_disable();
+
+    if(get_cache_entry(ptrs[0]) != NULL) {
+        LOG("Failure: fake mapping %p is still tracked after disabling the fake kernel", ptrs[0]);
+    }
+
+    char *p = map_memory("Real", PROT_READ | PROT_WRITE);
+
+    if(p == MAP_FAILED) {
+        LOG("Failure: to map memory after disabling the fake kernel");
+        return;
+    }
+
+    p[0] = 'A';
+    LOG("Success: mapping %p is backed after disabling the fake kernel", p);
+    unmap_memory(p);
+}
+
 #if MPK_SUPPORT
 void check_mpk_xom_test() {
     char *x86_nops_cc = "\x90\x90\x90\x90\xcc";
@@ -220,6 +1235,40 @@ void check_protect_mapping_test() {
 
     unmap_memory(ptr);
 }
+
+void write_jit_unscoped(uint8_t *p) {
+    p[1] = 0xc3;
+}
+
+void check_jit_test() {
+    uint8_t *p = mapguard_jit_alloc(64);
+
+    if(p == NULL) {
+        LOG("Failure: to allocate JIT memory");
+        return;
+    }
+
+    mapguard_jit_write_begin();
+    /* ret */
+    p[0] = 0xc3;
+    mapguard_jit_write_end();
+
+#if __x86_64__
+    ((void (*)(void)) p)();
+#endif
+
+    if(child_faults(write_jit_unscoped, p) == false) {
+        LOG("Failure: JIT memory %p is writable outside of a write scope", p);
+    } else if(mprotect(p, getpagesize(), PROT_READ | PROT_EXEC) == 0) {
+        LOG("Failure: mprotect of JIT memory %p was allowed", p);
+    } else if(munmap(p, getpagesize()) == 0 || errno != EACCES) {
+        LOG("Failure: munmap of JIT memory %p was allowed", p);
+    } else {
+        LOG("Success: JIT memory %p is only writable in a write scope", p);
+    }
+
+    mapguard_jit_free(p);
+}
 #endif
 
 int main(int argc, char *argv[]) {
@@ -229,6 +1278,31 @@ int main(int argc, char *argv[]) {
     map_rw_then_x_memory_test();
 #endif
     map_then_mremap_test();
+    check_randomized_placement_test();
+    check_snapshot_test();
+    check_dump_test();
+    check_dump_savings_test();
+    check_calibration_test();
+    check_zero_length_test();
+    check_metadata_directory_test();
+    check_metadata_huge_pages_test();
+    check_profile_test();
+    check_verify_test();
+    check_numa_test();
+    check_file_mapping_test();
+    check_fd_reuse_test();
+    check_secret_test();
+#if SAMPLE_MALLOC_SUPPORT
+    check_sample_malloc_test();
+#endif
+    check_lifetime_test();
+    check_lifetime_coalesce_test();
+    check_madvise_batch_test();
+    check_perf_counters_test();
+    check_async_guard_test();
+    check_async_guard_partial_unmap_test();
+    check_coalesce_test();
+    check_fake_kernel_test();
 #if 0
     map_static_address_test();
     check_poison_bytes_test();
@@ -240,6 +1314,7 @@ int main(int argc, char *argv[]) {
 #if MPK_SUPPORT
     // check_mpk_xom_test();
     check_protect_mapping_test();
+    check_jit_test();
     protect_code();
     unprotect_code();
 #endif